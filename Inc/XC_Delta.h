@@ -0,0 +1,49 @@
+/*=============================================================================
+	XC_Delta.h:
+	Binary delta between two versions of a package
+=============================================================================*/
+
+#ifndef _INC_XC_DELTA
+#define _INC_XC_DELTA
+
+//
+// Delta file
+// Layout: header, then a classic LZMA stream (props + size + data) of the command list.
+// Command: literal count, literal bytes, copy offset relative to the end of the previous copy, copy count.
+//
+#define DELTA_MAGIC     0x544C4458 //XDLT
+#define DELTA_VERSION   1
+#define DELTA_EXTENSION TEXT(".xdl")
+
+struct FDeltaHeader
+{
+	DWORD Magic;
+	INT   Version;
+	FGuid BaseGuid;
+	INT   BaseSize;
+	DWORD BaseCrc;
+	INT   TargetSize;
+	DWORD TargetCrc;
+
+	FDeltaHeader()
+		: Magic(DELTA_MAGIC), Version(DELTA_VERSION), BaseGuid(0,0,0,0), BaseSize(0), BaseCrc(0), TargetSize(0), TargetCrc(0)
+	{}
+
+	friend FArchive& operator<<( FArchive& Ar, FDeltaHeader& H)
+	{
+		return Ar << H.Magic << H.Version << H.BaseGuid << H.BaseSize << H.BaseCrc << H.TargetSize << H.TargetCrc;
+	}
+};
+
+XC_CORE_API void  DeltaDiff( const BYTE* Base, INT BaseSize, const BYTE* Target, INT TargetSize, TArray<BYTE>& Commands);
+XC_CORE_API UBOOL DeltaPatch( const BYTE* Base, INT BaseSize, const BYTE* Commands, INT CommandSize, BYTE* Target, INT TargetSize);
+XC_CORE_API UBOOL DeltaIsPatch( const BYTE* Data, INT Count);
+
+// Decodes a delta file and applies it to Base, see XC_LZMA.cpp
+XC_CORE_API UBOOL DeltaApply( const TCHAR* Src, const TCHAR* Base, const TCHAR* Dest, TCHAR* Error); //Define at least 128 chars for Error
+
+
+#endif
+/*-----------------------------------------------------------------------------
+	The End.
+-----------------------------------------------------------------------------*/
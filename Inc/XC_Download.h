@@ -5,20 +5,62 @@
 #ifndef _INC_XC_DL
 #define _INC_XC_DL
 
-#include "Cacus/CacusThread.h"
+#include "XC_JobQueue.h"
+
+// Capabilities a client appends to its file request
+enum EXCDownloadFlags
+{
+	XCDL_MultiBlock = 0x00000001, //Understands multi-block LZMA containers
+	XCDL_Resume     = 0x00000002, //Request carries a resume offset, expects a control header
+	XCDL_Delta      = 0x00000004, //Request carries the GUID of an older version in the cache
+	XCDL_Hash       = 0x00000008, //Wants the package hash in the control header
+	XCDL_ResumeHash = 0x00000010, //Resume offset is followed by the package hash of the partial file
+};
+
+// Control header sent before file data to clients with XCDL_Resume: Magic, Offset, StreamSize
+// Followed by the CRC32C of the package (zero if unknown) for clients with XCDL_Hash
+#define XCDL_HEADER_MAGIC 0x48445858
+#define XCDL_HEADER_SIZE  12
+#define XCDL_HEADER_HASH_SIZE 16
+
+//
+// Partial download kept in DownloadTemp, described by a sidecar file
+//
+struct FDownloadResumeInfo
+{
+	INT     Offset;     //Bytes already in temp file
+	INT     StreamSize; //Size of the stream the server is sending
+	DWORD   Hash;       //Package CRC32C from the control header, never resumed without it
+	BYTE    IsCompressed;
+	BYTE    IsLZMA;
+	FString TempFilename;
+};
 
 class XC_CORE_API UXC_Download : public UDownload
 {
 	DECLARE_ABSTRACT_CLASS(UXC_Download,UDownload,CLASS_Transient|CLASS_Config,XC_Core);
 
 	UBOOL EnableLZMA;
+	INT MaxConcurrentDownloads; //Packages fetched at once, 1 disables prefetching
+
+	BYTE IsLZMA; //1 classic stream, 2 multi-block container, 3 delta
+	UBOOL bPrefetch; //Background download the engine doesn't know about
+	UBOOL bAdopted;  //Engine download waiting for a background download of the same package
 
-	BYTE IsLZMA;
+	FDownloadResumeInfo Resume;
+	UBOOL bCanResume; //Server sent a control header
+	UBOOL bResuming;  //Server accepted our resume offset
+
+	FGuid DeltaBase;  //Cached version offered to the server
+	UBOOL bNoDelta;   //Delta failed to apply, get the full file
+
+	DWORD PackageHash;  //CRC32C sent by the server, zero if unknown
+	DWORD ReceivedHash; //CRC32C of uncompressed data received so far
 
 	int32 OldTransfered;
-	volatile int32 AsyncAction; //Worker thread in progress
-	volatile int32 Finished; //Destroy this channel on main thread
-	static volatile int32 GlobalLock; //Prevents destruction of download managers
+	class FDownloadStream* Stream; //Decodes while receiving, replaces temp file
+	UBOOL AsyncAction; //Job in download worker pool
+	UBOOL Finished; //Destroy this channel on main thread
 
 	static FString NetSizeError;
 	static FString NetOpenError;
@@ -38,6 +80,12 @@ class XC_CORE_API UXC_Download : public UDownload
 	void Tick();
 	void DownloadDone();
 	void ReceiveData( BYTE* Data, INT Count );
+
+	// UXC_Download interface
+	virtual void OpenTransfer() {}
+	void LoadResume();
+	void SaveResume();
+	void DeleteResume();
 };
 
 class XC_CORE_API UXC_ChannelDownload : public UXC_Download
@@ -58,6 +106,9 @@ class XC_CORE_API UXC_ChannelDownload : public UXC_Download
 	// UDownload Interface.
 	void ReceiveFile( UNetConnection* InConnection, INT PackageIndex, const TCHAR *Params=NULL, UBOOL InCompression=0 );
 	UBOOL TrySkipFile();
+
+	// UXC_Download interface
+	void OpenTransfer();
 };
 
 //
@@ -71,6 +122,17 @@ class XC_CORE_API UXC_FileChannel : public UFileChannel
 	static class ULZMAServer* GLZMA;
 	FGuid LZMA_PendingGuid;
 	FTime LZMA_Timeout;
+	DWORD ClientFlags;
+	INT ResumeOffset; //Requested by client
+	INT ResumeSize;   //Stream size the client's partial file belongs to
+	DWORD ResumeHash; //Package hash the client's partial file belongs to
+	FGuid DeltaBaseGuid; //Version the client has cached
+	FTime DeltaTimeout;
+	DWORD SendHash;      //Of the package being sent
+
+	// Send buffers
+	class FArchiveView* SendFileView; // SendFileAr if it can be read without copying
+	TArray<BYTE> SendScratch;         // Reused by bunches from other readers
 
 
 	// Receive Variables.
@@ -99,21 +161,42 @@ class XC_CORE_API UXC_FileChannel : public UFileChannel
 //	FString Describe();
 	void Tick();
 	UBOOL ProcessGuid( const FGuid& Guid, UBOOL UseGLZMA);
+	void SendControlHeader();
+	INT SendChunk( INT Limit); //Returns bytes sent
 };
 
 
-class XC_CORE_API FDownloadAsyncProcessor : public CThread
+//
+// Work done by the shared download worker pool on behalf of a download
+// Jobs never touch their download, results are handed over on the main
+// thread by ClaimFinished (called from UXC_Download::Tick).
+//
+class XC_CORE_API FDownloadAsyncProcessor : public FAsyncJob
 {
 public:
-	typedef void (*ASYNC_PROC)(FDownloadAsyncProcessor*);
-
-	UXC_Download* Download;
 	int32 DownloadTag;
-	ASYNC_PROC Proc;
+	TCHAR Error[256];
+
+	FDownloadAsyncProcessor( UXC_Download* InDownload);
 
-	FDownloadAsyncProcessor( const ASYNC_PROC InProc, UXC_Download* InDownload);
+	// Main thread, download is still alive
+	virtual void Finish( UXC_Download* Download);
 
-	bool DownloadActive();
+	static void Queue( FDownloadAsyncProcessor* Job);
+	static UBOOL CanQueueStream();
+	static void QueueStream( FDownloadAsyncProcessor* Job); //Runs for the whole transfer
+	static void ClaimFinished();
+};
+
+//
+// Simulated clients downloading from the file channel over an in-process loopback
+//
+class XC_CORE_API UFileTransferLoadTestCommandlet : public UCommandlet
+{
+	DECLARE_CLASS(UFileTransferLoadTestCommandlet,UCommandlet,CLASS_Transient,XC_Core);
+	NO_DEFAULT_CONSTRUCTOR(UFileTransferLoadTestCommandlet)
+	void StaticConstructor();
+	INT Main( const TCHAR* Parms );
 };
 
 
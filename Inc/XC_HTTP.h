@@ -0,0 +1,58 @@
+/*=============================================================================
+	XC_HTTP.h:
+	HTTP redirect server serving the LZMA server's compressed files
+=============================================================================*/
+
+#ifndef _INC_XC_HTTP
+#define _INC_XC_HTTP
+
+#include "XC_JobQueue.h"
+
+class FHttpServerJob;
+struct FHttpRequest;
+
+//
+// HTTP/1.1 server for clients redirected to this game server
+// GET/HEAD <Package filename or GUID>.lzma|.uz, query and directories are ignored.
+//
+// Sockets are handled by an event loop thread with a bounded number of
+// connections, requests are resolved against ULZMAServer's sources on the
+// main thread by Tick() and sent from memory or straight from the file
+// (sendfile on Linux, reader threads elsewhere).
+//
+class XC_CORE_API FHttpRedirectServer
+{
+public:
+	FHttpRedirectServer();
+	~FHttpRedirectServer();
+
+	UBOOL Listen( INT InPort, INT MaxConnections, FString& Error); //Port 0 picks a free one
+	void  Stop();
+	void  Tick( class ULZMAServer* Server); //Answers requests received since last tick
+	void  GetStats( INT& Connections, INT& Requests, INT& KBSent);
+	INT   GetPort() const { return Port; }
+
+protected:
+	INT Port;
+	FAsyncJobQueue* Queue;
+	FHttpServerJob* Job; //Owned by Queue
+	TArray<FHttpRequest*> Waiting; //For sources being compressed
+	FTime LastRetry;
+};
+
+//
+// Fetches packages from a redirect server on localhost
+//
+class XC_CORE_API UHttpRedirectTestCommandlet : public UCommandlet
+{
+	DECLARE_CLASS(UHttpRedirectTestCommandlet,UCommandlet,CLASS_Transient,XC_Core);
+	NO_DEFAULT_CONSTRUCTOR(UHttpRedirectTestCommandlet)
+	void StaticConstructor();
+	INT Main( const TCHAR* Parms );
+};
+
+
+#endif
+/*-----------------------------------------------------------------------------
+	The End.
+-----------------------------------------------------------------------------*/
@@ -0,0 +1,48 @@
+/*=============================================================================
+	XC_Hash.h:
+	Fast integrity hash of packages
+=============================================================================*/
+
+#ifndef _INC_XC_HASH
+#define _INC_XC_HASH
+
+//
+// CRC32C (Castagnoli polynomial)
+// Uses the SSE4.2 instruction when the CPU has it, table driven otherwise.
+// Can be computed in pieces by passing the previous result as Crc.
+//
+XC_CORE_API DWORD Crc32C( const void* Data, INT Count, DWORD Crc=0);
+XC_CORE_API UBOOL Crc32CArchive( FArchive& Ar, INT Count, DWORD& Crc); //Reads Count bytes from current position
+XC_CORE_API UBOOL Crc32CFile( const TCHAR* Filename, DWORD& Crc, INT Count=MAXINT); //First Count bytes
+
+//
+// Hashes everything written to another archive
+//
+class FCrc32CWriter : public FArchive
+{
+public:
+	FArchive& Ar;
+	DWORD     Crc;
+
+	FCrc32CWriter( FArchive& InAr)
+		: Ar(InAr)
+		, Crc(0)
+	{
+		ArIsSaving = 1;
+	}
+	void Serialize( void* V, INT Length)
+	{
+		Crc = Crc32C( V, Length, Crc);
+		Ar.Serialize( V, Length);
+		if ( Ar.IsError() )
+			ArIsError = 1;
+	}
+	INT Tell()      { return Ar.Tell(); }
+	INT TotalSize() { return Ar.TotalSize(); }
+};
+
+
+#endif
+/*-----------------------------------------------------------------------------
+	The End.
+-----------------------------------------------------------------------------*/
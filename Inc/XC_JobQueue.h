@@ -0,0 +1,107 @@
+/*=============================================================================
+	XC_JobQueue.h:
+	Prioritized worker thread pool for XC_Core asynchronous tasks
+=============================================================================*/
+
+#ifndef _INC_XC_JOBQUEUE
+#define _INC_XC_JOBQUEUE
+
+#include "Cacus/CacusThread.h"
+#include "Cacus/Atomics.h"
+
+//
+// Counted wake-up signal, each Signal() releases one Wait() now or later
+//
+class XC_CORE_API FAsyncEvent
+{
+public:
+	FAsyncEvent();
+	~FAsyncEvent();
+
+	void  Signal( INT Count=1);
+	UBOOL Wait( FLOAT Seconds); //False if timed out
+
+private:
+	void* Handle;
+};
+
+enum EAsyncJobStatus
+{
+	ASYNCJOB_Queued,
+	ASYNCJOB_Running,
+	ASYNCJOB_Finished,
+};
+
+//
+// Unit of work for a FAsyncJobQueue
+// Jobs must be self-contained, Run() cannot touch objects owned by the main thread.
+//
+class XC_CORE_API FAsyncJob
+{
+public:
+	INT            Priority;
+	volatile int32 Status;
+	volatile int32 Cancelled; // Set when the owner no longer wants the result, long jobs should poll this.
+
+	FAsyncJob( INT InPriority=0)
+		: Priority(InPriority)
+		, Status(ASYNCJOB_Queued)
+		, Cancelled(0)
+	{}
+	virtual ~FAsyncJob() {}
+
+	// Called on a worker thread
+	virtual void Run()=0;
+
+	UBOOL IsFinished() const { return Status == ASYNCJOB_Finished; }
+};
+
+//
+// Worker threads are spawned on demand (up to MaxThreads), sleep on an event while there's
+// nothing to do and exit after being idle for a while.
+// The queue owns all jobs until they're claimed via GetFinished().
+// Never delete a queue, call Release() instead, the last worker thread will delete it.
+//
+class XC_CORE_API FAsyncJobQueue
+{
+public:
+	FAsyncJobQueue( INT InMaxThreads=1);
+
+	// Main thread interface
+	void       Add( FAsyncJob* Job);
+	FAsyncJob* GetFinished();
+	void       SetMaxThreads( INT InMaxThreads);
+	INT        NumPending();
+	INT        NumActive(); // Queued + running
+	void       SetFinishedEvent( FAsyncEvent* Event); // Signalled once per finished job until Release()
+	void       Release();
+
+protected:
+	// All counters and lists are only accessed while holding Lock
+	volatile int32 Lock;
+	volatile int32 SpawnLock;
+	INT RefCount; // Owner + worker threads
+	INT bExit;
+	INT NumThreads;
+	INT NumIdle;
+	INT MaxThreads;
+	TArray<FAsyncJob*> Pending; // Sorted by priority
+	TArray<FAsyncJob*> Running;
+	TArray<FAsyncJob*> Finished;
+	FAsyncEvent WakeUp; // Signalled once per queued job
+	FAsyncEvent* FinishedEvent; // Owner's, jobs are in Finished by the time it's signalled
+
+	~FAsyncJobQueue();
+
+	FAsyncJob* PopPending();
+	INT        ReserveWorkers(); // Lock must be held, returns threads to spawn once it's released
+	void       SpawnWorkers( INT Count);
+	void       DecRef();
+	static uint32 WorkerProc( void* Arg, CThread* Handler);
+};
+
+
+#endif
+/*-----------------------------------------------------------------------------
+	The End.
+-----------------------------------------------------------------------------*/
@@ -3,14 +3,95 @@
 =============================================================================*/
 
 #include "XC_CoreGlobals.h"
-#include "Cacus/Atomics.h"
+#include "XC_JobQueue.h"
 #define COMPRESSED_EXTENSION TEXT(".lzma")
 #undef GetCompressedFileSize
 
+// Hash key for GUID indexed tables
+inline DWORD GetGuidHash( const FGuid& Guid)
+{
+	return Guid.A ^ Guid.B ^ Guid.C ^ Guid.D;
+}
+
+//
+// LZMA encoder settings
+//
+struct FLZMAParams
+{
+	INT Level;
+	INT DictSize;
+	INT lc;
+	INT lp;
+	INT pb;
+	INT fb;
+	INT NumThreads; //1 or 2
+
+	FLZMAParams()
+		: Level(5), DictSize(1<<22), lc(3), lp(0), pb(2), fb(32), NumThreads(1)
+	{}
+};
+
+//
+// Settings picked by package extension and size
+// Loaded from [Profiles] in LzmaCache.ini, first matching profile is used.
+//
+struct FLZMAProfile
+{
+	FString     Name;
+	FString     Extensions; //Separated by ';', empty matches all
+	INT         MinMegs;
+	INT         MaxMegs;    //0 means no limit
+	FLZMAParams Params;
+};
+
+XC_CORE_API TArray<FLZMAProfile>& LzmaGetProfiles(); //Loads profiles on first call, do it from the main thread
+XC_CORE_API FLZMAParams LzmaGetParams( const TCHAR* Filename, INT FileSize);
+
 XC_CORE_API UBOOL LzmaCompress( const TCHAR* Src, const TCHAR* Dest, TCHAR* Error); //Define at least 128 chars for Error
+XC_CORE_API UBOOL LzmaCompress( const TCHAR* Src, const TCHAR* Dest, TCHAR* Error, const FLZMAParams& Params);
 XC_CORE_API UBOOL LzmaDecompress( const TCHAR* Src, const TCHAR* Dest, TCHAR* Error); 
 XC_CORE_API UBOOL LzmaDecompress( FArchive* SrcFile, const TCHAR* Dest, TCHAR* Error); //OLDVER
 
+//
+// Multi-block container
+// Sequence of independently compressed classic LZMA streams with a block index, blocks
+// can be compressed and decoded in parallel.
+// Layout: Magic, Version, UnpackSize (QWORD), BlockSize, NumBlocks, compressed size of each block, blocks.
+//
+#define LZMA_CONTAINER_MAGIC     0x424D4358 //XCMB
+#define LZMA_CONTAINER_VERSION   1
+#define LZMA_CONTAINER_BLOCK     (4*1024*1024)
+#define LZMA_CONTAINER_EXTENSION TEXT(".xcb")
+
+XC_CORE_API UBOOL LzmaIsContainer( const BYTE* Data, INT Count);
+XC_CORE_API UBOOL LzmaDecompressContainer( const TCHAR* Src, const TCHAR* Dest, TCHAR* Error, INT Threads=4);
+
+//
+// Incremental LZMA decoder
+// Decoded data is written to an archive as compressed data is fed, memory use is bounded
+// by the dictionary size regardless of package size.
+// Requires a LZMA library exporting the SDK decoder (LzmaDec_*), see IsAvailable()
+//
+class XC_CORE_API FLZMADecoder
+{
+public:
+	QWORD UnpackSize;
+	QWORD Decoded;
+
+	FLZMADecoder();
+	~FLZMADecoder();
+
+	static UBOOL IsAvailable();
+	static const TCHAR* GetUnavailableReason(); //Why IsAvailable() failed
+	UBOOL Init( const BYTE* Header, TCHAR* Error); //Classic header: 5 byte props + 8 byte size
+	UBOOL Decode( const BYTE* Data, INT Count, FArchive& Dest, TCHAR* Error);
+	UBOOL IsFinished() const { return Decoded >= UnpackSize; }
+
+private:
+	void* State;
+	BYTE* OutBuffer;
+};
+
 class XC_CORE_API ULZMACompressCommandlet : public UCommandlet
 {
 	DECLARE_CLASS(ULZMACompressCommandlet,UCommandlet,CLASS_Transient,XC_Core);
@@ -38,6 +119,18 @@ enum ECompressedSourceState
 	CS_STATE_NoSource
 };
 
+//
+// Reader of contiguous memory, data can be accessed without copying
+//
+class FArchiveView : public FArchive
+{
+public:
+	// Returns Count bytes at current position and advances, null if not enough data
+	virtual const BYTE* ReadView( INT Count)=0;
+	// False while data is still being produced, TotalSize() grows until then
+	virtual UBOOL IsComplete() { return 1; }
+};
+
 class FLZMASourceBase
 {
 public:
@@ -47,21 +140,142 @@ public:
 	INT     CompressedSize;
 	ECompressedSourceState State;
 	INT     Priority;
-	INT     ActiveRequests;
+	class FLZMARequestCounter* Requests; //Shared with readers, outlives the source
+	FTime   LastServed;
+	INT     Hits;
+	FString ContainerFile; //Multi-block version in file cache
+	INT     ContainerSize; //Zero while being built
+	DWORD   Hash; //CRC32C of the package, zero if unknown
+	UBOOL   bSpillFailed; //Couldn't be written to file cache, stays in memory
+	class FLZMALiveData* Live; //Output published by the compressor while it runs
 
 	FLZMASourceBase( const FPackageInfo& Info);
-	virtual ~FLZMASourceBase()	{}
+	FLZMASourceBase( const FLZMASourceBase& Other); //Shares Requests
+	virtual ~FLZMASourceBase();
 
 	virtual FArchive* CreateReader()=0;
+	virtual FArchiveView* CreateView()        { return nullptr; } //Only if data is in memory
 	virtual void*     GetMemory()             { return nullptr;}
 	virtual INT       GetMemorySize()         { return 0; };
 	virtual FString   GetCompressedFile()     { return TEXT(""); }
 	virtual INT       GetCompressedFileSize() { return 0; };
+	virtual class FLZMASharedData* GetSharedData() { return nullptr; } //Memory shared with readers
+
+	INT ActiveRequests();
+	FArchive* CreateContainerReader();
+	FArchiveView* CreateLiveReader();
+};
+
+//
+// LZMA file cache descriptor
+// Loaded once and kept indexed in memory, changes are appended to the
+// manifest file and compacted into a new one every now and then.
+//
+struct FLZMACacheEntry
+{
+	FString SourceFile;
+	INT     SourceTime;
+	INT     SourceSize;
+	FGuid   Guid;
+	FString CmpFile;
+	INT     CmpSize;
+	INT     LastAccess;
+	DWORD   Hash; //CRC32C of source, zero in entries from older versions
+
+	friend FArchive& operator<<( FArchive& Ar, FLZMACacheEntry& Entry);
+};
+
+class XC_CORE_API FLZMACacheManifest
+{
+public:
+	TArray<FLZMACacheEntry> Entries; //Removed entries have no CmpFile
+
+	FLZMACacheManifest( const TCHAR* InFilename);
+
+	UBOOL Load();
+	UBOOL Save();
+
+	void Add( const FLZMACacheEntry& Entry);
+	void Remove( const TCHAR* CmpFile);
+	void Touch( INT i, INT Time);
+
+	INT FindBySource( const TCHAR* SourceFile);
+	INT FindByCmpFile( const TCHAR* CmpFile);
+	INT Num();
+
+	static UBOOL GetFileStamp( const TCHAR* Filename, INT& Time, INT& Size);
+	static INT Now();
+
+protected:
+	FString Filename;
+	INT Appended; //Records since last compaction
+	TMap<FString,INT> SourceMap;
+	TMap<FString,INT> CmpMap;
+
+	UBOOL LoadFile( const TCHAR* InFilename);
+	void Empty();
+	INT  SetEntry( const FLZMACacheEntry& Entry);
+	void RemoveEntry( INT i);
+	void AppendRecord( BYTE Op, TArray<BYTE>& Payload);
+	void WriteRecord( FArchive& Ar, BYTE Op, TArray<BYTE>& Payload);
+};
+
+//
+// Upload scheduler settings, shared by all file channels
+// Connections get equal shares of the budget, the ones downloading the level get LevelWeight shares.
+//
+struct FFileSendSettings
+{
+	INT   MaxBytesPerSecond; //0 means unlimited
+	INT   LevelWeight;
+	INT   Quantum;           //Bytes per share and round
+
+	// Stats
+	INT   ActiveConnections;
+	INT   ActiveChannels;
+	QWORD TotalSent;
+};
+extern XC_CORE_API FFileSendSettings GFileSendSettings;
+
+//
+// Compressed file handed over to another thread, see ULZMAServer::ExportSource
+// Memory sources are shared without copying, file sources are opened by the receiver.
+//
+struct XC_CORE_API FLZMAExport
+{
+	class FLZMASharedData* Shared;
+	const BYTE* Data;
+	INT         Size;
+	FString     Filename; //If there's no Data
+
+	FLZMAExport()
+		: Shared(nullptr), Data(nullptr), Size(0)
+	{}
+	void Release(); //Any thread
+};
+
+enum ELZMAExportResult
+{
+	LZMAEXPORT_NotFound,
+	LZMAEXPORT_Pending, //Being compressed
+	LZMAEXPORT_Ready
 };
 
 //
 // LZMA file subsystem
 //
+class FLZMACompressJob;
+class FLZMASpillJob;
+class FLZMABlockJob;
+class FLZMADeltaJob;
+
+enum EDeltaState
+{
+	DELTA_None,    //No base or not worth it, send the full file
+	DELTA_Pending, //Being built
+	DELTA_Ready
+};
+
 class XC_CORE_API ULZMAServer : public USubsystem
 {
 	DECLARE_CLASS(ULZMAServer,USubsystem,CLASS_Transient,XC_Core);
@@ -69,25 +283,43 @@ class XC_CORE_API ULZMAServer : public USubsystem
 
 	// Internal
 	TArray<FLZMASourceBase*> Sources;
-	void* ThreadPtr;
-	CAtomicLock    AsyncLock;
-	volatile INT   AsyncSource; // Main thread uses this as directive for worker.
-	void*          AsyncCompressedData;
-	size_t         AsyncCompressedSize;
-	FArchive*      AsyncReader;
-	volatile INT*  AsyncKey; // Worker thread uses this to verify Main still available.
+	TMultiMap<DWORD,FLZMASourceBase*> SourceMap; //GUID index of Sources
+	TMultiMap<FString,FLZMASourceBase*> SourceNameMap; //Package filename (no path) index of Sources
+	FAsyncJobQueue* Compressor;
+	FAsyncJobQueue* Spiller;
+	TArray<FLZMASourceBase*> Spilling; //Memory sources being written to the file cache
+	TArray<FLZMASpillJob*> FinishedSpills; //Written, waiting for readers to finish
+	FAsyncJobQueue* BlockCompressor;
+	FAsyncJobQueue* DeltaCompressor;
+	TArray<FString> DeltaPending; //Delta files being built
+	TMap<FString,INT> DeltaFailed; //Not smaller than the compressed package, not retried (keyed by delta file)
+	FLZMACacheManifest* Manifest;
+	class FHttpRedirectServer* HttpServer;
 
 	// Status
 	UBOOL bPendingRelocation;
 	UBOOL bProcessingMap;
 	FLOAT LastUpdated;
-	TCHAR LastError[256];
 
 	// Config
 	UBOOL Silent;
 	INT MaxMemCacheMegs;
 	INT MaxFileCacheMegs;
 	INT ForceSourceToFileMegs;
+	INT MaxCompressionThreads;
+	INT MultiBlockMinMegs;
+	INT MaxUploadRate;
+	INT LevelUploadWeight;
+	INT MaxDeltaBases; //Previous versions kept per package, 0 disables deltas
+	INT HttpPort; //Redirect server, 0 disables it
+	INT HttpMaxConnections;
+
+	// Stats
+	INT MemoryHits;
+	INT FileHits;
+	INT Misses;
+	INT Evictions;
+	INT DeltaHits;
 
 	void StaticConstructor();
 
@@ -104,9 +336,28 @@ class XC_CORE_API ULZMAServer : public USubsystem
 	virtual void Init();
 	virtual void UpdatePackageMap( UPackageMap* NewPackageMap);
 	virtual void RelocateSources( UBOOL bCleanupDisk=0);
-	virtual void AddFileCacheEntry( const TCHAR* CmpFilename, const TCHAR* SrcFilename);
+	virtual void AddFileCacheEntry( const TCHAR* CmpFilename, const TCHAR* SrcFilename, const FGuid& Guid, DWORD Hash=0);
 
 	FLZMASourceBase* GetSource( const FPackageInfo& Info);
+	void NotifyServed( FLZMASourceBase* Source, UBOOL bReady);
+	INT GetDelta( const FPackageInfo& Info, const FGuid& BaseGuid, FArchive*& Reader); //Returns EDeltaState
+	INT ExportSource( const TCHAR* Name, FLZMAExport& Export); //Returns ELZMAExportResult
+
+protected:
+	// Keep Sources and SourceMap in sync
+	void AddSource( FLZMASourceBase* Source);
+	void ReplaceSource( INT i, FLZMASourceBase* NewSource);
+	void RemoveSource( INT i);
+	void RebuildSourceMap();
+
+	void QueueCompression();
+	void FinishCompression( FLZMACompressJob* Job);
+	void QueueSpill( INT i, UBOOL bEviction=0);
+	UBOOL FinishSpill( FLZMASpillJob* Job);
+	void QueueContainer( INT i);
+	void FinishContainer( FLZMABlockJob* Job);
+	UBOOL KeepDeltaBase( const FLZMACacheEntry& Entry);
+	void FinishDelta( FLZMADeltaJob* Job);
 };
 
 /*-----------------------------------------------------------------------------
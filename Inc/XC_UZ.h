@@ -0,0 +1,31 @@
+/*=============================================================================
+	XC_UZ.h:
+	Native UZ/UZ2 decoder, output is identical to the engine's FCodecFull chain
+=============================================================================*/
+
+#ifndef _INC_XC_UZ
+#define _INC_XC_UZ
+
+#include "XC_JobQueue.h"
+
+#define UZ_SIGNATURE  1234
+#define UZ2_SIGNATURE 5678
+
+//
+// Decode a .uz file (signature and original filename included) into Dest
+// Blocks of the BWT stage are decoded by up to Threads workers.
+//
+XC_CORE_API UBOOL UzDecompress( FArchive& Src, FArchive& Dest, TCHAR* Error, INT Threads=4); //Define at least 128 chars for Error
+
+class XC_CORE_API UUZBenchmarkCommandlet : public UCommandlet
+{
+	DECLARE_CLASS(UUZBenchmarkCommandlet,UCommandlet,CLASS_Transient,XC_Core);
+	NO_DEFAULT_CONSTRUCTOR(UUZBenchmarkCommandlet)
+	INT Main( const TCHAR* Parms );
+};
+
+
+#endif
+/*-----------------------------------------------------------------------------
+	The End.
+-----------------------------------------------------------------------------*/
@@ -510,27 +510,69 @@ inline void FPathBuilderMaster::DefineSpecials()
 
 
 
+//============== Candidates lookup grid helpers
+//
+static DWORD CellHash( INT X, INT Y, INT Z)
+{
+	return ((DWORD)X * 73856093) ^ ((DWORD)Y * 19349663) ^ ((DWORD)Z * 83492791);
+}
+
+static QSORT_RETURN CDECL CompareIndex( const int32* A, const int32* B)
+{
+	return *A - *B;
+}
+
 //============== Candidates are possible connections
 //
 // Instead of connecting right away, candidates will be selected and sorted by distance
+// Nodes are hashed into cells as big as the lookup distance, so only the 27 cells
+// around a node can hold candidates for it.
 //
 inline void FPathBuilderMaster::BuildCandidatesLists()
 {
 	debugf( NAME_DevPath, TEXT("Building candidates lists..."));
 	float MaxDistSq = GoodDistance * GoodDistance * 2 * 2;
+	float CellSize = GoodDistance * 2;
 
-	uint64 MaxPossiblePairs = (uint64)InfoList.Num() * (uint64)InfoList.Num() / 2;
+	TMultiMap<DWORD,int32> Grid;
+	TArray<int32> Cells( InfoList.Num() * 3);
+	for ( int32 i=0 ; i<InfoList.Num() ; i++ )
+	{
+		const FVector& Location = InfoList(i).Owner->Location;
+		Cells(i*3+0) = appFloor( Location.X / CellSize);
+		Cells(i*3+1) = appFloor( Location.Y / CellSize);
+		Cells(i*3+2) = appFloor( Location.Z / CellSize);
+		if ( !InfoList(i).Owner->IsA( ALiftCenter::StaticClass()) ) //No LiftCenter
+			Grid.Add( CellHash(Cells(i*3+0),Cells(i*3+1),Cells(i*3+2)), i);
+	}
 
+	TArray<int32> Found;
+	TArray<int32> Nearby;
 	for ( int32 i=0 ; i<InfoList.Num() ; i++ )
 	{
 		if ( InfoList(i).Owner->IsA( ALiftCenter::StaticClass()) ) 
 			continue; //No LiftCenter
 
-		for ( int32 j=i+1 ; j<InfoList.Num() ; j++ )
+		GWarn->StatusUpdatef( i, InfoList.Num(), TEXT("Building candidates lists (%i/%i)"), i, InfoList.Num());
+
+		// Pairs are only evaluated once, visit them in list order so equally distant candidates keep their order
+		Nearby.Empty();
+		for ( int32 X=Cells(i*3+0)-1 ; X<=Cells(i*3+0)+1 ; X++ )
+		for ( int32 Y=Cells(i*3+1)-1 ; Y<=Cells(i*3+1)+1 ; Y++ )
+		for ( int32 Z=Cells(i*3+2)-1 ; Z<=Cells(i*3+2)+1 ; Z++ )
 		{
-			if ( InfoList(j).Owner->IsA( ALiftCenter::StaticClass()) ) 
-				continue; //No LiftCenter
+			Found.Empty();
+			Grid.MultiFind( CellHash(X,Y,Z), Found);
+			for ( int32 k=0 ; k<Found.Num() ; k++ )
+				if ( (Found(k) > i) && (Cells(Found(k)*3+0) == X) && (Cells(Found(k)*3+1) == Y) && (Cells(Found(k)*3+2) == Z) )
+					Nearby.AddItem( Found(k));
+		}
+		if ( Nearby.Num() > 1 )
+			appQsort( &Nearby(0), Nearby.Num(), sizeof(int32), (QSORT_COMPARE)CompareIndex);
 
+		for ( int32 n=0 ; n<Nearby.Num() ; n++ )
+		{
+			int32 j = Nearby(n);
 			float DistSq = (InfoList(i).Owner->Location - InfoList(j).Owner->Location).SizeSquared();
 			if ( DistSq > MaxDistSq ) 
 				continue; //Too far
@@ -538,15 +580,20 @@ inline void FPathBuilderMaster::BuildCandidatesLists()
 			if ( !Level->Model->FastLineCheck( InfoList(i).Owner->Location, InfoList(j).Owner->Location) ) 
 				continue; //Not visible
 
-			uint64 CurrentPair = (uint64)(InfoList.Num() * 2 - i) * i / 2 + j - i;
-			GWarn->StatusUpdatef( CurrentPair >> 4, MaxPossiblePairs >> 4, TEXT("Building candidates lists (%i/%i)"), (int32)CurrentPair, (int32)MaxPossiblePairs);
-				
-			int32 k = 0;
-			while ( (k < InfoList(i).Candidates.Num()) && (InfoList(i).Candidates(k).DistSq < DistSq) )
-				k++;
-			InfoList(i).Candidates.Insert( k);
-			InfoList(i).Candidates(k).Path = InfoList(j).Owner;
-			InfoList(i).Candidates(k).DistSq = DistSq;
+			// Before the first candidate at the same or greater distance
+			int32 Low = 0;
+			int32 High = InfoList(i).Candidates.Num();
+			while ( Low < High )
+			{
+				int32 Mid = (Low + High) / 2;
+				if ( InfoList(i).Candidates(Mid).DistSq < DistSq )
+					Low = Mid + 1;
+				else
+					High = Mid;
+			}
+			InfoList(i).Candidates.Insert( Low);
+			InfoList(i).Candidates(Low).Path = InfoList(j).Owner;
+			InfoList(i).Candidates(Low).DistSq = DistSq;
 			TotalCandidates++;
 		}
 	}
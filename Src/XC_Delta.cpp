@@ -0,0 +1,168 @@
+/*=============================================================================
+	XC_Delta.cpp:
+	Binary delta between two versions of a package.
+
+	Windows of the old version are indexed by hash every few bytes, the new
+	version is scanned with a rolling hash and matches are extended in both
+	directions. Whatever isn't matched is stored as literals, the LZMA pass
+	that follows takes care of those.
+=============================================================================*/
+
+#include "XC_Core.h"
+#include "XC_Delta.h"
+
+#define DELTA_WINDOW      32
+#define DELTA_PRIME       0x01000193
+#define DELTA_MAX_WINDOWS (1 << 22)
+
+static inline DWORD DeltaHash( const BYTE* Data)
+{
+	DWORD Hash = 0;
+	for ( INT i=0; i<DELTA_WINDOW; i++)
+		Hash = Hash * DELTA_PRIME + Data[i];
+	return Hash;
+}
+
+static inline void DeltaEmit( TArray<BYTE>& Out, INT Value)
+{
+	INT i = Out.Add( sizeof(INT));
+	appMemcpy( &Out(i), &Value, sizeof(INT));
+}
+
+static inline void DeltaEmit( TArray<BYTE>& Out, const BYTE* Data, INT Count)
+{
+	DeltaEmit( Out, Count);
+	if ( Count > 0 )
+	{
+		INT i = Out.Add( Count);
+		appMemcpy( &Out(i), Data, Count);
+	}
+}
+
+//
+// Commands that rebuild Target from Base
+//
+XC_CORE_API void DeltaDiff( const BYTE* Base, INT BaseSize, const BYTE* Target, INT TargetSize, TArray<BYTE>& Commands)
+{
+	Commands.Empty();
+
+	// Index base, big files get a coarser index
+	INT Stride = Max( DELTA_WINDOW / 2, BaseSize / DELTA_MAX_WINDOWS + 1);
+	INT NumWindows = (BaseSize >= DELTA_WINDOW) ? (BaseSize - DELTA_WINDOW) / Stride + 1 : 0;
+	INT Bits = 10;
+	while ( (1 << Bits) < NumWindows * 2 )
+		Bits++;
+	TArray<INT> Table( 1 << Bits);
+	appMemset( &Table(0), 0xFF, Table.Num() * sizeof(INT));
+	for ( INT i=0; i<NumWindows; i++)
+	{
+		DWORD Slot = (DeltaHash(Base + i*Stride) * 0x9E3779B1) >> (32 - Bits);
+		if ( Table(Slot) < 0 ) //Keep first
+			Table(Slot) = i * Stride;
+	}
+
+	DWORD Power = 1;
+	for ( INT i=1; i<DELTA_WINDOW; i++)
+		Power *= DELTA_PRIME;
+
+	INT Literal = 0; //Start of pending literals
+	INT Last = 0;    //End of previous copy in base
+	INT i = 0;
+	DWORD Hash = (TargetSize >= DELTA_WINDOW) ? DeltaHash(Target) : 0;
+	while ( i + DELTA_WINDOW <= TargetSize )
+	{
+		// Same length edits keep the rest of the file in place, try there first
+		INT Match = INDEX_NONE;
+		INT Expect = Last + (i - Literal);
+		if ( (Expect + DELTA_WINDOW <= BaseSize) && !appMemcmp( Base + Expect, Target + i, DELTA_WINDOW) )
+			Match = Expect;
+		else if ( NumWindows )
+		{
+			INT Found = Table( (Hash * 0x9E3779B1) >> (32 - Bits) );
+			if ( (Found >= 0) && !appMemcmp( Base + Found, Target + i, DELTA_WINDOW) )
+				Match = Found;
+		}
+
+		if ( Match == INDEX_NONE )
+		{
+			if ( i + DELTA_WINDOW < TargetSize )
+				Hash = (Hash - Target[i] * Power) * DELTA_PRIME + Target[i + DELTA_WINDOW];
+			i++;
+			continue;
+		}
+
+		// Extend both ways, backwards only over pending literals
+		INT Count = DELTA_WINDOW;
+		while ( (i + Count < TargetSize) && (Match + Count < BaseSize) && (Target[i + Count] == Base[Match + Count]) )
+			Count++;
+		while ( (i > Literal) && (Match > 0) && (Target[i - 1] == Base[Match - 1]) )
+		{
+			i--;
+			Match--;
+			Count++;
+		}
+
+		DeltaEmit( Commands, Target + Literal, i - Literal);
+		DeltaEmit( Commands, Match - Last);
+		DeltaEmit( Commands, Count);
+		i += Count;
+		Literal = i;
+		Last = Match + Count;
+		if ( i + DELTA_WINDOW <= TargetSize )
+			Hash = DeltaHash( Target + i);
+	}
+
+	if ( Literal < TargetSize )
+	{
+		DeltaEmit( Commands, Target + Literal, TargetSize - Literal);
+		DeltaEmit( Commands, 0);
+		DeltaEmit( Commands, 0);
+	}
+}
+
+//
+// Rebuild Target, every command is validated
+//
+XC_CORE_API UBOOL DeltaPatch( const BYTE* Base, INT BaseSize, const BYTE* Commands, INT CommandSize, BYTE* Target, INT TargetSize)
+{
+	INT Pos = 0;
+	INT Out = 0;
+	INT Last = 0;
+	while ( Pos < CommandSize )
+	{
+		INT Count, Offset;
+		if ( Pos + (INT)sizeof(INT) > CommandSize )
+			return 0;
+		appMemcpy( &Count, Commands + Pos, sizeof(INT));
+		Pos += sizeof(INT);
+		if ( (Count < 0) || (Count > CommandSize - Pos) || (Count > TargetSize - Out) )
+			return 0;
+		appMemcpy( Target + Out, Commands + Pos, Count);
+		Pos += Count;
+		Out += Count;
+
+		if ( Pos + 2 * (INT)sizeof(INT) > CommandSize )
+			return 0;
+		appMemcpy( &Offset, Commands + Pos, sizeof(INT));
+		appMemcpy( &Count, Commands + Pos + sizeof(INT), sizeof(INT));
+		Pos += 2 * sizeof(INT);
+		if ( (Offset < -Last) || (Offset > BaseSize - Last) )
+			return 0;
+		INT Start = Last + Offset;
+		if ( (Count < 0) || (Count > BaseSize - Start) || (Count > TargetSize - Out) )
+			return 0;
+		appMemcpy( Target + Out, Base + Start, Count);
+		Out += Count;
+		Last = Start + Count;
+	}
+	return Out == TargetSize;
+}
+
+XC_CORE_API UBOOL DeltaIsPatch( const BYTE* Data, INT Count)
+{
+	return (Count >= 4) && (*(DWORD*)Data == DELTA_MAGIC);
+}
+
+/*-----------------------------------------------------------------------------
+	The End.
+-----------------------------------------------------------------------------*/
@@ -0,0 +1,1231 @@
+/*=============================================================================
+	XC_HTTP.cpp:
+	HTTP redirect server serving the LZMA server's compressed files.
+
+	The event loop thread owns the sockets, it parses requests and hands
+	them to the main thread where ULZMAServer resolves them into shared
+	memory or a file in the cache. Responses are sent back by the event
+	loop without ever touching the LZMA server.
+
+	Without sendfile the files are opened and read by reader workers,
+	a slow disk never stalls the event loop.
+=============================================================================*/
+
+#include "XC_Core.h"
+#include "Engine.h"
+#include "UnLinker.h"
+#include "XC_LZMA.h"
+#include "XC_HTTP.h"
+
+#include "Cacus/Atomics.h"
+#include "Cacus/CacusThread.h"
+
+#include <stdio.h>
+
+#if __UNIX__
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <sys/select.h>
+	#include <sys/stat.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <arpa/inet.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <errno.h>
+	#include <signal.h>
+	#include <pthread.h>
+	#if defined(__linux__)
+		#include <sys/sendfile.h>
+		#define HTTP_SENDFILE 1
+	#endif
+	typedef int FHttpSocket;
+	#define HTTP_INVALID_SOCKET -1
+	#ifdef MSG_NOSIGNAL
+		#define HTTP_SEND_FLAGS MSG_NOSIGNAL
+	#else
+		#define HTTP_SEND_FLAGS 0
+	#endif
+	#define HttpCloseSocket close
+	inline UBOOL HttpWouldBlock() { return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR); }
+	// sendfile can't be told not to raise SIGPIPE, the event loop blocks it on its own
+	// thread and takes back the signal a broken pipe leaves pending.
+	static void HttpBlockSigPipe()
+	{
+		sigset_t Set;
+		sigemptyset( &Set);
+		sigaddset( &Set, SIGPIPE);
+		pthread_sigmask( SIG_BLOCK, &Set, nullptr);
+	}
+	static UBOOL HttpSendWouldBlock()
+	{
+		if ( HttpWouldBlock() )
+			return 1;
+		if ( errno == EPIPE )
+		{
+			sigset_t Set;
+			sigemptyset( &Set);
+			sigaddset( &Set, SIGPIPE);
+			timespec Zero = {0,0};
+			sigtimedwait( &Set, nullptr, &Zero);
+		}
+		return 0;
+	}
+#elif _WINDOWS
+	#include <winsock.h>
+	#pragma comment (lib,"ws2_32.lib")
+	typedef SOCKET FHttpSocket;
+	typedef int socklen_t;
+	#define HTTP_INVALID_SOCKET INVALID_SOCKET
+	#define HTTP_SEND_FLAGS 0
+	#define HttpCloseSocket closesocket
+	inline UBOOL HttpWouldBlock() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+	inline void  HttpBlockSigPipe() {}
+	inline UBOOL HttpSendWouldBlock() { return HttpWouldBlock(); }
+#endif
+
+#ifndef HTTP_SENDFILE
+	#define HTTP_SENDFILE 0
+#endif
+
+#define HTTP_MAX_HEADER      8192
+#define HTTP_MAX_CONNECTIONS Min(FD_SETSIZE-1,256)
+#define HTTP_RECV_SIZE       4096
+#define HTTP_SEND_CHUNK      (256*1024) //Per connection and loop, keeps big files from starving the rest
+#define HTTP_POLL_USEC       10000      //Responses from the main thread are picked up between polls
+#define HTTP_IDLE_TIMEOUT    15.0       //Keep-alive connection without requests
+#define HTTP_SEND_TIMEOUT    60.0       //Client not reading
+#define HTTP_PENDING_TIMEOUT 30.0       //Source still being compressed, answered with 503
+#define HTTP_PENDING_RETRY   0.5        //Sources still being compressed are looked up again this often
+#define HTTP_READ_WORKERS    2          //File readers when there's no sendfile
+
+
+/*-----------------------------------------------------------------------------
+	Utils.
+-----------------------------------------------------------------------------*/
+
+static UBOOL HttpSetNonBlocking( FHttpSocket Socket)
+{
+#if _WINDOWS
+	u_long NoBlock = 1;
+	return ioctlsocket( Socket, FIONBIO, &NoBlock) == 0;
+#else
+	INT Flags = fcntl( Socket, F_GETFL, 0);
+	return (Flags != -1) && (fcntl( Socket, F_SETFL, Flags | O_NONBLOCK) != -1);
+#endif
+}
+
+// appToAnsi/appFromAnsi use a shared buffer, these can be used by any thread
+static void HttpToAnsi( const TCHAR* Src, ANSICHAR* Dest, INT Max)
+{
+	INT i;
+	for ( i=0; Src[i] && (i<Max-1); i++)
+		Dest[i] = ((DWORD)Src[i] < 0x80) ? (ANSICHAR)Src[i] : '?';
+	Dest[i] = 0;
+}
+
+static ANSICHAR HttpLower( ANSICHAR C)
+{
+	return ((C >= 'A') && (C <= 'Z')) ? C + ('a' - 'A') : C;
+}
+
+// Case insensitive prefix match, returns what follows
+static const ANSICHAR* HttpMatch( const ANSICHAR* Str, const ANSICHAR* Prefix)
+{
+	for ( ; *Prefix; Str++, Prefix++)
+		if ( HttpLower(*Str) != HttpLower(*Prefix) )
+			return nullptr;
+	return Str;
+}
+
+// Case insensitive search of a token in a header value
+static UBOOL HttpHasToken( const ANSICHAR* Value, const ANSICHAR* Token)
+{
+	for ( ; *Value; Value++)
+		if ( HttpMatch( Value, Token) )
+			return 1;
+	return 0;
+}
+
+static INT HttpHexDigit( ANSICHAR C)
+{
+	if ( (C >= '0') && (C <= '9') ) return C - '0';
+	C = HttpLower(C);
+	if ( (C >= 'a') && (C <= 'f') ) return C - 'a' + 10;
+	return -1;
+}
+
+static const ANSICHAR* HttpReason( INT Status)
+{
+	switch ( Status )
+	{
+		case 200: return "OK";
+		case 400: return "Bad Request";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 503: return "Service Unavailable";
+		default:  return "Error";
+	}
+}
+
+
+/*-----------------------------------------------------------------------------
+	Event loop.
+-----------------------------------------------------------------------------*/
+
+//
+// Created by the event loop, resolved on the main thread
+//
+struct FHttpRequest
+{
+	INT         Connection;
+	TCHAR       Name[256]; //Last component of the path, decoded
+	UBOOL       bHead;
+	FTime       Time;
+	INT         Status;    //Set by main thread
+	FLZMAExport Body;
+
+	FHttpRequest( INT InConnection, FTime InTime)
+		: Connection(InConnection)
+		, bHead(0)
+		, Time(InTime)
+		, Status(0)
+	{
+		Name[0] = 0;
+	}
+	~FHttpRequest()
+	{
+		Body.Release();
+	}
+};
+
+struct FHttpConnection
+{
+	INT           Id;
+	FHttpSocket   Socket;
+	FTime         LastActive;
+	TArray<BYTE>  In;        //Received, not parsed yet
+	TArray<BYTE>  Out;       //Response header
+	INT           OutPos;
+	FHttpRequest* Request;   //Being resolved or sent
+	UBOOL         bWaiting;  //Request is on the main thread
+	UBOOL         bKeepAlive;
+	INT           BodyPos;
+	INT           BodySize;
+#if HTTP_SENDFILE
+	int           File;
+#else
+	FArchive*     File;      //Handed to the reader while it works
+	TArray<BYTE>  Chunk;
+	INT           ChunkPos;
+	UBOOL         bReading;  //Reader has the file
+#endif
+
+	FHttpConnection( INT InId, FHttpSocket InSocket, FTime Now)
+		: Id(InId)
+		, Socket(InSocket)
+		, LastActive(Now)
+		, OutPos(0)
+		, Request(nullptr)
+		, bWaiting(0)
+		, bKeepAlive(1)
+		, BodyPos(0)
+		, BodySize(0)
+#if HTTP_SENDFILE
+		, File(-1)
+#else
+		, File(nullptr)
+		, ChunkPos(0)
+		, bReading(0)
+#endif
+	{}
+
+	~FHttpConnection()
+	{
+		EndResponse();
+		HttpCloseSocket( Socket);
+	}
+
+	UBOOL IsSending()
+	{
+		return Request && !bWaiting && !IsReading();
+	}
+
+	UBOOL IsReading()
+	{
+#if HTTP_SENDFILE
+		return 0;
+#else
+		return bReading;
+#endif
+	}
+
+	void EndResponse()
+	{
+		if ( Request && !bWaiting ) //Otherwise the main thread has it
+			delete Request;
+		Request = nullptr;
+		bWaiting = 0;
+		Out.Empty();
+		OutPos = 0;
+		BodyPos = BodySize = 0;
+#if HTTP_SENDFILE
+		if ( File >= 0 )
+			close( File);
+		File = -1;
+#else
+		if ( File )
+			delete File;
+		File = nullptr;
+		Chunk.Empty();
+		ChunkPos = 0;
+		bReading = 0; //Reader's result will find no request
+#endif
+	}
+};
+
+#if !HTTP_SENDFILE
+//
+// Opens a file body or reads its next chunk
+// The file belongs to the job until it's claimed by the event loop.
+//
+class FHttpReadJob : public FAsyncJob
+{
+public:
+	INT          Connection;
+	FString      Filename;
+	FArchive*    File;
+	INT          Count; //Zero only opens the file
+	TArray<BYTE> Chunk;
+	UBOOL        bError;
+
+	FHttpReadJob( INT InConnection, const FString& InFilename, FArchive* InFile, INT InCount)
+		: Connection(InConnection)
+		, Filename(InFilename)
+		, File(InFile)
+		, Count(InCount)
+		, bError(0)
+	{}
+	~FHttpReadJob()
+	{
+		if ( File )
+			delete File;
+	}
+
+	void Run()
+	{
+		if ( !File )
+		{
+			File = GFileManager->CreateFileReader( *Filename);
+			if ( !File )
+			{
+				bError = 1;
+				return;
+			}
+		}
+		if ( Count > 0 )
+		{
+			Chunk.Add( Count);
+			File->Serialize( &Chunk(0), Count);
+			bError = File->IsError();
+		}
+	}
+};
+#endif
+
+class FHttpServerJob : public FAsyncJob
+{
+public:
+	// Shared with the main thread, Lock must be held
+	volatile int32 Lock;
+	TArray<FHttpRequest*> Requests;  //To be resolved
+	TArray<FHttpRequest*> Responses; //Resolved
+
+	// Stats
+	volatile int32 NumConnections;
+	volatile int32 NumRequests;
+	volatile int32 KBSent;
+
+	FHttpServerJob( FHttpSocket InListener, INT InMaxConnections)
+		: Lock(0)
+		, NumConnections(0)
+		, NumRequests(0)
+		, KBSent(0)
+		, Listener(InListener)
+		, MaxConnections(InMaxConnections)
+		, NextId(0)
+		, Sent(0)
+#if !HTTP_SENDFILE
+		, Readers( new FAsyncJobQueue(HTTP_READ_WORKERS) )
+#endif
+	{}
+
+	~FHttpServerJob()
+	{
+#if !HTTP_SENDFILE
+		Readers->Release();
+#endif
+		for ( INT i=0; i<Connections.Num(); i++)
+			delete Connections(i);
+		for ( INT i=0; i<Requests.Num(); i++)
+			delete Requests(i);
+		for ( INT i=0; i<Responses.Num(); i++)
+			delete Responses(i);
+		HttpCloseSocket( Listener);
+	}
+
+	void Run();
+
+protected:
+	FHttpSocket Listener;
+	INT MaxConnections;
+	TArray<FHttpConnection*> Connections;
+	INT NextId;
+	QWORD Sent;
+#if !HTTP_SENDFILE
+	FAsyncJobQueue* Readers;
+#endif
+
+	void  Accept( FTime Now);
+	UBOOL Receive( FHttpConnection* Conn, FTime Now);
+	UBOOL Parse( FHttpConnection* Conn, FTime Now);
+	void  Respond( FHttpConnection* Conn, FHttpRequest* Request);
+	UBOOL Send( FHttpConnection* Conn, FTime Now);
+	void  ClaimResponses();
+#if !HTTP_SENDFILE
+	void  Read( FHttpConnection* Conn, INT Count);
+	void  ClaimReads();
+#endif
+};
+
+void FHttpServerJob::Run()
+{
+	HttpBlockSigPipe();
+	while ( !Cancelled )
+	{
+		ClaimResponses();
+#if !HTTP_SENDFILE
+		ClaimReads();
+#endif
+
+		// Connections waiting for the main thread or a reader aren't polled
+		fd_set ReadSet, WriteSet;
+		FD_ZERO( &ReadSet);
+		FD_ZERO( &WriteSet);
+		FHttpSocket MaxSocket = 0;
+		INT Polled = 0;
+		if ( Connections.Num() < MaxConnections )
+		{
+			FD_SET( Listener, &ReadSet);
+			MaxSocket = Listener;
+			Polled++;
+		}
+		for ( INT i=0; i<Connections.Num(); i++)
+		{
+			FHttpConnection* Conn = Connections(i);
+			if ( Conn->IsSending() )
+				FD_SET( Conn->Socket, &WriteSet);
+			else if ( !Conn->Request && (Conn->In.Num() <= HTTP_MAX_HEADER) )
+				FD_SET( Conn->Socket, &ReadSet);
+			else
+				continue;
+			MaxSocket = Max( MaxSocket, Conn->Socket);
+			Polled++;
+		}
+
+		timeval Timeout;
+		Timeout.tv_sec  = 0;
+		Timeout.tv_usec = HTTP_POLL_USEC;
+		if ( !Polled || (select( (int)MaxSocket + 1, &ReadSet, &WriteSet, nullptr, &Timeout) < 0) )
+		{
+			FD_ZERO( &ReadSet);
+			FD_ZERO( &WriteSet);
+			appSleep( HTTP_POLL_USEC / 1000000.f);
+		}
+
+		FTime Now = appSeconds();
+		if ( FD_ISSET( Listener, &ReadSet) )
+			Accept( Now);
+		for ( INT i=0; i<Connections.Num(); i++)
+		{
+			FHttpConnection* Conn = Connections(i);
+			UBOOL bOpen = 1;
+			if ( FD_ISSET( Conn->Socket, &ReadSet) )
+				bOpen = Receive( Conn, Now);
+			else if ( FD_ISSET( Conn->Socket, &WriteSet) )
+				bOpen = Send( Conn, Now);
+
+			// Next request, may already be in the buffer if the client pipelines them
+			if ( bOpen && !Conn->Request )
+				bOpen = Parse( Conn, Now);
+			if ( bOpen && !Conn->bWaiting && !Conn->IsReading() && (Now - Conn->LastActive > (Conn->Request ? HTTP_SEND_TIMEOUT : HTTP_IDLE_TIMEOUT)) )
+				bOpen = 0;
+			if ( !bOpen )
+			{
+				delete Conn;
+				Connections.Remove( i--);
+				NumConnections = Connections.Num();
+			}
+		}
+	}
+}
+
+void FHttpServerJob::Accept( FTime Now)
+{
+	sockaddr_in Addr;
+	socklen_t AddrSize = sizeof(Addr);
+	FHttpSocket Socket = accept( Listener, (sockaddr*)&Addr, &AddrSize);
+	if ( Socket == HTTP_INVALID_SOCKET )
+		return;
+#if __UNIX__
+	if ( Socket >= FD_SETSIZE )
+	{
+		HttpCloseSocket( Socket);
+		return;
+	}
+#endif
+	if ( !HttpSetNonBlocking( Socket) )
+	{
+		HttpCloseSocket( Socket);
+		return;
+	}
+	int NoDelay = 1;
+	setsockopt( Socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&NoDelay, sizeof(NoDelay));
+	Connections.AddItem( new FHttpConnection( NextId++, Socket, Now) );
+	NumConnections = Connections.Num();
+}
+
+UBOOL FHttpServerJob::Receive( FHttpConnection* Conn, FTime Now)
+{
+	BYTE Buffer[HTTP_RECV_SIZE];
+	INT Count = recv( Conn->Socket, (char*)Buffer, sizeof(Buffer), 0);
+	if ( Count == 0 ) //Closed by client
+		return 0;
+	if ( Count < 0 )
+		return HttpWouldBlock();
+	INT i = Conn->In.Add( Count);
+	appMemcpy( &Conn->In(i), Buffer, Count);
+	Conn->LastActive = Now;
+	return 1;
+}
+
+//
+// Turn the first complete request in the buffer into a FHttpRequest
+// Only GET and HEAD are served, requests with a body are refused.
+//
+UBOOL FHttpServerJob::Parse( FHttpConnection* Conn, FTime Now)
+{
+	INT End = INDEX_NONE;
+	for ( INT i=3; i<Conn->In.Num() && (End == INDEX_NONE); i++)
+		if ( (Conn->In(i) == '\n') && (Conn->In(i-1) == '\r') && (Conn->In(i-2) == '\n') && (Conn->In(i-3) == '\r') )
+			End = i + 1;
+
+	if ( (End == INDEX_NONE) && (Conn->In.Num() <= HTTP_MAX_HEADER) )
+		return 1;
+
+	FHttpRequest* Request = new FHttpRequest( Conn->Id, Now);
+	Conn->bKeepAlive = 0;
+	if ( (End == INDEX_NONE) || (End > HTTP_MAX_HEADER) )
+	{
+		Request->Status = 400;
+		Conn->In.Empty();
+	}
+	else
+	{
+		ANSICHAR Header[HTTP_MAX_HEADER+1];
+		appMemcpy( Header, &Conn->In(0), End);
+		Header[End] = 0;
+		Conn->In.Remove( 0, End);
+
+		ANSICHAR Method[16], Target[1024], Version[16];
+		if ( (sscanf( Header, "%15s %1023s %15s", Method, Target, Version) != 3) || !HttpMatch(Version,"HTTP/1.") )
+			Request->Status = 400;
+		else
+		{
+			// HTTP/1.1 defaults to keep-alive, 1.0 has to ask for it
+			Conn->bKeepAlive = HttpMatch(Version,"HTTP/1.1") != nullptr;
+			for ( ANSICHAR* Line=strstr(Header,"\r\n"); Line && Line[2]; Line=strstr(Line,"\r\n"))
+			{
+				Line += 2;
+				if ( *Line == '\r' )
+					break;
+				ANSICHAR* LineEnd = strstr( Line, "\r\n");
+				if ( LineEnd )
+					*LineEnd = 0;
+				const ANSICHAR* Value;
+				if ( (Value=HttpMatch(Line,"Connection:")) != nullptr )
+				{
+					if ( HttpHasToken(Value,"close") )
+						Conn->bKeepAlive = 0;
+					else if ( HttpHasToken(Value,"keep-alive") )
+						Conn->bKeepAlive = 1;
+				}
+				else if ( HttpMatch(Line,"Transfer-Encoding:") || (((Value=HttpMatch(Line,"Content-Length:")) != nullptr) && atoi(Value)) )
+					Request->Status = 400; //Body would be taken as the next request
+				if ( !LineEnd )
+					break;
+				*LineEnd = '\r';
+			}
+
+			// Last path component, without query
+			ANSICHAR* Path = Target;
+			for ( ANSICHAR* C=Target; *C && (*C != '?') && (*C != '#'); C++)
+				if ( *C == '/' )
+					Path = C + 1;
+			INT Len = 0;
+			for ( ANSICHAR* C=Path; *C && (*C != '?') && (*C != '#') && (Len < ARRAY_COUNT(Request->Name)-1); C++)
+			{
+				INT Char = (BYTE)*C;
+				if ( (Char == '%') && (HttpHexDigit(C[1]) >= 0) && (HttpHexDigit(C[2]) >= 0) )
+				{
+					Char = HttpHexDigit(C[1]) * 16 + HttpHexDigit(C[2]);
+					C += 2;
+				}
+				if ( (Char < 0x20) || (Char == '\\') || (Char == '/') || (Char == ':') )
+				{
+					Len = 0;
+					break;
+				}
+				Request->Name[Len++] = (TCHAR)Char;
+			}
+			Request->Name[Len] = 0;
+
+			Request->bHead = !strcmp( Method, "HEAD");
+			if ( !Request->Status && strcmp( Method, "GET") && !Request->bHead )
+				Request->Status = 405;
+			else if ( !Request->Status && (!Len || (Request->Name[0] == '.')) )
+				Request->Status = 404;
+		}
+	}
+
+	FPlatformAtomics::InterlockedIncrement( &NumRequests);
+	if ( Request->Status )
+	{
+		Conn->bKeepAlive &= (Request->Status != 400);
+		Respond( Conn, Request);
+		return 1;
+	}
+
+	Conn->Request  = Request;
+	Conn->bWaiting = 1;
+	CSpinLock SL(&Lock);
+	Requests.AddItem( Request);
+	return 1;
+}
+
+//
+// Build the response header and open the body
+//
+void FHttpServerJob::Respond( FHttpConnection* Conn, FHttpRequest* Request)
+{
+	Conn->Request  = Request;
+	Conn->bWaiting = 0;
+
+	INT Size = 0;
+	if ( Request->Status == 200 )
+	{
+		if ( Request->Body.Data )
+			Size = Request->Body.Size;
+		else
+		{
+			// The cache may drop the file in the meantime, handle stays valid
+			ANSICHAR Filename[1024];
+			HttpToAnsi( *Request->Body.Filename, Filename, ARRAY_COUNT(Filename));
+#if HTTP_SENDFILE
+			struct stat Buf;
+			Conn->File = open( Filename, O_RDONLY);
+			if ( (Conn->File >= 0) && (fstat(Conn->File,&Buf) == 0) && (Buf.st_size <= 0x7FFFFFFF) )
+				Size = (INT)Buf.st_size;
+			else
+				Request->Status = 404;
+#else
+			// Header goes out once a reader has opened the file
+			if ( !Conn->File )
+			{
+				Read( Conn, 0);
+				return;
+			}
+			Size = Conn->File->TotalSize();
+#endif
+		}
+	}
+	Conn->BodySize = (Request->Status == 200 && !Request->bHead) ? Size : 0;
+
+	ANSICHAR Header[512];
+	INT Len = snprintf( Header, sizeof(Header),
+		"HTTP/1.1 %i %s\r\n"
+		"Server: XC_Core/%i\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"Content-Length: %i\r\n"
+		"Connection: %s\r\n"
+		"%s"
+		"\r\n"
+		, Request->Status, HttpReason(Request->Status)
+		, XC_CORE_VERSION
+		, (Request->Status == 200) ? Size : 0
+		, Conn->bKeepAlive ? "keep-alive" : "close"
+		, (Request->Status == 405) ? "Allow: GET, HEAD\r\n" : (Request->Status == 503) ? "Retry-After: 5\r\n" : "");
+	Conn->Out.Empty();
+	Conn->Out.Add( Len);
+	appMemcpy( &Conn->Out(0), Header, Len);
+	Conn->OutPos = 0;
+}
+
+UBOOL FHttpServerJob::Send( FHttpConnection* Conn, FTime Now)
+{
+	if ( Conn->OutPos < Conn->Out.Num() )
+	{
+		INT Count = send( Conn->Socket, (const char*)&Conn->Out(Conn->OutPos), Conn->Out.Num() - Conn->OutPos, HTTP_SEND_FLAGS);
+		if ( Count < 0 )
+			return HttpSendWouldBlock();
+		Conn->OutPos += Count;
+		Conn->LastActive = Now;
+		if ( Conn->OutPos < Conn->Out.Num() )
+			return 1;
+	}
+
+	if ( Conn->BodyPos < Conn->BodySize )
+	{
+		INT Count = Min( Conn->BodySize - Conn->BodyPos, HTTP_SEND_CHUNK);
+		const FLZMAExport& Body = Conn->Request->Body;
+		if ( Body.Data )
+			Count = send( Conn->Socket, (const char*)Body.Data + Conn->BodyPos, Count, HTTP_SEND_FLAGS);
+		else
+		{
+#if HTTP_SENDFILE
+			off_t Offset = Conn->BodyPos;
+			Count = sendfile( Conn->Socket, Conn->File, &Offset, Count);
+#else
+			if ( Conn->ChunkPos >= Conn->Chunk.Num() )
+			{
+				Read( Conn, Count);
+				return 1;
+			}
+			Count = send( Conn->Socket, (const char*)&Conn->Chunk(Conn->ChunkPos), Conn->Chunk.Num() - Conn->ChunkPos, HTTP_SEND_FLAGS);
+			if ( Count > 0 )
+				Conn->ChunkPos += Count;
+#endif
+		}
+		if ( Count < 0 )
+			return HttpSendWouldBlock();
+		if ( Count == 0 ) //File got shorter
+			return 0;
+		Conn->BodyPos += Count;
+		Conn->LastActive = Now;
+		Sent += Count;
+		KBSent = (int32)(Sent / 1024);
+		if ( Conn->BodyPos < Conn->BodySize )
+			return 1;
+	}
+
+	Conn->EndResponse();
+	return Conn->bKeepAlive;
+}
+
+void FHttpServerJob::ClaimResponses()
+{
+	TArray<FHttpRequest*> Resolved;
+	{
+		CSpinLock SL(&Lock);
+		if ( !Responses.Num() )
+			return;
+		Resolved = Responses;
+		Responses.Empty();
+	}
+	for ( INT i=0; i<Resolved.Num(); i++)
+	{
+		FHttpRequest* Request = Resolved(i);
+		INT j;
+		for ( j=0; j<Connections.Num(); j++)
+			if ( Connections(j)->Id == Request->Connection )
+				break;
+		if ( (j < Connections.Num()) && Connections(j)->bWaiting )
+			Respond( Connections(j), Request);
+		else //Connection is gone
+			delete Request;
+	}
+}
+
+
+#if !HTTP_SENDFILE
+//
+// Hand the file to a reader, the connection sits out polling until it's back
+//
+void FHttpServerJob::Read( FHttpConnection* Conn, INT Count)
+{
+	Readers->Add( new FHttpReadJob( Conn->Id, Conn->Request->Body.Filename, Conn->File, Count) );
+	Conn->File = nullptr;
+	Conn->bReading = 1;
+}
+
+void FHttpServerJob::ClaimReads()
+{
+	FAsyncJob* Job;
+	while ( (Job=Readers->GetFinished()) != nullptr )
+	{
+		FHttpReadJob* ReadJob = (FHttpReadJob*)Job;
+		FHttpConnection* Conn = nullptr;
+		for ( INT i=0; i<Connections.Num(); i++)
+			if ( Connections(i)->Id == ReadJob->Connection )
+			{
+				Conn = Connections(i);
+				break;
+			}
+
+		// Connection is gone or moved on, the job deletes the file
+		if ( Conn && Conn->bReading && Conn->Request )
+		{
+			Conn->bReading = 0;
+			Conn->File = ReadJob->File;
+			ReadJob->File = nullptr;
+			if ( ReadJob->Count == 0 )
+			{
+				if ( ReadJob->bError )
+					Conn->Request->Status = 404;
+				Respond( Conn, Conn->Request);
+			}
+			else if ( ReadJob->bError )
+			{
+				// Body can't be completed, end it and drop the connection
+				Conn->BodySize = Conn->BodyPos;
+				Conn->bKeepAlive = 0;
+			}
+			else
+			{
+				Conn->Chunk = ReadJob->Chunk;
+				Conn->ChunkPos = 0;
+			}
+		}
+		delete Job;
+	}
+}
+#endif
+
+
+/*-----------------------------------------------------------------------------
+	FHttpRedirectServer.
+-----------------------------------------------------------------------------*/
+
+FHttpRedirectServer::FHttpRedirectServer()
+	: Port(0)
+	, Queue(nullptr)
+	, Job(nullptr)
+	, LastRetry(0)
+{}
+
+FHttpRedirectServer::~FHttpRedirectServer()
+{
+	Stop();
+}
+
+UBOOL FHttpRedirectServer::Listen( INT InPort, INT MaxConnections, FString& Error)
+{
+	guard(FHttpRedirectServer::Listen);
+
+	Stop();
+	Error.Empty();
+#if _WINDOWS
+	static UBOOL bStarted = 0;
+	WSADATA Data;
+	if ( !bStarted && WSAStartup( MAKEWORD(2,2), &Data) )
+	{
+		Error = TEXT("WSAStartup failed");
+		return 0;
+	}
+	bStarted = 1;
+#endif
+
+	FHttpSocket Listener = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if ( Listener == HTTP_INVALID_SOCKET )
+	{
+		Error = TEXT("Cannot create socket");
+		return 0;
+	}
+#if __UNIX__
+	int Reuse = 1;
+	setsockopt( Listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&Reuse, sizeof(Reuse));
+#endif
+
+	sockaddr_in Addr;
+	appMemzero( &Addr, sizeof(Addr));
+	Addr.sin_family      = AF_INET;
+	Addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	Addr.sin_port        = htons( (WORD)InPort);
+	socklen_t AddrSize = sizeof(Addr);
+	if ( bind( Listener, (sockaddr*)&Addr, sizeof(Addr)) )
+		Error = FString::Printf( TEXT("Cannot bind port %i"), InPort);
+	else if ( listen( Listener, 16) )
+		Error = TEXT("Cannot listen");
+	else if ( !HttpSetNonBlocking( Listener) )
+		Error = TEXT("Cannot make socket non-blocking");
+	else if ( getsockname( Listener, (sockaddr*)&Addr, &AddrSize) )
+		Error = TEXT("Cannot get port");
+	if ( Error.Len() )
+	{
+		HttpCloseSocket( Listener);
+		return 0;
+	}
+
+	Port  = ntohs( Addr.sin_port);
+	Queue = new FAsyncJobQueue( 1);
+	Job   = new FHttpServerJob( Listener, Clamp( MaxConnections, 1, HTTP_MAX_CONNECTIONS) );
+	Queue->Add( Job);
+	return 1;
+
+	unguard;
+}
+
+//
+// Connections are closed by the event loop, data being sent stays alive until then
+//
+void FHttpRedirectServer::Stop()
+{
+	guard(FHttpRedirectServer::Stop);
+
+	if ( Queue )
+	{
+		Queue->Release();
+		Queue = nullptr;
+		Job = nullptr;
+	}
+	for ( INT i=0; i<Waiting.Num(); i++)
+		delete Waiting(i);
+	Waiting.Empty();
+	Port = 0;
+
+	unguard;
+}
+
+void FHttpRedirectServer::Tick( ULZMAServer* Server)
+{
+	guard(FHttpRedirectServer::Tick);
+
+	if ( !Job )
+		return;
+	INT FirstNew = Waiting.Num();
+	{
+		CSpinLock SL(&Job->Lock);
+		for ( INT i=0; i<Job->Requests.Num(); i++)
+			Waiting.AddItem( Job->Requests(i) );
+		Job->Requests.Empty();
+	}
+	if ( !Waiting.Num() )
+		return;
+
+	// New requests are looked up right away, pending ones now and then
+	TArray<FHttpRequest*> Answered;
+	FTime Now = appSeconds();
+	INT First = FirstNew;
+	if ( Now - LastRetry >= HTTP_PENDING_RETRY )
+	{
+		LastRetry = Now;
+		First = 0;
+	}
+	for ( INT i=First; i<Waiting.Num(); i++)
+	{
+		FHttpRequest* Request = Waiting(i);
+		INT Result = Server ? Server->ExportSource( Request->Name, Request->Body) : LZMAEXPORT_NotFound;
+		if ( Result == LZMAEXPORT_Ready )
+			Request->Status = 200;
+		else if ( Result == LZMAEXPORT_NotFound )
+			Request->Status = 404;
+		else if ( Now - Request->Time > HTTP_PENDING_TIMEOUT )
+			Request->Status = 503;
+		else
+			continue;
+		Answered.AddItem( Request);
+		Waiting.Remove( i--);
+	}
+
+	if ( Answered.Num() )
+	{
+		CSpinLock SL(&Job->Lock);
+		for ( INT i=0; i<Answered.Num(); i++)
+			Job->Responses.AddItem( Answered(i) );
+	}
+
+	unguard;
+}
+
+void FHttpRedirectServer::GetStats( INT& Connections, INT& Requests, INT& KBSent)
+{
+	Connections = Job ? Job->NumConnections : 0;
+	Requests    = Job ? Job->NumRequests : 0;
+	KBSent      = Job ? Job->KBSent : 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+	UHttpRedirectTestCommandlet.
+-----------------------------------------------------------------------------*/
+
+//
+// Blocking-free client, the main thread has to keep ticking the LZMA server
+//
+struct FHttpTestClient
+{
+	FHttpSocket  Socket;
+	TArray<BYTE> In;
+
+	FHttpTestClient()
+		: Socket(HTTP_INVALID_SOCKET)
+	{}
+	~FHttpTestClient()
+	{
+		Close();
+	}
+
+	UBOOL Connect( INT Port)
+	{
+		Close();
+		Socket = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if ( Socket == HTTP_INVALID_SOCKET )
+			return 0;
+		sockaddr_in Addr;
+		appMemzero( &Addr, sizeof(Addr));
+		Addr.sin_family      = AF_INET;
+		Addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		Addr.sin_port        = htons( (WORD)Port);
+		if ( connect( Socket, (sockaddr*)&Addr, sizeof(Addr)) || !HttpSetNonBlocking(Socket) )
+		{
+			Close();
+			return 0;
+		}
+		return 1;
+	}
+
+	void Close()
+	{
+		if ( Socket != HTTP_INVALID_SOCKET )
+			HttpCloseSocket( Socket);
+		Socket = HTTP_INVALID_SOCKET;
+		In.Empty();
+	}
+
+	UBOOL Request( const TCHAR* Method, const TCHAR* Path, const TCHAR* Version=TEXT("HTTP/1.1"))
+	{
+		ANSICHAR Buffer[1024];
+		HttpToAnsi( *FString::Printf( TEXT("%s /%s %s\r\nHost: localhost\r\n\r\n"), Method, Path, Version), Buffer, ARRAY_COUNT(Buffer));
+		INT Len = (INT)strlen( Buffer);
+		return send( Socket, Buffer, Len, HTTP_SEND_FLAGS) == Len;
+	}
+
+	// Returns true when a whole response was received
+	UBOOL Poll( UBOOL bHead, INT& Status, TArray<BYTE>& Body, UBOOL& bClosed)
+	{
+		BYTE Buffer[16384];
+		INT Count;
+		while ( (Count=recv( Socket, (char*)Buffer, sizeof(Buffer), 0)) > 0 )
+			appMemcpy( &In(In.Add(Count)), Buffer, Count);
+		bClosed = (Count == 0);
+
+		INT End = INDEX_NONE;
+		for ( INT i=3; i<In.Num() && (End == INDEX_NONE); i++)
+			if ( (In(i) == '\n') && (In(i-1) == '\r') && (In(i-2) == '\n') && (In(i-3) == '\r') )
+				End = i + 1;
+		if ( (End == INDEX_NONE) || (End > HTTP_MAX_HEADER) )
+			return 0;
+
+		ANSICHAR Header[HTTP_MAX_HEADER+1];
+		appMemcpy( Header, &In(0), End);
+		Header[End] = 0;
+		INT Size = 0;
+		if ( sscanf( Header, "HTTP/1.1 %i", &Status) != 1 )
+			Status = 0;
+		for ( const ANSICHAR* C=Header; *C; C++)
+			if ( HttpMatch(C,"\r\nContent-Length:") )
+				Size = atoi( C + 17);
+		if ( bHead )
+			Size = 0;
+		if ( In.Num() < End + Size )
+			return 0;
+
+		Body.Empty();
+		Body.Add( Size);
+		if ( Size )
+			appMemcpy( &Body(0), &In(End), Size);
+		In.Remove( 0, End + Size);
+		return 1;
+	}
+};
+
+void UHttpRedirectTestCommandlet::StaticConstructor()
+{
+	LogToStdout     = 1;
+	IsClient        = 0;
+	IsEditor        = 0;
+	IsServer        = 1;
+	LazyLoad        = 1;
+	ShowErrorCount  = 0;
+}
+
+//
+// ucc XC_Core.HttpRedirectTest <Package> [<Package>...] [-port=0] [-timeout=120]
+//
+// Every package is requested by filename and HEAD by GUID over a single pipelined
+// keep-alive connection, bodies are compared with the LZMA server's sources.
+// Finishes with a missing file and a HTTP/1.0 request that must close the connection.
+//
+INT UHttpRedirectTestCommandlet::Main( const TCHAR* Parms )
+{
+	INT   Port    = 0;
+	FLOAT Timeout = 120.f;
+
+	TArray<FString> Packages;
+	FString Token;
+	while ( ParseToken(Parms,Token,0) )
+	{
+		if ( Token.Left(1) != TEXT("-") )
+			new(Packages) FString(Token);
+		else if ( Token.Left(6) == TEXT("-port=") )
+			Port = Clamp( appAtoi(*Token + 6), 0, 65535);
+		else if ( Token.Left(9) == TEXT("-timeout=") )
+			Timeout = Max( appAtof(*Token + 9), 1.f);
+	}
+	if ( !Packages.Num() )
+		appErrorf( TEXT("No packages specified"));
+
+	UPackageMap* Map = ConstructObject<UPackageMap>( UPackageMap::StaticClass() );
+	for ( INT i=0; i<Packages.Num(); i++)
+	{
+		ULinkerLoad* Linker = UObject::GetPackageLinker( nullptr, *Packages(i), LOAD_NoWarn|LOAD_Quiet, nullptr, nullptr);
+		if ( !Linker )
+		{
+			warnf( TEXT("Skipping %s, package not found"), *Packages(i));
+			continue;
+		}
+		INT j = Map->AddLinker( Linker);
+		Map->List(j).PackageFlags |= PKG_AllowDownload;
+	}
+	Map->Compute();
+	if ( !Map->List.Num() )
+		appErrorf( TEXT("No packages to serve"));
+
+	ULZMAServer* LZMA = ConstructObject<ULZMAServer>( ULZMAServer::StaticClass() );
+	LZMA->Init();
+	LZMA->UpdatePackageMap( Map);
+
+	FString Error;
+	FHttpRedirectServer Server;
+	if ( !Server.Listen( Port, 4, Error) )
+		appErrorf( TEXT("HTTP server: %s"), *Error);
+	warnf( TEXT("HTTP redirect test: %i files on port %i"), Map->List.Num(), Server.GetPort() );
+
+	FHttpTestClient Client;
+	if ( !Client.Connect( Server.GetPort()) )
+		appErrorf( TEXT("Cannot connect to localhost:%i"), Server.GetPort() );
+
+	INT Errors = 0;
+	FTime LastTime = appSeconds();
+	for ( INT Step=0; Step<Map->List.Num()+1; Step++)
+	{
+		UBOOL bLast = (Step == Map->List.Num());
+		FPackageInfo* Info = bLast ? nullptr : &Map->List(Step);
+		FString Filename, GuidName;
+		if ( Info )
+		{
+			INT Separator = Max( Info->Linker->Filename.InStr(TEXT("/"),1), Info->Linker->Filename.InStr(TEXT("\\"),1) );
+			Filename = Info->Linker->Filename.Mid(Separator+1) + COMPRESSED_EXTENSION;
+			GuidName = Info->Guid.String() + COMPRESSED_EXTENSION;
+			Client.Request( TEXT("GET"), *Filename);
+			Client.Request( TEXT("HEAD"), *GuidName);
+		}
+		else
+		{
+			Filename = GuidName = TEXT("NoSuchPackage.u.lzma");
+			Client.Request( TEXT("GET"), *Filename);
+			Client.Request( TEXT("GET"), *GuidName, TEXT("HTTP/1.0"));
+		}
+
+		// Both responses
+		FTime Start = appSeconds();
+		for ( INT Response=0; Response<2; )
+		{
+			FTime Now = appSeconds();
+			LZMA->Tick( Max<FLOAT>( Now - LastTime, 0.0001f) );
+			Server.Tick( LZMA);
+			LastTime = Now;
+
+			INT Status;
+			TArray<BYTE> Body;
+			UBOOL bClosed;
+			const TCHAR* Name = Response ? *GuidName : *Filename;
+			if ( Client.Poll( Response && !bLast, Status, Body, bClosed) )
+			{
+				FString Result;
+				INT Expected = bLast ? 404 : 200;
+				if ( Status != Expected )
+					Result = FString::Printf( TEXT("expected %i"), Expected);
+				else if ( Info && !Response )
+				{
+					// Must be exactly what the file channel sends
+					FLZMASourceBase* Source = LZMA->GetSource( *Info);
+					FArchive* Reader = Source ? Source->CreateReader() : nullptr;
+					if ( !Reader || !Body.Num() || (Reader->TotalSize() != Body.Num()) )
+						Result = TEXT("size mismatch");
+					else
+					{
+						TArray<BYTE> Data( Body.Num() );
+						Reader->Serialize( &Data(0), Data.Num() );
+						if ( appMemcmp( &Data(0), &Body(0), Data.Num()) )
+							Result = TEXT("data mismatch");
+					}
+					if ( Reader )
+						delete Reader;
+				}
+				warnf( TEXT("%s %s: %i, %i bytes in %.0f ms %s"), (Response && !bLast) ? TEXT("HEAD") : TEXT("GET"), Name, Status, Body.Num()
+					, 1000.0 * (appSeconds() - Start), Result.Len() ? *Result : TEXT("OK"));
+				Errors += Result.Len() != 0;
+				Response++;
+				continue;
+			}
+			if ( bClosed )
+			{
+				warnf( TEXT("Connection closed while waiting for %s"), Name);
+				Errors++;
+				break;
+			}
+			if ( Now - Start > Timeout )
+			{
+				warnf( TEXT("Timed out waiting for %s"), Name);
+				Errors++;
+				break;
+			}
+			appSleep( 0.005f);
+		}
+	}
+
+	// HTTP/1.0 without keep-alive
+	UBOOL bClosed = 0;
+	FTime Start = appSeconds();
+	while ( !bClosed && (appSeconds() - Start < 5.0) )
+	{
+		INT Status;
+		TArray<BYTE> Body;
+		Client.Poll( 0, Status, Body, bClosed);
+		appSleep( 0.005f);
+	}
+	if ( !bClosed )
+	{
+		warnf( TEXT("HTTP/1.0 connection was kept open"));
+		Errors++;
+	}
+
+	Server.Tick( LZMA);
+	LZMA->Exec( TEXT("LZMA STATS"), *GWarn);
+	INT Connections, Requests, KBSent;
+	Server.GetStats( Connections, Requests, KBSent);
+	warnf( TEXT("Finished with %i errors: %i requests, %i KB sent"), Errors, Requests, KBSent);
+
+	Client.Close();
+	Server.Stop();
+	delete LZMA;
+
+	GIsRequestingExit = 1;
+	return Errors ? 1 : 0;
+}
+IMPLEMENT_CLASS(UHttpRedirectTestCommandlet)
+
+/*-----------------------------------------------------------------------------
+	The End.
+-----------------------------------------------------------------------------*/
@@ -0,0 +1,157 @@
+/*=============================================================================
+	XC_Hash.cpp:
+	CRC32C of packages, runs close to memory speed so it can be done while
+	receiving or compressing without being noticed.
+=============================================================================*/
+
+#include "XC_Core.h"
+#include "XC_Hash.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+	#define CRC32C_SSE42 1
+	#include <nmmintrin.h>
+	#if _MSC_VER
+		#include <intrin.h>
+		#define CRC32C_TARGET
+	#else
+		#include <cpuid.h>
+		#define CRC32C_TARGET __attribute__((target("sse4.2")))
+	#endif
+#else
+	#define CRC32C_SSE42 0
+#endif
+
+#define CRC32C_POLY 0x82F63B78 //Reflected
+#define CRC32C_FILE_BLOCK (256*1024)
+
+//
+// Slicing-by-8 tables and CPU detection, set up before any thread can hash
+//
+static struct FCrc32CInit
+{
+	DWORD Table[8][256];
+	UBOOL bHardware;
+
+	FCrc32CInit()
+	{
+		for ( INT i=0; i<256; i++)
+		{
+			DWORD Crc = i;
+			for ( INT j=0; j<8; j++)
+				Crc = (Crc >> 1) ^ (CRC32C_POLY & (0 - (Crc & 1)));
+			Table[0][i] = Crc;
+		}
+		for ( INT i=0; i<256; i++)
+			for ( INT t=1; t<8; t++)
+				Table[t][i] = (Table[t-1][i] >> 8) ^ Table[0][Table[t-1][i] & 0xFF];
+
+		bHardware = 0;
+#if CRC32C_SSE42
+	#if _MSC_VER
+		int Info[4];
+		__cpuid( Info, 1);
+		bHardware = (Info[2] & (1 << 20)) != 0;
+	#else
+		unsigned int A, B, C, D;
+		if ( __get_cpuid( 1, &A, &B, &C, &D) )
+			bHardware = (C & bit_SSE4_2) != 0;
+	#endif
+#endif
+	}
+} GCrc32C;
+
+static DWORD Crc32CTable( const BYTE* Data, INT Count, DWORD Crc)
+{
+	for ( ; Count && ((PTRINT)Data & 7); Count--)
+		Crc = (Crc >> 8) ^ GCrc32C.Table[0][(Crc ^ *Data++) & 0xFF];
+	for ( ; Count >= 8; Count-=8, Data+=8)
+	{
+		DWORD Lo = *(const DWORD*)Data ^ Crc;
+		DWORD Hi = *(const DWORD*)(Data+4);
+		Crc = GCrc32C.Table[7][ Lo        & 0xFF] ^ GCrc32C.Table[6][(Lo >>  8) & 0xFF]
+		    ^ GCrc32C.Table[5][(Lo >> 16) & 0xFF] ^ GCrc32C.Table[4][ Lo >> 24        ]
+		    ^ GCrc32C.Table[3][ Hi        & 0xFF] ^ GCrc32C.Table[2][(Hi >>  8) & 0xFF]
+		    ^ GCrc32C.Table[1][(Hi >> 16) & 0xFF] ^ GCrc32C.Table[0][ Hi >> 24        ];
+	}
+	for ( ; Count; Count--)
+		Crc = (Crc >> 8) ^ GCrc32C.Table[0][(Crc ^ *Data++) & 0xFF];
+	return Crc;
+}
+
+#if CRC32C_SSE42
+CRC32C_TARGET static DWORD Crc32CHardware( const BYTE* Data, INT Count, DWORD Crc)
+{
+	for ( ; Count && ((PTRINT)Data & 7); Count--)
+		Crc = _mm_crc32_u8( Crc, *Data++);
+	#if defined(_M_X64) || defined(__x86_64__)
+	QWORD Crc64 = Crc;
+	for ( ; Count >= 32; Count-=32, Data+=32)
+	{
+		Crc64 = _mm_crc32_u64( Crc64, ((const QWORD*)Data)[0]);
+		Crc64 = _mm_crc32_u64( Crc64, ((const QWORD*)Data)[1]);
+		Crc64 = _mm_crc32_u64( Crc64, ((const QWORD*)Data)[2]);
+		Crc64 = _mm_crc32_u64( Crc64, ((const QWORD*)Data)[3]);
+	}
+	for ( ; Count >= 8; Count-=8, Data+=8)
+		Crc64 = _mm_crc32_u64( Crc64, *(const QWORD*)Data);
+	Crc = (DWORD)Crc64;
+	#else
+	for ( ; Count >= 16; Count-=16, Data+=16)
+	{
+		Crc = _mm_crc32_u32( Crc, ((const DWORD*)Data)[0]);
+		Crc = _mm_crc32_u32( Crc, ((const DWORD*)Data)[1]);
+		Crc = _mm_crc32_u32( Crc, ((const DWORD*)Data)[2]);
+		Crc = _mm_crc32_u32( Crc, ((const DWORD*)Data)[3]);
+	}
+	for ( ; Count >= 4; Count-=4, Data+=4)
+		Crc = _mm_crc32_u32( Crc, *(const DWORD*)Data);
+	#endif
+	for ( ; Count; Count--)
+		Crc = _mm_crc32_u8( Crc, *Data++);
+	return Crc;
+}
+#endif
+
+XC_CORE_API DWORD Crc32C( const void* Data, INT Count, DWORD Crc)
+{
+	if ( !Data || (Count <= 0) )
+		return Crc;
+	Crc = ~Crc;
+#if CRC32C_SSE42
+	if ( GCrc32C.bHardware )
+		return ~Crc32CHardware( (const BYTE*)Data, Count, Crc);
+#endif
+	return ~Crc32CTable( (const BYTE*)Data, Count, Crc);
+}
+
+XC_CORE_API UBOOL Crc32CArchive( FArchive& Ar, INT Count, DWORD& Crc)
+{
+	TArray<BYTE> Buffer( Min( Count, CRC32C_FILE_BLOCK) );
+	while ( Count > 0 )
+	{
+		INT Block = Min( Count, Buffer.Num() );
+		Ar.Serialize( &Buffer(0), Block);
+		if ( Ar.IsError() )
+			return 0;
+		Crc = Crc32C( &Buffer(0), Block, Crc);
+		Count -= Block;
+	}
+	return 1;
+}
+
+XC_CORE_API UBOOL Crc32CFile( const TCHAR* Filename, DWORD& Crc, INT Count)
+{
+	Crc = 0;
+	FArchive* Ar = GFileManager->CreateFileReader( Filename);
+	if ( !Ar )
+		return 0;
+	UBOOL bResult = (Count <= Ar->TotalSize()) || (Count == MAXINT);
+	if ( bResult )
+		bResult = Crc32CArchive( *Ar, Min( Count, Ar->TotalSize()), Crc);
+	delete Ar;
+	return bResult;
+}
+
+/*-----------------------------------------------------------------------------
+	The End.
+-----------------------------------------------------------------------------*/
@@ -0,0 +1,328 @@
+/*=============================================================================
+	XC_JobQueue.cpp:
+	Prioritized worker thread pool for XC_Core asynchronous tasks
+=============================================================================*/
+
+#include "XC_Core.h"
+#include "XC_JobQueue.h"
+
+#if __UNIX__
+	#include <pthread.h>
+	#include <sys/time.h>
+#endif
+
+#define ASYNCJOB_IDLE_TIME 5.0f //Idle worker exits after this
+
+
+/*-----------------------------------------------------------------------------
+	FAsyncEvent.
+-----------------------------------------------------------------------------*/
+
+#if __UNIX__
+struct FAsyncEventUnix
+{
+	pthread_mutex_t Mutex;
+	pthread_cond_t  Cond;
+	INT             Count;
+};
+#endif
+
+FAsyncEvent::FAsyncEvent()
+{
+#if __UNIX__
+	FAsyncEventUnix* Event = new FAsyncEventUnix;
+	pthread_mutex_init( &Event->Mutex, nullptr);
+	pthread_cond_init( &Event->Cond, nullptr);
+	Event->Count = 0;
+	Handle = Event;
+#elif _WINDOWS
+	Handle = CreateSemaphoreA( nullptr, 0, MAXINT, nullptr);
+#endif
+}
+
+FAsyncEvent::~FAsyncEvent()
+{
+#if __UNIX__
+	FAsyncEventUnix* Event = (FAsyncEventUnix*)Handle;
+	pthread_cond_destroy( &Event->Cond);
+	pthread_mutex_destroy( &Event->Mutex);
+	delete Event;
+#elif _WINDOWS
+	CloseHandle( (HANDLE)Handle);
+#endif
+}
+
+void FAsyncEvent::Signal( INT Count)
+{
+	if ( Count <= 0 )
+		return;
+#if __UNIX__
+	FAsyncEventUnix* Event = (FAsyncEventUnix*)Handle;
+	pthread_mutex_lock( &Event->Mutex);
+	Event->Count += Count;
+	if ( Count == 1 )
+		pthread_cond_signal( &Event->Cond);
+	else
+		pthread_cond_broadcast( &Event->Cond);
+	pthread_mutex_unlock( &Event->Mutex);
+#elif _WINDOWS
+	ReleaseSemaphore( (HANDLE)Handle, Count, nullptr);
+#endif
+}
+
+UBOOL FAsyncEvent::Wait( FLOAT Seconds)
+{
+#if __UNIX__
+	FAsyncEventUnix* Event = (FAsyncEventUnix*)Handle;
+	timeval Now;
+	gettimeofday( &Now, nullptr);
+	QWORD Nanoseconds = (QWORD)Now.tv_usec * 1000 + (QWORD)(Seconds * 1000000000.0);
+	timespec Until;
+	Until.tv_sec  = Now.tv_sec + (time_t)(Nanoseconds / 1000000000);
+	Until.tv_nsec = (long)(Nanoseconds % 1000000000);
+
+	pthread_mutex_lock( &Event->Mutex);
+	while ( Event->Count <= 0 )
+		if ( pthread_cond_timedwait( &Event->Cond, &Event->Mutex, &Until) != 0 )
+			break;
+	UBOOL bSignalled = Event->Count > 0;
+	if ( bSignalled )
+		Event->Count--;
+	pthread_mutex_unlock( &Event->Mutex);
+	return bSignalled;
+#elif _WINDOWS
+	return WaitForSingleObject( (HANDLE)Handle, (DWORD)(Seconds * 1000.f)) == WAIT_OBJECT_0;
+#endif
+}
+
+
+/*-----------------------------------------------------------------------------
+	FAsyncJobQueue.
+-----------------------------------------------------------------------------*/
+
+
+FAsyncJobQueue::FAsyncJobQueue( INT InMaxThreads)
+	: Lock(0)
+	, SpawnLock(0)
+	, RefCount(1)
+	, bExit(0)
+	, NumThreads(0)
+	, NumIdle(0)
+	, MaxThreads( Clamp(InMaxThreads,1,64) )
+	, FinishedEvent(nullptr)
+{}
+
+FAsyncJobQueue::~FAsyncJobQueue()
+{
+	for ( INT i=0; i<Finished.Num(); i++)
+		delete Finished(i);
+	Finished.Empty();
+	Pending.Empty();
+	Running.Empty();
+}
+
+//
+// Queue a job, the queue owns it until it's claimed via GetFinished
+//
+void FAsyncJobQueue::Add( FAsyncJob* Job)
+{
+	check(Job);
+	INT Spawn;
+	{
+		CSpinLock SL(&Lock);
+		Job->Status = ASYNCJOB_Queued;
+
+		// Highest priority first, keep insertion order for equal priorities
+		INT i = Pending.Num();
+		while ( (i > 0) && (Pending(i-1)->Priority < Job->Priority) )
+			i--;
+		Pending.Insert(i);
+		Pending(i) = Job;
+		Spawn = ReserveWorkers();
+	}
+	SpawnWorkers( Spawn);
+	WakeUp.Signal();
+}
+
+//
+// Claim a finished job, caller must delete it
+//
+FAsyncJob* FAsyncJobQueue::GetFinished()
+{
+	CSpinLock SL(&Lock);
+	FAsyncJob* Job = nullptr;
+	if ( Finished.Num() )
+	{
+		Job = Finished(0);
+		Finished.Remove(0);
+	}
+	return Job;
+}
+
+void FAsyncJobQueue::SetMaxThreads( INT InMaxThreads)
+{
+	INT Spawn;
+	{
+		CSpinLock SL(&Lock);
+		MaxThreads = Clamp(InMaxThreads,1,64);
+		Spawn = ReserveWorkers();
+	}
+	SpawnWorkers( Spawn);
+}
+
+void FAsyncJobQueue::SetFinishedEvent( FAsyncEvent* Event)
+{
+	CSpinLock SL(&Lock);
+	FinishedEvent = Event;
+}
+
+INT FAsyncJobQueue::NumPending()
+{
+	CSpinLock SL(&Lock);
+	return Pending.Num();
+}
+
+INT FAsyncJobQueue::NumActive()
+{
+	CSpinLock SL(&Lock);
+	return Pending.Num() + Running.Num();
+}
+
+//
+// Owner no longer needs this queue
+// Pending and unclaimed jobs are deleted, running jobs are cancelled and deleted by their workers.
+//
+void FAsyncJobQueue::Release()
+{
+	TArray<FAsyncJob*> Discard;
+	INT Idle;
+	{
+		CSpinLock SL(&Lock);
+		bExit = 1;
+		FinishedEvent = nullptr;
+		for ( INT i=0; i<Pending.Num(); i++)
+			Discard.AddItem( Pending(i) );
+		for ( INT i=0; i<Finished.Num(); i++)
+			Discard.AddItem( Finished(i) );
+		for ( INT i=0; i<Running.Num(); i++)
+			Running(i)->Cancelled = 1;
+		Pending.Empty();
+		Finished.Empty();
+		Idle = NumIdle;
+	}
+	for ( INT i=0; i<Discard.Num(); i++)
+		delete Discard(i);
+	WakeUp.Signal( Idle); // Busy workers see bExit when their job ends
+	DecRef();
+}
+
+//
+// Lock must be held
+//
+FAsyncJob* FAsyncJobQueue::PopPending()
+{
+	FAsyncJob* Job = nullptr;
+	if ( Pending.Num() )
+	{
+		Job = Pending(0);
+		Pending.Remove(0);
+		Running.AddItem(Job);
+	}
+	return Job;
+}
+
+//
+// Lock must be held
+// Workers are accounted for here so the caller can create them after releasing the lock
+//
+INT FAsyncJobQueue::ReserveWorkers()
+{
+	INT Count = 0;
+	while ( (NumIdle < Pending.Num()) && (NumThreads < MaxThreads) )
+	{
+		RefCount++;
+		NumThreads++;
+		NumIdle++;
+		Count++;
+	}
+	return Count;
+}
+
+void FAsyncJobQueue::SpawnWorkers( INT Count)
+{
+	// Worker cannot delete its handler until we're done constructing it
+	CSpinLock SL(&SpawnLock);
+	while ( Count-- > 0 )
+		new CThread( &FAsyncJobQueue::WorkerProc, this, 0);
+}
+
+void FAsyncJobQueue::DecRef()
+{
+	INT Refs;
+	{
+		CSpinLock SL(&Lock);
+		Refs = --RefCount;
+	}
+	if ( Refs == 0 )
+		delete this;
+}
+
+uint32 FAsyncJobQueue::WorkerProc( void* Arg, CThread* Handler)
+{
+	FAsyncJobQueue* Queue = (FAsyncJobQueue*)Arg;
+	UBOOL bTimedOut = 0;
+	for ( ; ; )
+	{
+		FAsyncJob* Job = nullptr;
+		{
+			CSpinLock SL(&Queue->Lock);
+			if ( !Queue->bExit )
+				Job = Queue->PopPending();
+			if ( !Job && (Queue->bExit || bTimedOut) )
+			{
+				Queue->NumIdle--;
+				Queue->NumThreads--;
+				break;
+			}
+			if ( Job )
+				Queue->NumIdle--;
+		}
+
+		if ( !Job )
+		{
+			bTimedOut = !Queue->WakeUp.Wait( ASYNCJOB_IDLE_TIME);
+			continue;
+		}
+
+		bTimedOut = 0;
+		Job->Status = ASYNCJOB_Running;
+		try { Job->Run(); } catch(...) {}
+		Job->Status = ASYNCJOB_Finished;
+
+		UBOOL bDiscard;
+		{
+			CSpinLock SL(&Queue->Lock);
+			Queue->Running.RemoveItem(Job);
+			Queue->NumIdle++;
+			bDiscard = Queue->bExit;
+			if ( !bDiscard )
+			{
+				Queue->Finished.AddItem(Job);
+				if ( Queue->FinishedEvent ) // Under the lock, the owner may be releasing us
+					Queue->FinishedEvent->Signal();
+			}
+		}
+		if ( bDiscard )
+			delete Job;
+	}
+
+	{ CSpinLock SL(&Queue->SpawnLock); }
+	Handler->Detach();
+	delete Handler;
+	Queue->DecRef();
+	return THREAD_END_OK;
+}
+
+/*-----------------------------------------------------------------------------
+	The End.
+-----------------------------------------------------------------------------*/
@@ -13,6 +13,9 @@
 #include "UnLinker.h"
 #include "FConfigCacheIni.h"
 #include "XC_LZMA.h"
+#include "XC_Delta.h"
+#include "XC_Hash.h"
+#include "XC_HTTP.h"
 
 #include "Cacus/CacusBase.h"
 #include "Cacus/Atomics.h"
@@ -37,19 +40,80 @@ typedef int (STDCALL *XCFN_LZMA_Compress)(unsigned char *dest, size_t *destLen,
   int numThreads /* 1 or 2, default = 2 */
   );
 
-//Dictionary size changed from 16mb to 4mb to ease memory usage, besides we're only compressing small files
-static INT lzma_threads = 1;
-#define DEFAULT_LZMA_PARMS 5, (1<<22), 3, 0, 2, 32, lzma_threads
+// Encoder settings are chosen per package, see FLZMAProfile
+#define LZMA_PARMS(P) (P).Level, (P).DictSize, (P).lc, (P).lp, (P).pb, (P).fb, (P).NumThreads
   
 typedef int (STDCALL *XCFN_LZMA_Uncompress) (unsigned char *dest, size_t *destLen, const unsigned char *src, SizeT *srcLen,
   const unsigned char *props, size_t propsSize);
 
+// LZMA SDK streaming interfaces (7zTypes.h, LzmaEnc.h, LzmaDec.h)
+// The stock LzmaLib (LzmaLib.def) only exports LzmaCompress/LzmaUncompress.
+// Streaming needs LZMA.dll/LZMA.so built from the SDK's C sources with LzmaEnc_*,
+// LzmaEncProps_Init and LzmaDec_* exported as well, anything else compresses and
+// decompresses in memory. Both paths are verified with a small round trip on load.
+struct FLzmaSeqInStream  { int    (*Read)( void* p, void* Buf, size_t* Size); };
+struct FLzmaSeqOutStream { size_t (*Write)( void* p, const void* Buf, size_t Size); };
+struct FLzmaProgress     { int    (*Progress)( void* p, uint64 InSize, uint64 OutSize); };
+struct FLzmaAlloc        { void*  (*Alloc)( void* p, size_t Size); void (*Free)( void* p, void* Address); };
+
+//
+// CLzmaEncProps, the layout depends on the SDK version:
+// 4.x and 16.04+ : level, dictSize, lc, lp, pb, algo, fb, btMode, numHashBytes, mc, writeEndMark, numThreads (, UInt64 reduceSize...)
+// 9.20 - 15.14   : level, dictSize, UInt32 reduceSize, lc, ...
+// Only filled through LzmaEncProps_Init, fields are then located by LzmaEncPropsShift.
+//
+struct FLzmaEncProps
+{
+	int32 Fields[32];
+
+	enum { level=0, dictSize=1, lc=2, lp=3, pb=4, algo=5, fb=6, btMode=7, numHashBytes=8, mc=9, writeEndMark=10, numThreads=11 };
+	int32& operator[]( INT Field);
+};
+static INT LzmaEncPropsShift = -1; //Unknown layout, no streaming encoder
+
+int32& FLzmaEncProps::operator[]( INT Field)
+{
+	return Fields[ (Field <= dictSize) ? Field : (Field + LzmaEncPropsShift) ];
+}
+
+// CLzmaDec is constructed by a macro in the SDK, we provide zeroed storage instead.
+// Known versions use less than 200 bytes, LzmaValidateStreaming checks the rest stays untouched.
+#define LZMA_DEC_STATE_SIZE 512
+
+typedef void* (*XCFN_LzmaEnc_Create)( FLzmaAlloc* Alloc);
+typedef void  (*XCFN_LzmaEnc_Destroy)( void* Enc, FLzmaAlloc* Alloc, FLzmaAlloc* AllocBig);
+typedef void  (*XCFN_LzmaEncProps_Init)( FLzmaEncProps* Props);
+typedef int   (*XCFN_LzmaEnc_SetProps)( void* Enc, const FLzmaEncProps* Props);
+typedef int   (*XCFN_LzmaEnc_WriteProperties)( void* Enc, uint8* Props, size_t* Size);
+typedef int   (*XCFN_LzmaEnc_Encode)( void* Enc, FLzmaSeqOutStream* OutStream, FLzmaSeqInStream* InStream, FLzmaProgress* Progress, FLzmaAlloc* Alloc, FLzmaAlloc* AllocBig);
+typedef int   (*XCFN_LzmaDec_Allocate)( void* Dec, const uint8* Props, unsigned PropsSize, FLzmaAlloc* Alloc);
+typedef void  (*XCFN_LzmaDec_Free)( void* Dec, FLzmaAlloc* Alloc);
+typedef void  (*XCFN_LzmaDec_Init)( void* Dec);
+typedef int   (*XCFN_LzmaDec_DecodeToBuf)( void* Dec, uint8* Dest, size_t* DestLen, const uint8* Src, size_t* SrcLen, int FinishMode, int* Status);
+
 static CScopedLibrary LZMA;
 static XCFN_LZMA_Compress LzmaCompressFunc = 0;
 static XCFN_LZMA_Uncompress LzmaDecompressFunc = 0;
+static XCFN_LzmaEnc_Create          LzmaEnc_Create = 0;
+static XCFN_LzmaEnc_Destroy         LzmaEnc_Destroy = 0;
+static XCFN_LzmaEncProps_Init       LzmaEncProps_Init = 0;
+static XCFN_LzmaEnc_SetProps        LzmaEnc_SetProps = 0;
+static XCFN_LzmaEnc_WriteProperties LzmaEnc_WriteProperties = 0;
+static XCFN_LzmaEnc_Encode          LzmaEnc_Encode = 0;
+static XCFN_LzmaDec_Allocate        LzmaDec_Allocate = 0;
+static XCFN_LzmaDec_Free            LzmaDec_Free = 0;
+static XCFN_LzmaDec_Init            LzmaDec_Init = 0;
+static XCFN_LzmaDec_DecodeToBuf     LzmaDec_DecodeToBuf = 0;
+static const TCHAR* LzmaStreamingEncodeError = nullptr; //Set if the streaming encoder was disabled on load
+static const TCHAR* LzmaStreamingDecodeError = nullptr;
+static void LzmaValidateStreaming();
+static void LzmaLogEncoder();
 
 #define LZMA_CACHE_PATH TEXT("../LzmaCache/")
 #define LZMA_CACHE_INI  LZMA_CACHE_PATH TEXT("LzmaCache.ini")
+#define LZMA_CACHE_MANIFEST LZMA_CACHE_PATH TEXT("LzmaCache.bin")
+#define LZMA_DELTA_PATH LZMA_CACHE_PATH TEXT("Delta/")
+#define LZMA_DELTA_MAX_FAILED 4096 //Forget failed deltas past this, they'll be retried once
 
 /*-----------------------------------------------------------------------------
 	Utils
@@ -69,17 +133,45 @@ static bool GetHandles()
 		{
 			LzmaCompressFunc = NewLZMA.Get<XCFN_LZMA_Compress>("LzmaCompress");
 			LzmaDecompressFunc = NewLZMA.Get<XCFN_LZMA_Uncompress>("LzmaUncompress");
+			LzmaEnc_Create          = NewLZMA.Get<XCFN_LzmaEnc_Create>("LzmaEnc_Create");
+			LzmaEnc_Destroy         = NewLZMA.Get<XCFN_LzmaEnc_Destroy>("LzmaEnc_Destroy");
+			LzmaEncProps_Init       = NewLZMA.Get<XCFN_LzmaEncProps_Init>("LzmaEncProps_Init");
+			LzmaEnc_SetProps        = NewLZMA.Get<XCFN_LzmaEnc_SetProps>("LzmaEnc_SetProps");
+			LzmaEnc_WriteProperties = NewLZMA.Get<XCFN_LzmaEnc_WriteProperties>("LzmaEnc_WriteProperties");
+			LzmaEnc_Encode          = NewLZMA.Get<XCFN_LzmaEnc_Encode>("LzmaEnc_Encode");
+			LzmaDec_Allocate        = NewLZMA.Get<XCFN_LzmaDec_Allocate>("LzmaDec_Allocate");
+			LzmaDec_Free            = NewLZMA.Get<XCFN_LzmaDec_Free>("LzmaDec_Free");
+			LzmaDec_Init            = NewLZMA.Get<XCFN_LzmaDec_Init>("LzmaDec_Init");
+			LzmaDec_DecodeToBuf     = NewLZMA.Get<XCFN_LzmaDec_DecodeToBuf>("LzmaDec_DecodeToBuf");
+			if ( LzmaCompressFunc && LzmaDecompressFunc )
+				LzmaValidateStreaming();
 			ExchangeRaw( LZMA, NewLZMA); // Ugly
 		}
 	}
 	return LZMA && LzmaCompressFunc && LzmaDecompressFunc;
 }
 
+//Streaming encoder is optional
+static bool GetEncoderHandles()
+{
+	return GetHandles() && LzmaEnc_Create && LzmaEnc_Destroy && LzmaEncProps_Init
+		&& LzmaEnc_SetProps && LzmaEnc_WriteProperties && LzmaEnc_Encode;
+}
+
+//Streaming decoder is optional
+static bool GetDecoderHandles()
+{
+	return GetHandles() && LzmaDec_Allocate && LzmaDec_Free && LzmaDec_Init && LzmaDec_DecodeToBuf;
+}
+
 
 
 #if __UNIX__
 #include "sys/types.h"
 #include "sys/stat.h"
+#include "sys/mman.h"
+#include "fcntl.h"
+#include "unistd.h"
 static double GetFileAge( const TCHAR* Filename )
 {
 	struct stat Buf;
@@ -112,22 +204,141 @@ static double GetFileAge( const TCHAR* Filename )
 /*-----------------------------------------------------------------------------
 	ULZMACompressCommandlet.
 -----------------------------------------------------------------------------*/
+//
+// Compresses a single file in a worker thread
+//
+class FLZMACommandletJob : public FAsyncJob
+{
+public:
+	FString Src;
+	FString Dest;
+	INT     SrcSize;
+	INT     DestSize;
+	FLOAT   Time;
+	FLZMAParams Params;
+	TCHAR   Error[256];
+
+	FLZMACommandletJob( const FString& InSrc, INT InSrcSize)
+		: FAsyncJob( InSrcSize / 1024) //Largest first for a better balance
+		, Src(InSrc)
+		, Dest(InSrc + COMPRESSED_EXTENSION)
+		, SrcSize(InSrcSize)
+		, DestSize(0)
+		, Time(0)
+		, Params( LzmaGetParams(*InSrc,InSrcSize) )
+	{
+		Error[0] = '\0';
+	}
+
+	void Run()
+	{
+		FTime StartTime = appSeconds();
+		if ( LzmaCompress( *Src, *Dest, Error, Params) )
+			DestSize = GFileManager->FileSize( *Dest);
+		Time = appSeconds() - StartTime;
+	}
+};
+
+//
+// Adds a directory's packages, subdirectories included
+//
+static void FindPackagesInDirectory( const FString& Dir, TArray<FString>& Result)
+{
+	static const TCHAR* Extensions[] = { TEXT("u"), TEXT("utx"), TEXT("uax"), TEXT("umx"), TEXT("unr"), TEXT("usx") }; //Packages only
+	for ( INT e=0; e<ARRAY_COUNT(Extensions); e++)
+	{
+		TArray<FString> Files = GFileManager->FindFiles( *FString::Printf(TEXT("%s*.%s"), *Dir, Extensions[e]), 1, 0);
+		for ( INT i=0; i<Files.Num(); i++)
+			new(Result) FString( Dir + Files(i));
+	}
+	TArray<FString> SubDirs = GFileManager->FindFiles( *(Dir + TEXT("*")), 0, 1);
+	for ( INT i=0; i<SubDirs.Num(); i++)
+		if ( (SubDirs(i) != TEXT(".")) && (SubDirs(i) != TEXT("..")) )
+			FindPackagesInDirectory( Dir + SubDirs(i) + PATH_SEPARATOR, Result);
+}
+
+class FLZMALiveData;
+static UBOOL LzmaLiveAppend( FLZMALiveData* Live, const void* Data, INT Count);
+static void LzmaCompress( FArchive* Reader, void*& CompressedData, size_t& CompressedSize, TCHAR* Error, const FLZMAParams& Params, volatile int32* Cancel=nullptr, FLZMALiveData* Live=nullptr, DWORD* Hash=nullptr);
+
+//
+// Compress files in memory with every profile and report the results
+//
+static void LzmaBenchmark( const TArray<FString>& Files)
+{
+	TArray<FLZMAProfile>& List = LzmaGetProfiles();
+	for ( INT i=0; i<Files.Num(); i++)
+	{
+		TArray<BYTE> Data;
+		if ( !appLoadFileToArray( Data, *Files(i)) || !Data.Num() )
+		{
+			warnf( TEXT("Unable to load %s"), *Files(i));
+			continue;
+		}
+		FLZMAParams Selected = LzmaGetParams( *Files(i), Data.Num());
+		warnf( TEXT("Benchmarking %s (%i KB)"), *Files(i), Data.Num() / 1024);
+		for ( INT j=0; j<List.Num(); j++)
+		{
+			const FLZMAParams& Params = List(j).Params;
+			TCHAR Error[256] = {0};
+			void* CompressedData;
+			size_t CompressedSize;
+			FBufferReader Reader( Data);
+			FTime StartTime = appSeconds();
+			LzmaCompress( &Reader, CompressedData, CompressedSize, Error, Params);
+			FLOAT Time = Max<FLOAT>( appSeconds() - StartTime, 0.001f);
+			if ( !CompressedData )
+			{
+				warnf( TEXT("   %-12s failed: %s"), *List(j).Name, Error);
+				continue;
+			}
+			free( CompressedData);
+			UBOOL bSelected = !appMemcmp( &Params, &Selected, sizeof(FLZMAParams));
+			warnf( TEXT("%s %-12s L%i %2iMB T%i: %8i KB (%5.1f%%) %6.2fs %6.2f MB/s"), bSelected ? TEXT(" *") : TEXT("  ")
+				, *List(j).Name, Params.Level, Params.DictSize / (1024*1024), Params.NumThreads
+				, (INT)(CompressedSize / 1024), 100.0 * (DOUBLE)CompressedSize / (DOUBLE)Data.Num()
+				, Time, (DOUBLE)Data.Num() / (1024.0 * 1024.0) / Time);
+		}
+	}
+}
+
 INT ULZMACompressCommandlet::Main( const TCHAR* Parms )
 {
 	FString Wildcard;
-	TCHAR Error[256] = {0};
 	if( !ParseToken(Parms,Wildcard,0) )
 		appErrorf(TEXT("Source file(s) not specified"));
-#ifdef _MSC_VER
-	lzma_threads = 2;
-#endif
 	OSpath(Parms);
 	OSpath(*Wildcard);
+
+	INT Threads = 1;
+	UBOOL bIncremental = 0;
+	UBOOL bBenchmark = 0;
+	TArray<FString> Sources;
 	do
 	{
         // skip "-nohomedir", etc... --ryan.
         if ((Wildcard.Len() > 0) && ( (*Wildcard)[0] == '-'))
+		{
+			if ( Wildcard.Left(9) == TEXT("-threads=") )
+				Threads = Clamp( appAtoi(*Wildcard + 9), 1, 64);
+			else if ( Wildcard == TEXT("-incremental") )
+				bIncremental = 1;
+			else if ( Wildcard == TEXT("-benchmark") )
+				bBenchmark = 1;
             continue;
+		}
+
+		// Directories are searched for packages
+		if ( Wildcard.Right(1) == TEXT("/") || Wildcard.Right(1) == TEXT("\\") )
+		{
+			FindPackagesInDirectory( Wildcard, Sources);
+			continue;
+		}
+		else if ( (GFileManager->FileSize(*Wildcard) < 0) && (Wildcard.InStr(TEXT("*")) == -1) && GFileManager->FindFiles(*Wildcard,0,1).Num() )
+		{
+			FindPackagesInDirectory( Wildcard + PATH_SEPARATOR, Sources);
+			continue;
+		}
 
 		FString Dir;
 		INT i = Max( Wildcard.InStr( TEXT("\\"), 1), Wildcard.InStr( TEXT("/"), 1));
@@ -137,24 +348,82 @@ INT ULZMACompressCommandlet::Main( const TCHAR* Parms )
 		if( !Files.Num() )
 			appErrorf(TEXT("Source %s not found"), *Wildcard);
 		for( INT j=0;j<Files.Num();j++)
+			new(Sources) FString( Dir + Files(j));
+	}
+	while( ParseToken(Parms,Wildcard,0) );
+
+	// Load library and profiles before workers need them
+	if ( !GetHandles() )
+		appErrorf(TEXT("Unable to load LZMA library"));
+	LzmaLogEncoder();
+	LzmaGetProfiles();
+
+	if ( bBenchmark )
+	{
+		LzmaBenchmark( Sources);
+		return 0;
+	}
+
+	FTime StartTime = appSeconds();
+	FAsyncJobQueue* Queue = new FAsyncJobQueue(Threads);
+	INT Queued = 0;
+	INT Skipped = 0;
+	for ( INT i=0; i<Sources.Num(); i++)
+	{
+		const FString& Src = Sources(i);
+		if ( Src.Right(appStrlen(COMPRESSED_EXTENSION)) == COMPRESSED_EXTENSION )
+			continue;
+
+		// Output is newer than its source
+		if ( bIncremental )
 		{
-			FString Src = Dir + Files(j);
-			FString End = Src + COMPRESSED_EXTENSION;
-			FTime StartTime = appSeconds();
-			LzmaCompress( *Src, *End, Error);
-			
-			if ( Error[0] )
-				warnf( Error);
-			else
+			double DestAge = GetFileAge( *(Src + COMPRESSED_EXTENSION) );
+			if ( (DestAge > 0) && (DestAge <= GetFileAge(*Src)) )
 			{
-				INT SrcSize = GFileManager->FileSize(*Src);
-				INT DstSize = GFileManager->FileSize(*(Src+COMPRESSED_EXTENSION));
-				warnf(TEXT("Compressed %s -> %s%s (%d%%). Time: %03.1f"), *Src, *Src, COMPRESSED_EXTENSION, 100*DstSize / SrcSize, appSeconds() - StartTime);
+				Skipped++;
+				continue;
 			}
 		}
+		Queue->Add( new FLZMACommandletJob( Src, GFileManager->FileSize(*Src)) );
+		Queued++;
 	}
-	while( ParseToken(Parms,Wildcard,0) );
-	return 0;
+
+	// Report as files finish
+	QWORD TotalIn = 0;
+	QWORD TotalOut = 0;
+	INT Failed = 0;
+	for ( INT Done=0; Done<Queued; )
+	{
+		FLZMACommandletJob* Job = (FLZMACommandletJob*)Queue->GetFinished();
+		if ( !Job )
+		{
+			appSleep( 0.01f);
+			continue;
+		}
+		Done++;
+		if ( Job->Error[0] || !Job->DestSize )
+		{
+			warnf( TEXT("Failed to compress %s: %s"), *Job->Src, Job->Error);
+			Failed++;
+		}
+		else
+		{
+			TotalIn += (QWORD)Job->SrcSize;
+			TotalOut += (QWORD)Job->DestSize;
+			warnf(TEXT("Compressed %s -> %s (%d%%). Time: %03.1f"), *Job->Src, *Job->Dest, (INT)(100 * (QWORD)Job->DestSize / Max(Job->SrcSize,1)), Job->Time);
+		}
+		delete Job;
+	}
+	Queue->Release();
+
+	// Throughput report
+	FLOAT Elapsed = Max<FLOAT>( appSeconds() - StartTime, 0.001f);
+	DOUBLE MegsIn  = (DOUBLE)TotalIn / (1024.0 * 1024.0);
+	DOUBLE MegsOut = (DOUBLE)TotalOut / (1024.0 * 1024.0);
+	warnf( TEXT("Compressed %i files (%i skipped, %i failed) using %i threads in %03.1f seconds"), Queued - Failed, Skipped, Failed, Threads, Elapsed);
+	warnf( TEXT("In: %.2f MB (%.2f MB/s) - Out: %.2f MB (%.2f MB/s) - Ratio: %.1f%%"),
+		MegsIn, MegsIn / Elapsed, MegsOut, MegsOut / Elapsed, TotalIn ? (100.0 * (DOUBLE)TotalOut / (DOUBLE)TotalIn) : 0.0);
+	return Failed ? 1 : 0;
 }
 IMPLEMENT_CLASS(ULZMACompressCommandlet)
 /*-----------------------------------------------------------------------------
@@ -200,6 +469,9 @@ static const TCHAR* TranslateLzmaError( int32 ErrorCode)
 		case 5:		return TEXT("Incorrect parameter");
 		case 6:		return TEXT("Insufficient bytes in input buffer");
 		case 7:		return TEXT("Output buffer overflow");
+		case 8:		return TEXT("Read error");
+		case 9:		return TEXT("Write error");
+		case 10:	return TEXT("Cancelled");
 		case 12:	return TEXT("Errors in multithreading functions");
 		default:	return TEXT("Undocumented error code");
 	}
@@ -209,7 +481,155 @@ static const TCHAR* TranslateLzmaError( int32 ErrorCode)
 #define lzPrintErrorD( a, b) { appSprintf( Error, a, b); return 0; }
 
 
-static void LzmaCompress( FArchive* Reader, void*& CompressedData, size_t& CompressedSize, TCHAR* Error)
+//
+// Streaming encoder glue
+// Input is read from the archive in fixed blocks, output goes to an archive or a growable buffer.
+//
+#define LZMA_STREAM_BLOCK (1024*1024)
+
+struct FLzmaArchiveInStream : public FLzmaSeqInStream
+{
+	FArchive* Ar;
+	INT       Remaining;
+	DWORD     Crc; //CRC32C of everything read so far
+
+	static int StaticRead( void* p, void* Buf, size_t* Size)
+	{
+		FLzmaArchiveInStream* In = (FLzmaArchiveInStream*)p;
+		INT Count = (INT)Min<size_t>( *Size, (size_t)Min<INT>(In->Remaining,LZMA_STREAM_BLOCK));
+		*Size = 0;
+		if ( Count > 0 )
+		{
+			In->Ar->Serialize( Buf, Count);
+			if ( In->Ar->GetError() )
+				return 8; //SZ_ERROR_READ
+			In->Remaining -= Count;
+			In->Crc = Crc32C( Buf, Count, In->Crc);
+			*Size = (size_t)Count;
+		}
+		return 0;
+	}
+};
+
+struct FLzmaOutStream : public FLzmaSeqOutStream
+{
+	FArchive* Ar;     //Write here if set
+	uint8*    Data;   //Otherwise append to malloc'd buffer
+	size_t    Num;
+	size_t    Capacity;
+	FLZMALiveData* Live; //Also publish here if set
+
+	static size_t StaticWrite( void* p, const void* Buf, size_t Size)
+	{
+		FLzmaOutStream* Out = (FLzmaOutStream*)p;
+		if ( Out->Ar )
+		{
+			Out->Ar->Serialize( (void*)Buf, (INT)Size);
+			if ( Out->Ar->GetError() )
+				return 0;
+		}
+		else
+		{
+			if ( Out->Num + Size > Out->Capacity )
+			{
+				size_t NewCapacity = Max<size_t>( Out->Capacity * 2, Out->Num + Size + 64*1024);
+				uint8* NewData = (uint8*)realloc( Out->Data, NewCapacity);
+				if ( !NewData )
+					return 0;
+				Out->Data = NewData;
+				Out->Capacity = NewCapacity;
+			}
+			memcpy( Out->Data + Out->Num, Buf, Size);
+		}
+		if ( Out->Live && !LzmaLiveAppend( Out->Live, Buf, (INT)Size) )
+			Out->Live = nullptr; //Readers will be told, keep compressing
+		Out->Num += Size;
+		return Size;
+	}
+};
+
+struct FLzmaCancelProgress : public FLzmaProgress
+{
+	volatile int32* Cancel;
+
+	static int StaticProgress( void* p, uint64 InSize, uint64 OutSize)
+	{
+		FLzmaCancelProgress* Progress = (FLzmaCancelProgress*)p;
+		return (Progress->Cancel && *Progress->Cancel) ? 10 : 0; //SZ_ERROR_PROGRESS
+	}
+};
+
+static void* LzmaAllocProc( void* p, size_t Size)   { return malloc(Size); }
+static void  LzmaFreeProc( void* p, void* Address)  { free(Address); }
+
+//
+// Encode Reader into Out, writes the classic header (props + 8 byte size)
+//
+static UBOOL LzmaCompressStream( FArchive* Reader, FLzmaOutStream& Out, TCHAR* Error, const FLZMAParams& Params, volatile int32* Cancel, DWORD* Hash=nullptr)
+{
+	FLzmaAlloc Alloc;
+	Alloc.Alloc = &LzmaAllocProc;
+	Alloc.Free  = &LzmaFreeProc;
+
+	void* Enc = (*LzmaEnc_Create)( &Alloc);
+	if ( !Enc )
+	{
+		appStrcpy( Error, TEXT("Unable to create LZMA encoder"));
+		return 0;
+	}
+
+	int32 SourceSize = Reader->TotalSize() - Reader->Tell();
+	FLzmaEncProps Props;
+	(*LzmaEncProps_Init)( &Props);
+	Props[FLzmaEncProps::level]      = Params.Level;
+	Props[FLzmaEncProps::dictSize]   = Params.DictSize;
+	Props[FLzmaEncProps::lc]         = Params.lc;
+	Props[FLzmaEncProps::lp]         = Params.lp;
+	Props[FLzmaEncProps::pb]         = Params.pb;
+	Props[FLzmaEncProps::fb]         = Params.fb;
+	Props[FLzmaEncProps::numThreads] = Params.NumThreads;
+
+	int32 Ret = (*LzmaEnc_SetProps)( Enc, &Props);
+	if ( !Ret )
+	{
+		uint8  Header[LZMA_PROPS_SIZE + 8];
+		size_t OutPropSize = LZMA_PROPS_SIZE;
+		Ret = (*LzmaEnc_WriteProperties)( Enc, Header, &OutPropSize);
+		if ( !Ret )
+		{
+			for ( uint32 i=0; i<8; i++)
+				Header[OutPropSize++] = (uint8)((uint64)SourceSize >> (8 * i));
+			Out.Write = &FLzmaOutStream::StaticWrite;
+			if ( FLzmaOutStream::StaticWrite( &Out, Header, OutPropSize) != OutPropSize )
+				Ret = 9; //SZ_ERROR_WRITE
+		}
+	}
+	if ( !Ret )
+	{
+		FLzmaArchiveInStream In;
+		In.Read      = &FLzmaArchiveInStream::StaticRead;
+		In.Ar        = Reader;
+		In.Remaining = SourceSize;
+		In.Crc       = 0;
+		FLzmaCancelProgress Progress;
+		Progress.Progress = &FLzmaCancelProgress::StaticProgress;
+		Progress.Cancel   = Cancel;
+		Ret = (*LzmaEnc_Encode)( Enc, &Out, &In, &Progress, &Alloc, &Alloc);
+		if ( Hash )
+			*Hash = In.Crc;
+	}
+	(*LzmaEnc_Destroy)( Enc, &Alloc, &Alloc);
+
+	const TCHAR* LzmaError = TranslateLzmaError( Ret);
+	if ( LzmaError ) //Got error
+		appStrcpy( Error, LzmaError);
+	return Ret == 0;
+}
+
+//
+// Compress to malloc'd memory
+//
+static void LzmaCompress( FArchive* Reader, void*& CompressedData, size_t& CompressedSize, TCHAR* Error, const FLZMAParams& Params, volatile int32* Cancel, FLZMALiveData* Live, DWORD* Hash)
 {
 	CompressedData = nullptr;
 	CompressedSize = 0;
@@ -218,7 +638,28 @@ static void LzmaCompress( FArchive* Reader, void*& CompressedData, size_t& Compr
 	if ( !Reader || !Error )
 		return;
 
-	if ( GetHandles() )
+	if ( GetEncoderHandles() )
+	{
+		// Start with a quarter of the source, packages rarely compress worse than that
+		FLzmaOutStream Out;
+		Out.Ar       = nullptr;
+		Out.Live     = Live;
+		Out.Num      = 0;
+		Out.Capacity = (size_t)Max( Reader->TotalSize() / 4, 64*1024);
+		Out.Data     = (uint8*)malloc( Out.Capacity);
+		if ( !Out.Data )
+			appStrcpy( Error, TEXT("Unable to allocate compression buffer"));
+		else if ( !LzmaCompressStream( Reader, Out, Error, Params, Cancel, Hash) )
+			free( Out.Data);
+		else
+		{
+			CompressedSize = Out.Num;
+			CompressedData = realloc( Out.Data, Out.Num); //Shrink
+			if ( !CompressedData )
+				CompressedData = Out.Data;
+		}
+	}
+	else if ( GetHandles() )
 	{
 		int32 SourceSize = Reader->TotalSize();
 		void* SourceData = malloc((size_t)SourceSize);
@@ -227,14 +668,16 @@ static void LzmaCompress( FArchive* Reader, void*& CompressedData, size_t& Compr
 			Reader->Serialize( SourceData, SourceSize);
 			if ( !Reader->GetError() )
 			{
+				if ( Hash )
+					*Hash = Crc32C( SourceData, SourceSize);
 				size_t DestSize = (size_t)(SourceSize + SourceSize / 128 + 1024);
-				void*  DestData = malloc( DestSize);
+				void*  DestData = malloc( DestSize + LZMA_PROPS_SIZE + 8);
 				if ( DestData )
 				{
 					//Compress and free source data
 					uint8  Header[LZMA_PROPS_SIZE + 8];
 					size_t OutPropSize = LZMA_PROPS_SIZE;
-					int32 Ret = (*LzmaCompressFunc)( (uint8*)DestData + sizeof(Header), &DestSize, (uint8*)SourceData, SourceSize, Header, &OutPropSize, DEFAULT_LZMA_PARMS);
+					int32 Ret = (*LzmaCompressFunc)( (uint8*)DestData + sizeof(Header), &DestSize, (uint8*)SourceData, SourceSize, Header, &OutPropSize, LZMA_PARMS(Params));
 					if ( !Ret )
 					{
 						// Deallocate source
@@ -246,11 +689,11 @@ static void LzmaCompress( FArchive* Reader, void*& CompressedData, size_t& Compr
 						memcpy( DestData, Header, sizeof(Header));
 						DestSize += sizeof(Header);
 
-						// Reallocate
+						// Shrink in place
 						CompressedSize = DestSize;
-						CompressedData = malloc(DestSize);
-						memcpy( CompressedData, DestData, DestSize);
-						free(DestData);
+						CompressedData = realloc( DestData, DestSize);
+						if ( !CompressedData )
+							CompressedData = DestData;
 						return;
 					}
 					const TCHAR* LzmaError = TranslateLzmaError( Ret);
@@ -268,6 +711,274 @@ static void LzmaCompress( FArchive* Reader, void*& CompressedData, size_t& Compr
 	else appStrcpy( Error, TEXT("Unable to load LZMA library") );
 }
 
+//
+// Compress to archive, returns amount of bytes written
+//
+static size_t LzmaCompress( FArchive* Reader, FArchive* Writer, TCHAR* Error, const FLZMAParams& Params, volatile int32* Cancel=nullptr, FLZMALiveData* Live=nullptr, DWORD* Hash=nullptr)
+{
+	if ( !Reader || !Writer || !Error )
+		return 0;
+
+	if ( GetEncoderHandles() )
+	{
+		FLzmaOutStream Out;
+		Out.Ar       = Writer;
+		Out.Live     = Live;
+		Out.Data     = nullptr;
+		Out.Num      = 0;
+		Out.Capacity = 0;
+		return LzmaCompressStream( Reader, Out, Error, Params, Cancel, Hash) ? Out.Num : 0;
+	}
+
+	// LzmaLib subset only, go through memory
+	void*  CompressedData;
+	size_t CompressedSize;
+	LzmaCompress( Reader, CompressedData, CompressedSize, Error, Params, Cancel, nullptr, Hash);
+	if ( !CompressedData )
+		return 0;
+	Writer->Serialize( CompressedData, (INT)CompressedSize);
+	free( CompressedData);
+	if ( Writer->GetError() )
+	{
+		appStrcpy( Error, TEXT("Unable to write compressed data"));
+		return 0;
+	}
+	return CompressedSize;
+}
+
+//
+// Tell why compression goes through memory, main thread only
+//
+static void LzmaLogEncoder()
+{
+	static UBOOL bLogged = 0;
+	if ( !bLogged && GetHandles() && LzmaStreamingEncodeError )
+	{
+		bLogged = 1;
+		debugf( NAME_Init, TEXT("Streaming LZMA encoder unavailable (%s), compressing in memory. Requires a LZMA library exporting the SDK encoder."), LzmaStreamingEncodeError);
+	}
+}
+
+//
+// Locate CLzmaEncProps fields using the defaults set by LzmaEncProps_Init
+// level=5, dictSize=mc=0, (reduceSize=-1), lc..numHashBytes=-1, writeEndMark=0, numThreads=-1
+//
+static INT LzmaDetectEncPropsShift()
+{
+	FLzmaEncProps Props;
+	memset( &Props, 0xCD, sizeof(Props));
+	(*LzmaEncProps_Init)( &Props);
+
+	const int32* F = Props.Fields;
+	if ( (F[0] != 5) || (F[1] != 0) )
+		return -1;
+	for ( INT Shift=0; Shift<=1; Shift++)
+	{
+		UBOOL bMatch = (Shift == 0) || (F[2] == -1);
+		for ( INT i=FLzmaEncProps::lc; i<=FLzmaEncProps::numHashBytes; i++)
+			bMatch = bMatch && (F[i+Shift] == -1);
+		bMatch = bMatch && (F[FLzmaEncProps::mc+Shift] == 0) && (F[FLzmaEncProps::writeEndMark+Shift] == 0) && (F[FLzmaEncProps::numThreads+Shift] == -1);
+		if ( bMatch )
+			return Shift;
+	}
+	return -1;
+}
+
+//
+// Round trip a small buffer through the streaming encoder and decoder
+// Either one is disabled (handles cleared) if it doesn't match this build's expectations.
+//
+static void LzmaValidateStreaming()
+{
+	TArray<BYTE> Source( 8192);
+	for ( INT i=0; i<Source.Num(); i++)
+		Source(i) = (BYTE)((i * 7) ^ (i >> 5));
+	FLZMAParams Params;
+	Params.Level    = 1;
+	Params.DictSize = 1 << 16;
+	TCHAR Error[256];
+
+	// Encoder: streaming encode, decode with LzmaLib
+	if ( LzmaEnc_Create && LzmaEnc_Destroy && LzmaEncProps_Init && LzmaEnc_SetProps && LzmaEnc_WriteProperties && LzmaEnc_Encode )
+	{
+		LzmaEncPropsShift = LzmaDetectEncPropsShift();
+		UBOOL bValid = 0;
+		if ( LzmaEncPropsShift >= 0 )
+		{
+			FBufferReader Reader( Source);
+			FLzmaOutStream Out;
+			Out.Ar       = nullptr;
+			Out.Live     = nullptr;
+			Out.Num      = 0;
+			Out.Capacity = 64*1024;
+			Out.Data     = (uint8*)malloc( Out.Capacity);
+			if ( Out.Data && LzmaCompressStream( &Reader, Out, Error, Params, nullptr) && (Out.Num > LZMA_PROPS_SIZE + 8) )
+			{
+				TArray<BYTE> Decoded( Source.Num());
+				size_t DestSize = (size_t)Decoded.Num();
+				SizeT  SrcSize  = Out.Num - (LZMA_PROPS_SIZE + 8);
+				bValid = (Out.Data[0] == (Params.pb * 5 + Params.lp) * 9 + Params.lc)
+					&& !(*LzmaDecompressFunc)( &Decoded(0), &DestSize, Out.Data + LZMA_PROPS_SIZE + 8, &SrcSize, Out.Data, LZMA_PROPS_SIZE)
+					&& (DestSize == (size_t)Source.Num())
+					&& !appMemcmp( &Decoded(0), &Source(0), Source.Num());
+			}
+			if ( Out.Data )
+				free( Out.Data);
+		}
+		if ( !bValid )
+		{
+			LzmaEnc_Create = nullptr;
+			LzmaStreamingEncodeError = (LzmaEncPropsShift < 0) ? TEXT("unknown CLzmaEncProps layout") : TEXT("round trip test failed");
+		}
+	}
+	else
+		LzmaStreamingEncodeError = TEXT("LzmaEnc_* not exported");
+
+	// Decoder: encode with LzmaLib, streaming decode into guarded state
+	if ( LzmaDec_Allocate && LzmaDec_Free && LzmaDec_Init && LzmaDec_DecodeToBuf )
+	{
+		UBOOL bValid = 0;
+		TArray<BYTE> Compressed( Source.Num() + 1024);
+		uint8  Header[LZMA_PROPS_SIZE];
+		size_t PropSize = LZMA_PROPS_SIZE;
+		size_t DestSize = (size_t)Compressed.Num();
+		if ( !(*LzmaCompressFunc)( &Compressed(0), &DestSize, &Source(0), Source.Num(), Header, &PropSize, LZMA_PARMS(Params)) )
+		{
+			TArray<BYTE> StateBuffer( LZMA_DEC_STATE_SIZE * 2);
+			BYTE* State = &StateBuffer(0);
+			appMemzero( State, LZMA_DEC_STATE_SIZE);
+			memset( State + LZMA_DEC_STATE_SIZE, 0xCD, LZMA_DEC_STATE_SIZE);
+			FLzmaAlloc Alloc;
+			Alloc.Alloc = &LzmaAllocProc;
+			Alloc.Free  = &LzmaFreeProc;
+			if ( !(*LzmaDec_Allocate)( State, Header, LZMA_PROPS_SIZE, &Alloc) )
+			{
+				(*LzmaDec_Init)( State);
+				TArray<BYTE> Decoded( Source.Num());
+				size_t OutSize = (size_t)Decoded.Num();
+				size_t InSize  = DestSize;
+				int    Status  = 0;
+				bValid = !(*LzmaDec_DecodeToBuf)( State, &Decoded(0), &OutSize, &Compressed(0), &InSize, 0, &Status)
+					&& (OutSize == (size_t)Source.Num())
+					&& !appMemcmp( &Decoded(0), &Source(0), Source.Num());
+				(*LzmaDec_Free)( State, &Alloc);
+			}
+			for ( INT i=LZMA_DEC_STATE_SIZE; i<LZMA_DEC_STATE_SIZE*2; i++)
+				bValid = bValid && (State[i] == 0xCD);
+		}
+		if ( !bValid )
+		{
+			LzmaDec_Allocate = nullptr;
+			LzmaStreamingDecodeError = TEXT("round trip test failed");
+		}
+	}
+	else
+		LzmaStreamingDecodeError = TEXT("LzmaDec_* not exported");
+}
+
+/*-----------------------------------------------------------------------------
+	FLZMADecoder.
+-----------------------------------------------------------------------------*/
+
+#define LZMA_DECODE_BLOCK (256*1024)
+
+FLZMADecoder::FLZMADecoder()
+	: UnpackSize(0)
+	, Decoded(0)
+	, State(nullptr)
+	, OutBuffer(nullptr)
+{}
+
+FLZMADecoder::~FLZMADecoder()
+{
+	if ( State )
+	{
+		FLzmaAlloc Alloc;
+		Alloc.Alloc = &LzmaAllocProc;
+		Alloc.Free  = &LzmaFreeProc;
+		(*LzmaDec_Free)( State, &Alloc);
+		free( State);
+	}
+	if ( OutBuffer )
+		free( OutBuffer);
+}
+
+UBOOL FLZMADecoder::IsAvailable()
+{
+	return GetDecoderHandles();
+}
+
+const TCHAR* FLZMADecoder::GetUnavailableReason()
+{
+	if ( !GetHandles() )
+		return TEXT("LZMA library not loaded");
+	return LzmaStreamingDecodeError ? LzmaStreamingDecodeError : TEXT("");
+}
+
+//
+// Header is the classic LZMA_PROPS_SIZE + 8 byte unpacked size
+//
+UBOOL FLZMADecoder::Init( const BYTE* Header, TCHAR* Error)
+{
+	if ( State || !GetDecoderHandles() )
+		lzPrintError( TEXT("LzmaDecompress: Unable to create streaming decoder.") );
+
+	UnpackSize = 0;
+	for ( uint32 i=0; i<8; i++)
+		UnpackSize |= (QWORD)Header[LZMA_PROPS_SIZE+i] << (8 * i);
+	Decoded = 0;
+
+	// CLzmaDec layout differs between SDK versions, size was verified on load
+	State     = calloc( 1, LZMA_DEC_STATE_SIZE);
+	OutBuffer = (BYTE*)malloc( LZMA_DECODE_BLOCK);
+	if ( !State || !OutBuffer )
+		lzPrintError( TEXT("LzmaDecompress: Unable to allocate decoder.") );
+
+	FLzmaAlloc Alloc;
+	Alloc.Alloc = &LzmaAllocProc;
+	Alloc.Free  = &LzmaFreeProc;
+	int32 Ret = (*LzmaDec_Allocate)( State, Header, LZMA_PROPS_SIZE, &Alloc);
+	if ( Ret )
+	{
+		free( State);
+		State = nullptr;
+		lzPrintErrorD( TEXT("LzmaDecompress: %s."), TranslateLzmaError(Ret) );
+	}
+	(*LzmaDec_Init)( State);
+	return 1;
+}
+
+//
+// Feed compressed data, decoded data is written to Dest as it becomes available
+//
+UBOOL FLZMADecoder::Decode( const BYTE* Data, INT Count, FArchive& Dest, TCHAR* Error)
+{
+	if ( !State )
+		lzPrintError( TEXT("LzmaDecompress: Decoder not initialized.") );
+
+	while ( Decoded < UnpackSize )
+	{
+		size_t OutSize = (size_t)Min<QWORD>( LZMA_DECODE_BLOCK, UnpackSize - Decoded);
+		size_t InSize  = (size_t)Count;
+		int    Status  = 0;
+		int32  Ret     = (*LzmaDec_DecodeToBuf)( State, OutBuffer, &OutSize, Data, &InSize, 0, &Status); //LZMA_FINISH_ANY
+		Data  += InSize;
+		Count -= (INT)InSize;
+		if ( OutSize )
+		{
+			Dest.Serialize( OutBuffer, (INT)OutSize);
+			if ( Dest.IsError() )
+				lzPrintError( TEXT("LzmaDecompress: Unable to write decompressed data.") );
+			Decoded += OutSize;
+		}
+		if ( Ret )
+			lzPrintErrorD( TEXT("LzmaDecompress: %s."), TranslateLzmaError(Ret) );
+		if ( !InSize && !OutSize ) //Needs more input
+			break;
+	}
+	return 1;
+}
+
 static FString CreateFilename( const FGuid& Guid)
 {
 	for ( int32 i=0; i<65536; i++)	
@@ -286,6 +997,17 @@ static FString CreateFilename( const FGuid& Guid)
 	return TEXT("ERROR.lzma");
 }
 
+//
+// Multi-block container that goes along with a file cache entry
+// Returns empty string if the compressed file isn't in the cache folder
+//
+static FString GetContainerFilename( const FString& CmpFilename)
+{
+	if ( (CmpFilename.InStr(TEXT("/")) != INDEX_NONE) || (CmpFilename.InStr(TEXT("\\")) != INDEX_NONE) || (CmpFilename.Right(5) != COMPRESSED_EXTENSION) )
+		return FString();
+	return CmpFilename.Left(CmpFilename.Len()-5) + LZMA_CONTAINER_EXTENSION;
+}
+
 static bool SaveDataToFile( const TCHAR* Filename, void* Data, INT Size)
 {
 	bool Result = false;
@@ -296,7 +1018,7 @@ static bool SaveDataToFile( const TCHAR* Filename, void* Data, INT Size)
 		{
 			File->Serialize( Data, Size);
 			Result = !File->GetError();
-			File->Close();
+			Result = File->Close() && Result;
 		}
 		delete File;
 	}
@@ -304,44 +1026,980 @@ static bool SaveDataToFile( const TCHAR* Filename, void* Data, INT Size)
 }
 
 /*-----------------------------------------------------------------------------
-	LZMA Server
+	LZMA Profiles
 -----------------------------------------------------------------------------*/
 
-class FArchiveProxyLock : public FArchive
+static TArray<FLZMAProfile> Profiles;
+static UBOOL bProfilesLoaded = 0;
+
+static FString ProfileToString( const FLZMAProfile& Profile)
 {
-public:
-	FArchive* Ar;
-	INT&      Lock;
+	return FString::Printf( TEXT("Name=%s,Extensions=%s,MinMegs=%i,MaxMegs=%i,Level=%i,DictMegs=%i,Threads=%i")
+		, *Profile.Name, *Profile.Extensions, Profile.MinMegs, Profile.MaxMegs
+		, Profile.Params.Level, Profile.Params.DictSize / (1024*1024), Profile.Params.NumThreads);
+}
 
-	FArchiveProxyLock( FArchive* InAr, INT& InLock)
-		: Ar(InAr), Lock(InLock)
+static UBOOL ParseProfile( const TCHAR* Str, FLZMAProfile& Profile)
+{
+	INT DictMegs = 4;
+	Profile = FLZMAProfile();
+	Profile.MinMegs = 0;
+	Profile.MaxMegs = 0;
+	if ( !Parse( Str, TEXT("Name="), Profile.Name) )
+		return 0;
+	Parse( Str, TEXT("Extensions="), Profile.Extensions);
+	Parse( Str, TEXT("MinMegs="), Profile.MinMegs);
+	Parse( Str, TEXT("MaxMegs="), Profile.MaxMegs);
+	Parse( Str, TEXT("Level="), Profile.Params.Level);
+	Parse( Str, TEXT("DictMegs="), DictMegs);
+	Parse( Str, TEXT("Threads="), Profile.Params.NumThreads);
+	Profile.Params.Level      = Clamp( Profile.Params.Level, 0, 9);
+	Profile.Params.DictSize   = Clamp( DictMegs, 1, 64) * (1024*1024);
+	Profile.Params.NumThreads = Clamp( Profile.Params.NumThreads, 1, 2);
+	return 1;
+}
+
+XC_CORE_API TArray<FLZMAProfile>& LzmaGetProfiles()
+{
+	guard(LzmaGetProfiles);
+	if ( !bProfilesLoaded )
 	{
-		Lock++;
+		bProfilesLoaded = 1;
+		FConfigCacheIni LzmaCacheIni;
+		FString Value;
+		FLZMAProfile Profile;
+		for ( INT i=0; LzmaCacheIni.GetString( TEXT("Profiles"), *FString::Printf(TEXT("Profile%i"),i), Value, LZMA_CACHE_INI); i++)
+			if ( ParseProfile( *Value, Profile) )
+				Profiles.AddItem( Profile);
+
+		// Defaults: fast for small files, large dictionary for big assets
+		if ( !Profiles.Num() )
+		{
+			static const TCHAR* Defaults[] =
+			{	TEXT("Name=Small,Extensions=,MinMegs=0,MaxMegs=1,Level=3,DictMegs=1,Threads=1")
+			,	TEXT("Name=Code,Extensions=u,MinMegs=0,MaxMegs=0,Level=5,DictMegs=4,Threads=1")
+			,	TEXT("Name=LargeAssets,Extensions=utx;uax;umx;usx;unr,MinMegs=8,MaxMegs=0,Level=6,DictMegs=16,Threads=2")
+			,	TEXT("Name=Default,Extensions=,MinMegs=0,MaxMegs=0,Level=5,DictMegs=4,Threads=1")	};
+			for ( INT i=0; i<ARRAY_COUNT(Defaults); i++)
+				if ( ParseProfile( Defaults[i], Profile) )
+				{
+					Profiles.AddItem( Profile);
+					LzmaCacheIni.SetString( TEXT("Profiles"), *FString::Printf(TEXT("Profile%i"),i), *ProfileToString(Profile), LZMA_CACHE_INI);
+				}
+		}
+	}
+	return Profiles;
+	unguard;
+}
+
+XC_CORE_API FLZMAParams LzmaGetParams( const TCHAR* Filename, INT FileSize)
+{
+	TArray<FLZMAProfile>& List = LzmaGetProfiles();
+
+	FString Ext;
+	const TCHAR* Dot = appStrrchr( Filename, '.');
+	if ( Dot )
+		Ext = FString(TEXT(";")) + (Dot+1) + TEXT(";");
+	INT Megs = FileSize / (1024*1024);
+
+	for ( INT i=0; i<List.Num(); i++)
+	{
+		const FLZMAProfile& Profile = List(i);
+		if ( (Megs < Profile.MinMegs) || ((Profile.MaxMegs > 0) && (Megs >= Profile.MaxMegs)) )
+			continue;
+		if ( Profile.Extensions.Len() && (!Ext.Len() || ((FString(TEXT(";")) + Profile.Extensions + TEXT(";")).Caps().InStr(*Ext.Caps()) == -1)) )
+			continue;
+		return Profile.Params;
+	}
+	return FLZMAParams();
+}
+
+/*-----------------------------------------------------------------------------
+	Multi-block container.
+-----------------------------------------------------------------------------*/
+
+//
+// Decode a classic LZMA stream (props + size + data) held in memory
+//
+static UBOOL LzmaDecodeBlock( const BYTE* Src, INT SrcSize, BYTE* Dest, INT DestSize, TCHAR* Error)
+{
+	if ( SrcSize < LZMA_PROPS_SIZE + 8 )
+	{
+		appStrcpy( Error, TEXT("Truncated LZMA block"));
+		return 0;
+	}
+	if ( *(QWORD*)&Src[LZMA_PROPS_SIZE] != (QWORD)DestSize )
+	{
+		appStrcpy( Error, TEXT("LZMA block size mismatch"));
+		return 0;
+	}
+	size_t DestLen = (size_t)DestSize;
+	SizeT  SrcLen  = (SizeT)(SrcSize - (LZMA_PROPS_SIZE + 8));
+	int32 Ret = (*LzmaDecompressFunc)( Dest, &DestLen, Src + LZMA_PROPS_SIZE + 8, &SrcLen, Src, LZMA_PROPS_SIZE);
+	const TCHAR* LzmaError = TranslateLzmaError( Ret);
+	if ( LzmaError )
+	{
+		appStrcpy( Error, LzmaError);
+		return 0;
+	}
+	if ( DestLen != (size_t)DestSize )
+	{
+		appStrcpy( Error, TranslateLzmaError(6) );
+		return 0;
+	}
+	return 1;
+}
+
+//
+// Blocks of a container being built, shared by all block jobs
+// The job that finishes last writes the container file.
+//
+class FLZMAContainerBuild
+{
+public:
+	FGuid          Guid;
+	FString        SrcFilename;
+	FString        ContainerFile;
+	INT            UnpackSize;
+	INT            NumBlocks;
+	TArray<void*>  BlockData;
+	TArray<INT>    BlockSizes;
+	volatile int32 Remaining;
+	volatile int32 Failed;
+	volatile int32 RefCount;
+
+	FLZMAContainerBuild( const FGuid& InGuid, const TCHAR* InSrcFilename, const TCHAR* InContainerFile, INT InUnpackSize)
+		: Guid(InGuid)
+		, SrcFilename(InSrcFilename)
+		, ContainerFile(InContainerFile)
+		, UnpackSize(InUnpackSize)
+		, NumBlocks( (InUnpackSize + LZMA_CONTAINER_BLOCK - 1) / LZMA_CONTAINER_BLOCK )
+		, Failed(0)
+		, RefCount(1)
+	{
+		Remaining = NumBlocks;
+		BlockData.AddZeroed( NumBlocks);
+		BlockSizes.AddZeroed( NumBlocks);
+	}
+
+	void AddRef()
+	{
+		FPlatformAtomics::InterlockedIncrement( &RefCount);
+	}
+
+	void Release()
+	{
+		if ( FPlatformAtomics::InterlockedDecrement( &RefCount) == 0 )
+			delete this;
+	}
+
+	UBOOL WriteFile( TCHAR* Error)
+	{
+		FString Filename = FString(LZMA_CACHE_PATH) + ContainerFile;
+		FArchive* Ar = GFileManager->CreateFileWriter( *Filename);
+		if ( !Ar )
+		{
+			appSprintf( Error, TEXT("Unable to create container file %s"), *Filename);
+			return 0;
+		}
+		DWORD Magic     = LZMA_CONTAINER_MAGIC;
+		INT   Version   = LZMA_CONTAINER_VERSION;
+		QWORD Size      = (QWORD)UnpackSize;
+		INT   BlockSize = LZMA_CONTAINER_BLOCK;
+		*Ar << Magic << Version << Size << BlockSize << NumBlocks;
+		for ( INT i=0; i<NumBlocks; i++)
+			*Ar << BlockSizes(i);
+		for ( INT i=0; i<NumBlocks && !Ar->IsError(); i++)
+			Ar->Serialize( BlockData(i), BlockSizes(i));
+		UBOOL Result = !Ar->IsError();
+		Result = Ar->Close() && Result;
+		delete Ar;
+		if ( !Result )
+		{
+			appSprintf( Error, TEXT("Unable to write container file %s"), *Filename);
+			GFileManager->Delete( *Filename);
+		}
+		return Result;
+	}
+
+private:
+	~FLZMAContainerBuild()
+	{
+		for ( INT i=0; i<BlockData.Num(); i++)
+			if ( BlockData(i) )
+				free( BlockData(i));
+	}
+};
+
+//
+// Compresses one block of a container
+//
+class FLZMABlockJob : public FAsyncJob
+{
+public:
+	FLZMAContainerBuild* Build;
+	INT                  Index;
+	FLZMAParams          Params;
+	UBOOL                bLast;    //Last job of the container to finish
+	UBOOL                bWritten; //Container file was written
+	TCHAR                Error[256];
+
+	FLZMABlockJob( FLZMAContainerBuild* InBuild, INT InIndex, const FLZMAParams& InParams)
+		: FAsyncJob( -InIndex) //Blocks in order
+		, Build(InBuild)
+		, Index(InIndex)
+		, Params(InParams)
+		, bLast(0)
+		, bWritten(0)
+	{
+		Error[0] = '\0';
+		Build->AddRef();
+	}
+
+	~FLZMABlockJob()
+	{
+		Build->Release();
+	}
+
+	void Run()
+	{
+		if ( !Build->Failed && !Cancelled )
+		{
+			INT Offset = Index * LZMA_CONTAINER_BLOCK;
+			INT Size   = Min( LZMA_CONTAINER_BLOCK, Build->UnpackSize - Offset);
+			TArray<BYTE> Data( Size);
+			FArchive* Reader = GFileManager->CreateFileReader( *Build->SrcFilename);
+			if ( Reader )
+			{
+				Reader->Seek( Offset);
+				Reader->Serialize( &Data(0), Size);
+				UBOOL bReadError = Reader->IsError();
+				delete Reader;
+				if ( !bReadError )
+				{
+					void*  CompressedData;
+					size_t CompressedSize;
+					FBufferReader BlockReader( Data);
+					LzmaCompress( &BlockReader, CompressedData, CompressedSize, Error, Params, &Cancelled);
+					Build->BlockData(Index)  = CompressedData;
+					Build->BlockSizes(Index) = (INT)CompressedSize;
+				}
+			}
+			if ( !Build->BlockData(Index) )
+				Build->Failed = 1;
+		}
+		if ( FPlatformAtomics::InterlockedDecrement( &Build->Remaining) == 0 )
+		{
+			bLast = 1;
+			if ( !Build->Failed && !Cancelled )
+				bWritten = Build->WriteFile( Error);
+		}
+	}
+};
+
+//
+// Decodes one block of a container
+//
+class FLZMABlockDecodeJob : public FAsyncJob
+{
+public:
+	INT          Index;
+	TArray<BYTE> Compressed;
+	TArray<BYTE> Decoded;
+	UBOOL        bSuccess;
+	TCHAR        Error[256];
+
+	FLZMABlockDecodeJob( INT InIndex, INT CompressedSize, INT DecodedSize)
+		: FAsyncJob( -InIndex)
+		, Index(InIndex)
+		, Compressed(CompressedSize)
+		, Decoded(DecodedSize)
+		, bSuccess(0)
+	{
+		Error[0] = '\0';
+	}
+
+	void Run()
+	{
+		bSuccess = LzmaDecodeBlock( &Compressed(0), Compressed.Num(), &Decoded(0), Decoded.Num(), Error);
+		Compressed.Empty();
+	}
+};
+
+XC_CORE_API UBOOL LzmaIsContainer( const BYTE* Data, INT Count)
+{
+	return (Count >= 4) && (*(DWORD*)Data == LZMA_CONTAINER_MAGIC);
+}
+
+//
+// Decode blocks in parallel, write them in order
+//
+XC_CORE_API UBOOL LzmaDecompressContainer( const TCHAR* Src, const TCHAR* Dest, TCHAR* Error, INT Threads)
+{
+	guard(LzmaDecompressContainer);
+
+	Error[0] = '\0';
+	if ( !GetHandles() )
+	{
+		appStrcpy( Error, TEXT("LzmaDecompressContainer: Unable to load LZMA library."));
+		return 0;
+	}
+
+	FArchive* SrcFile = GFileManager->CreateFileReader( Src);
+	if ( !SrcFile )
+	{
+		appSprintf( Error, TEXT("LzmaDecompressContainer: Unable to load file %s."), Src);
+		return 0;
+	}
+
+	// Validate header and block index
+	DWORD Magic = 0;
+	INT   Version = 0, BlockSize = 0, NumBlocks = 0;
+	QWORD UnpackSize = 0;
+	*SrcFile << Magic << Version << UnpackSize << BlockSize << NumBlocks;
+	UBOOL bValid = !SrcFile->IsError() && (Magic == LZMA_CONTAINER_MAGIC) && (Version == LZMA_CONTAINER_VERSION)
+		&& (BlockSize > 0) && (BlockSize <= 64*1024*1024) && (UnpackSize < 0x7FFFFFFF)
+		&& ((QWORD)NumBlocks == (UnpackSize + BlockSize - 1) / BlockSize);
+	TArray<INT> BlockSizes;
+	if ( bValid )
+	{
+		BlockSizes.Add( NumBlocks);
+		QWORD Total = 0;
+		for ( INT i=0; i<NumBlocks; i++)
+		{
+			*SrcFile << BlockSizes(i);
+			bValid = bValid && (BlockSizes(i) > 0);
+			Total += (QWORD)Max(BlockSizes(i),0);
+		}
+		bValid = bValid && !SrcFile->IsError() && (Total == (QWORD)(SrcFile->TotalSize() - SrcFile->Tell()));
+	}
+	if ( !bValid )
+	{
+		delete SrcFile;
+		appStrcpy( Error, TEXT("LzmaDecompressContainer: Invalid container."));
+		return 0;
+	}
+
+	FArchive* DestFile = GFileManager->CreateFileWriter( Dest, FILEWRITE_EvenIfReadOnly);
+	if ( !DestFile )
+	{
+		delete SrcFile;
+		appSprintf( Error, TEXT("LzmaDecompressContainer: Unable to create destination file %s."), Dest);
+		return 0;
+	}
+
+	// Read ahead a limited amount of blocks, write them as soon as they're next in order
+	Threads = Clamp( Threads, 1, 16);
+	FAsyncJobQueue* Queue = new FAsyncJobQueue( Threads);
+	FAsyncEvent BlockDecoded;
+	Queue->SetFinishedEvent( &BlockDecoded);
+	TArray<FLZMABlockDecodeJob*> Done;
+	Done.AddZeroed( NumBlocks);
+	INT Submitted = 0;
+	INT Written = 0;
+	UBOOL Result = 1;
+	while ( Result && (Written < NumBlocks) )
+	{
+		while ( (Submitted < NumBlocks) && (Submitted - Written < Threads * 2) )
+		{
+			INT DecodedSize = (INT)Min<QWORD>( BlockSize, UnpackSize - (QWORD)Submitted * BlockSize);
+			FLZMABlockDecodeJob* Job = new FLZMABlockDecodeJob( Submitted, BlockSizes(Submitted), DecodedSize);
+			SrcFile->Serialize( &Job->Compressed(0), Job->Compressed.Num());
+			if ( SrcFile->IsError() )
+			{
+				appStrcpy( Error, TEXT("LzmaDecompressContainer: Read error."));
+				delete Job;
+				Result = 0;
+				break;
+			}
+			Queue->Add( Job);
+			Submitted++;
+		}
+
+		FLZMABlockDecodeJob* Job;
+		while ( Result && (Job=(FLZMABlockDecodeJob*)Queue->GetFinished()) != nullptr )
+		{
+			if ( !Job->bSuccess )
+			{
+				appSprintf( Error, TEXT("LzmaDecompressContainer: %s."), Job->Error);
+				Result = 0;
+			}
+			Done(Job->Index) = Job;
+		}
+		if ( !Result )
+			break;
+
+		if ( !Done(Written) )
+		{
+			BlockDecoded.Wait( 1.f);
+			continue;
+		}
+		while ( (Written < NumBlocks) && Done(Written) )
+		{
+			DestFile->Serialize( &Done(Written)->Decoded(0), Done(Written)->Decoded.Num());
+			delete Done(Written);
+			Done(Written++) = nullptr;
+		}
+		if ( DestFile->IsError() )
+		{
+			appStrcpy( Error, TEXT("LzmaDecompressContainer: Unable to write decompressed data."));
+			Result = 0;
+		}
+	}
+	Queue->Release();
+	for ( INT i=0; i<Done.Num(); i++)
+		if ( Done(i) )
+			delete Done(i);
+	delete SrcFile;
+
+	Result = DestFile->Close() && Result;
+	delete DestFile;
+	if ( !Result )
+	{
+		if ( !Error[0] )
+			appStrcpy( Error, TEXT("LzmaDecompressContainer: Unable to write decompressed data."));
+		GFileManager->Delete( Dest);
+	}
+	return Result;
+
+	unguard;
+}
+
+/*-----------------------------------------------------------------------------
+	Binary delta.
+-----------------------------------------------------------------------------*/
+
+//
+// Previous versions of a package are kept in LZMA_DELTA_PATH as
+// <Package>.<OldGuid>.lzma, deltas to the current one as <Package>.<OldGuid>.<NewGuid>.xdl
+//
+static FString GetDeltaPackageName( const TCHAR* SourceFile)
+{
+	const TCHAR* Name = SourceFile;
+	for ( ; *SourceFile; SourceFile++)
+		if ( *SourceFile == '\\' || *SourceFile == '/' )
+			Name = SourceFile + 1;
+	return Name;
+}
+
+static FString GetDeltaBaseFilename( const FString& Name, const FGuid& BaseGuid)
+{
+	return FString(LZMA_DELTA_PATH) + Name + TEXT(".") + BaseGuid.String() + COMPRESSED_EXTENSION;
+}
+
+static FString GetDeltaFilename( const FString& Name, const FGuid& BaseGuid, const FGuid& Guid)
+{
+	return FString(LZMA_DELTA_PATH) + Name + TEXT(".") + BaseGuid.String() + TEXT(".") + Guid.String() + DELTA_EXTENSION;
+}
+
+//
+// Client side, Base is the version in the cache
+//
+XC_CORE_API UBOOL DeltaApply( const TCHAR* Src, const TCHAR* Base, const TCHAR* Dest, TCHAR* Error)
+{
+	Error[0] = '\0';
+	if ( !GetHandles() )
+	{
+		appStrcpy( Error, TEXT("DeltaApply: Unable to load LZMA library."));
+		return 0;
+	}
+
+	TArray<BYTE> Delta;
+	if ( !appLoadFileToArray( Delta, Src) )
+	{
+		appSprintf( Error, TEXT("DeltaApply: Unable to load file %s."), Src);
+		return 0;
+	}
+	FDeltaHeader Header;
+	FBufferReader Reader( Delta);
+	Reader << Header;
+	INT Pos = Reader.Tell();
+	if ( Reader.IsError() || (Header.Magic != DELTA_MAGIC) || (Header.Version != DELTA_VERSION) || (Header.TargetSize < 0)
+		|| (Delta.Num() - Pos < LZMA_PROPS_SIZE + 8) || (*(QWORD*)&Delta(Pos + LZMA_PROPS_SIZE) > 0x7FFFFFFF) )
+	{
+		appStrcpy( Error, TEXT("DeltaApply: Invalid delta file."));
+		return 0;
+	}
+
+	TArray<BYTE> BaseData;
+	if ( !appLoadFileToArray( BaseData, Base) || (BaseData.Num() != Header.BaseSize) || (appMemCrc(BaseData.GetData(),BaseData.Num()) != Header.BaseCrc) )
+	{
+		appSprintf( Error, TEXT("DeltaApply: Cached file %s doesn't match."), Base);
+		return 0;
+	}
+
+	TArray<BYTE> Commands( (INT)*(QWORD*)&Delta(Pos + LZMA_PROPS_SIZE) );
+	if ( !LzmaDecodeBlock( &Delta(Pos), Delta.Num() - Pos, Commands.GetData(), Commands.Num(), Error) )
+		return 0;
+	Delta.Empty();
+
+	TArray<BYTE> Target( Header.TargetSize);
+	if ( !DeltaPatch( BaseData.GetData(), BaseData.Num(), Commands.GetData(), Commands.Num(), Target.GetData(), Target.Num())
+		|| (appMemCrc(Target.GetData(),Target.Num()) != Header.TargetCrc) )
+	{
+		appStrcpy( Error, TEXT("DeltaApply: Corrupt delta."));
+		return 0;
+	}
+	if ( !SaveDataToFile( Dest, Target.GetData(), Target.Num()) )
+	{
+		appSprintf( Error, TEXT("DeltaApply: Unable to write %s."), Dest);
+		GFileManager->Delete( Dest);
+		return 0;
+	}
+	return 1;
+}
+
+//
+// Builds a delta between a kept version and the current package
+// Nothing is written unless it's smaller than MaxSize.
+//
+class FLZMADeltaJob : public FAsyncJob
+{
+public:
+	FString     BaseFile;
+	FString     TargetFile;
+	FString     DeltaFile;
+	FGuid       BaseGuid;
+	INT         MaxSize;
+	INT         DeltaSize;
+	FLZMAParams Params;
+	TCHAR       Error[256];
+
+	FLZMADeltaJob( const TCHAR* InBaseFile, const TCHAR* InTargetFile, const TCHAR* InDeltaFile, const FGuid& InBaseGuid, INT InMaxSize, const FLZMAParams& InParams)
+		: BaseFile(InBaseFile)
+		, TargetFile(InTargetFile)
+		, DeltaFile(InDeltaFile)
+		, BaseGuid(InBaseGuid)
+		, MaxSize(InMaxSize)
+		, DeltaSize(0)
+		, Params(InParams)
+	{
+		Error[0] = '\0';
+	}
+
+	void Run()
+	{
+		// Kept versions are compressed
+		TArray<BYTE> Packed;
+		if ( !appLoadFileToArray( Packed, *BaseFile) || (Packed.Num() < LZMA_PROPS_SIZE + 8) || (*(QWORD*)&Packed(LZMA_PROPS_SIZE) > 0x7FFFFFFF) )
+		{
+			appSprintf( Error, TEXT("Unable to load delta base %s"), *BaseFile);
+			return;
+		}
+		TArray<BYTE> Base( (INT)*(QWORD*)&Packed(LZMA_PROPS_SIZE) );
+		if ( !LzmaDecodeBlock( &Packed(0), Packed.Num(), Base.GetData(), Base.Num(), Error) )
+			return;
+		Packed.Empty();
+
+		TArray<BYTE> Target;
+		if ( Cancelled || !appLoadFileToArray( Target, *TargetFile) )
+			return;
+
+		TArray<BYTE> Commands;
+		DeltaDiff( Base.GetData(), Base.Num(), Target.GetData(), Target.Num(), Commands);
+		if ( Cancelled || !Commands.Num() )
+			return;
+
+		void*  CompressedData = nullptr;
+		size_t CompressedSize = 0;
+		FBufferReader CommandReader( Commands);
+		LzmaCompress( &CommandReader, CompressedData, CompressedSize, Error, Params, &Cancelled);
+		if ( !CompressedData )
+			return;
+
+		FDeltaHeader Header;
+		Header.BaseGuid   = BaseGuid;
+		Header.BaseSize   = Base.Num();
+		Header.BaseCrc    = appMemCrc( Base.GetData(), Base.Num());
+		Header.TargetSize = Target.Num();
+		Header.TargetCrc  = appMemCrc( Target.GetData(), Target.Num());
+		TArray<BYTE> Data;
+		FBufferWriter Writer( Data);
+		Writer << Header;
+		Writer.Serialize( CompressedData, (INT)CompressedSize);
+		free( CompressedData);
+
+		// Written under a temporary name, the channel may pick it up as soon as it exists
+		if ( !Cancelled && (Data.Num() < MaxSize) )
+		{
+			FString TempFile = DeltaFile + TEXT(".tmp");
+			if ( SaveDataToFile( *TempFile, Data.GetData(), Data.Num()) && GFileManager->Move( *DeltaFile, *TempFile, 1) )
+				DeltaSize = Data.Num();
+			else
+				GFileManager->Delete( *TempFile);
+		}
+	}
+};
+
+
+/*-----------------------------------------------------------------------------
+	LZMA Server
+-----------------------------------------------------------------------------*/
+
+//
+// Number of readers of a source
+// Reference counted so readers can outlive the source they were created from.
+//
+class FLZMARequestCounter
+{
+public:
+	volatile int32 Active;
+	volatile int32 RefCount;
+
+	FLZMARequestCounter()
+		: Active(0)
+		, RefCount(1)
+	{}
+
+	void AddRef()
+	{
+		FPlatformAtomics::InterlockedIncrement( &RefCount);
+	}
+
+	void Release()
+	{
+		if ( FPlatformAtomics::InterlockedDecrement( &RefCount) == 0 )
+			delete this;
+	}
+
+	// Reader started, keeps the counter alive until EndRequest
+	void BeginRequest()
+	{
+		AddRef();
+		FPlatformAtomics::InterlockedIncrement( &Active);
+	}
+
+	void EndRequest()
+	{
+		FPlatformAtomics::InterlockedDecrement( &Active);
+		Release();
+	}
+};
+
+class FArchiveProxyLock : public FArchive
+{
+public:
+	FArchive* Ar;
+	FLZMARequestCounter* Lock;
+
+	FArchiveProxyLock( FArchive* InAr, FLZMARequestCounter* InLock)
+		: Ar(InAr), Lock(InLock)
+	{
+		Lock->BeginRequest();
 	}
 	~FArchiveProxyLock()
 	{
-		Lock--;
-		delete Ar;
+		delete Ar;
+		Lock->EndRequest();
+	}
+
+	void Serialize( void* V, INT Length )  { Ar->Serialize( V, Length); }
+	virtual INT Tell()                     { return Ar->Tell(); }
+	virtual INT TotalSize()                { return Ar->TotalSize(); }
+	virtual void Seek( INT InPos )         { Ar->Seek(InPos); }
+	virtual UBOOL Close()                  { return Ar->Close(); }
+	virtual UBOOL GetError()               { return Ar->GetError(); }
+};
+
+static FArchiveProxyLock* CreateLock( FArchive* Archive, FLZMARequestCounter* Lock)
+{
+	if ( Archive )
+	{
+		if ( !Archive->GetError() )
+			return new FArchiveProxyLock( Archive, Lock);
+		delete Archive;
+	}
+	return nullptr;
+}
+
+//
+// Reference counted read-only data shared by all readers of a source
+// Data stays valid until the source and all of its readers are gone.
+//
+class FLZMASharedData
+{
+public:
+	enum EDataMode
+	{
+		SHARED_Malloc,
+		SHARED_Mapped,
+	};
+
+	BYTE*          Data;
+	INT            Size;
+	EDataMode      Mode;
+	volatile int32 RefCount;
+
+	FLZMASharedData( void* InData, INT InSize, EDataMode InMode)
+		: Data( (BYTE*)InData)
+		, Size(InSize)
+		, Mode(InMode)
+		, RefCount(1)
+	{}
+
+	void AddRef()
+	{
+		FPlatformAtomics::InterlockedIncrement( &RefCount);
+	}
+
+	void Release()
+	{
+		if ( FPlatformAtomics::InterlockedDecrement( &RefCount) == 0 )
+			delete this;
+	}
+
+	// Map a whole file in memory, pages are shared with the OS file cache
+	static FLZMASharedData* MapFile( const TCHAR* Filename)
+	{
+#if __UNIX__
+		int fd = open( appToAnsi(Filename), O_RDONLY);
+		if ( fd < 0 )
+			return nullptr;
+		struct stat Buf;
+		void* MapData = MAP_FAILED;
+		if ( (fstat(fd,&Buf) == 0) && (Buf.st_size > 0) && (Buf.st_size <= 0x7FFFFFFF) )
+			MapData = mmap( nullptr, Buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd); //Mapping stays valid
+		if ( MapData != MAP_FAILED )
+			return new FLZMASharedData( MapData, (INT)Buf.st_size, SHARED_Mapped);
+#endif
+		return nullptr;
+	}
+
+private:
+	~FLZMASharedData()
+	{
+#if __UNIX__
+		if ( Mode == SHARED_Mapped )
+			munmap( Data, Size);
+		else
+#endif
+		free( Data);
+	}
+};
+
+//
+// Lightweight reader of shared data, no handles or syscalls involved
+//
+class FLZMASharedReader : public FArchiveView
+{
+public:
+	FLZMASharedData*     Shared;
+	INT                  Pos;
+	FLZMARequestCounter* Lock;
+
+	FLZMASharedReader( FLZMASharedData* InShared, FLZMARequestCounter* InLock)
+		: Shared(InShared)
+		, Pos(0)
+		, Lock(InLock)
+	{
+		ArIsLoading = ArIsPersistent = 1;
+		Shared->AddRef();
+		Lock->BeginRequest();
+	}
+	~FLZMASharedReader()
+	{
+		Shared->Release();
+		Lock->EndRequest();
+	}
+
+	const BYTE* ReadView( INT Count)
+	{
+		if ( (Count < 0) || (Pos + Count > Shared->Size) )
+			return nullptr;
+		const BYTE* Result = Shared->Data + Pos;
+		Pos += Count;
+		return Result;
+	}
+
+	void Serialize( void* V, INT Length )
+	{
+		if ( (Length < 0) || (Pos + Length > Shared->Size) )
+		{
+			ArIsError = 1;
+			return;
+		}
+		appMemcpy( V, Shared->Data + Pos, Length);
+		Pos += Length;
+	}
+	INT Tell()              { return Pos; }
+	INT TotalSize()         { return Shared->Size; }
+	void Seek( INT InPos )  { Pos = Clamp( InPos, 0, Shared->Size); }
+};
+
+void FLZMAExport::Release()
+{
+	if ( Shared )
+	{
+		Shared->Release();
+		Shared = nullptr;
+	}
+	Data = nullptr;
+}
+
+//
+// Compressed output published while the compressor is still running
+// Written by a single compressor thread, chunks never move once published
+// so file channels can send from them without copying.
+//
+#define LZMA_LIVE_CHUNK (256*1024)
+
+class FLZMALiveData
+{
+public:
+	BYTE**         Chunks;
+	INT            MaxChunks;
+	INT            Num;       //Published bytes
+	UBOOL          bFinished;
+	UBOOL          bFailed;
+	volatile int32 Lock;
+	volatile int32 RefCount;
+
+	FLZMALiveData( INT SourceSize)
+		: MaxChunks( (SourceSize + SourceSize / 128 + 64*1024) / LZMA_LIVE_CHUNK + 1)
+		, Num(0)
+		, bFinished(0)
+		, bFailed(0)
+		, Lock(0)
+		, RefCount(1)
+	{
+		Chunks = (BYTE**)calloc( MaxChunks, sizeof(BYTE*));
+		if ( !Chunks )
+			bFailed = 1;
 	}
 
-	void Serialize( void* V, INT Length )  { Ar->Serialize( V, Length); }
-	virtual INT Tell()                     { return Ar->Tell(); }
-	virtual INT TotalSize()                { return Ar->TotalSize(); }
-	virtual void Seek( INT InPos )         { Ar->Seek(InPos); }
-	virtual UBOOL Close()                  { return Ar->Close(); }
-	virtual UBOOL GetError()               { return Ar->GetError(); }
+	void AddRef()
+	{
+		FPlatformAtomics::InterlockedIncrement( &RefCount);
+	}
+
+	void Release()
+	{
+		if ( FPlatformAtomics::InterlockedDecrement( &RefCount) == 0 )
+			delete this;
+	}
+
+	// Compressor thread
+	UBOOL Append( const void* Data, INT Count)
+	{
+		INT Pos = Num; //Only changed by this thread
+		while ( Count > 0 )
+		{
+			INT c = Pos / LZMA_LIVE_CHUNK;
+			if ( bFailed || (c >= MaxChunks) || (!Chunks[c] && !(Chunks[c]=(BYTE*)malloc(LZMA_LIVE_CHUNK))) )
+			{
+				Finish( 0);
+				return 0;
+			}
+			INT Copy = Min( Count, LZMA_LIVE_CHUNK - Pos % LZMA_LIVE_CHUNK);
+			appMemcpy( Chunks[c] + Pos % LZMA_LIVE_CHUNK, Data, Copy);
+			Data   = (const BYTE*)Data + Copy;
+			Count -= Copy;
+			Pos   += Copy;
+		}
+		CSpinLock SL(&Lock);
+		Num = Pos;
+		return 1;
+	}
+
+	void Finish( UBOOL bSuccess)
+	{
+		CSpinLock SL(&Lock);
+		if ( bSuccess )
+			bFinished = !bFailed;
+		else
+			bFailed = 1;
+	}
+
+	// Readers
+	INT GetStatus( UBOOL& bOutFinished, UBOOL& bOutFailed)
+	{
+		CSpinLock SL(&Lock);
+		bOutFinished = bFinished;
+		bOutFailed   = bFailed;
+		return Num;
+	}
+
+private:
+	~FLZMALiveData()
+	{
+		if ( Chunks )
+		{
+			for ( INT i=0; i<MaxChunks; i++)
+				if ( Chunks[i] )
+					free( Chunks[i]);
+			free( Chunks);
+		}
+	}
 };
 
-static FArchiveProxyLock* CreateLock( FArchive* Archive, INT& Lock)
+static UBOOL LzmaLiveAppend( FLZMALiveData* Live, const void* Data, INT Count)
 {
-	if ( Archive )
+	return Live->Append( Data, Count);
+}
+
+//
+// Reader of a stream being compressed
+// Not counted in ActiveRequests, holding the live data is enough.
+//
+class FLZMALiveReader : public FArchiveView
+{
+public:
+	FLZMALiveData* Live;
+	INT            Pos;
+
+	FLZMALiveReader( FLZMALiveData* InLive)
+		: Live(InLive)
+		, Pos(0)
 	{
-		if ( !Archive->GetError() )
-			return new FArchiveProxyLock( Archive, Lock);
-		delete Archive;
+		ArIsLoading = ArIsPersistent = 1;
+		Live->AddRef();
 	}
-	return nullptr;
-}
+	~FLZMALiveReader()
+	{
+		Live->Release();
+	}
+
+	// Only within a chunk, Serialize copies across chunk boundaries
+	const BYTE* ReadView( INT Count)
+	{
+		if ( (Count <= 0) || (Pos + Count > TotalSize()) || (Pos / LZMA_LIVE_CHUNK != (Pos + Count - 1) / LZMA_LIVE_CHUNK) )
+			return nullptr;
+		const BYTE* Result = Live->Chunks[Pos / LZMA_LIVE_CHUNK] + Pos % LZMA_LIVE_CHUNK;
+		Pos += Count;
+		return Result;
+	}
+
+	void Serialize( void* V, INT Length )
+	{
+		if ( (Length < 0) || (Pos + Length > TotalSize()) )
+		{
+			ArIsError = 1;
+			return;
+		}
+		while ( Length > 0 )
+		{
+			INT Copy = Min( Length, LZMA_LIVE_CHUNK - Pos % LZMA_LIVE_CHUNK);
+			appMemcpy( V, Live->Chunks[Pos / LZMA_LIVE_CHUNK] + Pos % LZMA_LIVE_CHUNK, Copy);
+			V       = (BYTE*)V + Copy;
+			Length -= Copy;
+			Pos    += Copy;
+		}
+	}
+
+	UBOOL IsComplete()
+	{
+		UBOOL bFinished, bFailed;
+		Live->GetStatus( bFinished, bFailed);
+		if ( bFailed )
+			ArIsError = 1;
+		return bFinished || bFailed;
+	}
+
+	INT Tell()              { return Pos; }
+	INT TotalSize()         { UBOOL bFinished, bFailed; return Live->GetStatus( bFinished, bFailed); }
+	void Seek( INT InPos )  { Pos = Clamp( InPos, 0, TotalSize()); }
+};
 
 #define NAME_LZMAServer (EName)GetClass()->GetFName().GetIndex()
 
@@ -352,9 +2010,51 @@ FLZMASourceBase::FLZMASourceBase( const FPackageInfo& Info)
 	, CompressedSize(0)
 	, State(CS_STATE_Waiting)
 	, Priority(0)
-	, ActiveRequests(0)
+	, Requests(new FLZMARequestCounter())
+	, LastServed(appSeconds())
+	, Hits(0)
+	, ContainerSize(0)
+	, Hash(0)
+	, bSpillFailed(0)
+	, Live(nullptr)
 {}
 
+//
+// Replacement sources keep counting the readers of the one they replace
+//
+FLZMASourceBase::FLZMASourceBase( const FLZMASourceBase& Other)
+	: Guid(Other.Guid)
+	, Filename(Other.Filename)
+	, OriginalSize(Other.OriginalSize)
+	, CompressedSize(Other.CompressedSize)
+	, State(Other.State)
+	, Priority(Other.Priority)
+	, Requests(Other.Requests)
+	, LastServed(Other.LastServed)
+	, Hits(Other.Hits)
+	, ContainerFile(Other.ContainerFile)
+	, ContainerSize(Other.ContainerSize)
+	, Hash(Other.Hash)
+	, bSpillFailed(Other.bSpillFailed)
+	, Live(Other.Live)
+{
+	Requests->AddRef();
+	if ( Live )
+		Live->AddRef();
+}
+
+FLZMASourceBase::~FLZMASourceBase()
+{
+	if ( Live )
+		Live->Release();
+	Requests->Release(); //Readers may still hold it
+}
+
+INT FLZMASourceBase::ActiveRequests()
+{
+	return Requests->Active;
+}
+
 
 //
 // Temporary stub
@@ -377,28 +2077,51 @@ class FLZMASourceFile : public FLZMASourceBase
 {
 public:
 	FString CmpFilename;
-
-	FLZMASourceFile( const FLZMASourceBase& Base, void* InData)
-		: FLZMASourceBase(Base)
-		, CmpFilename( CreateFilename(Base.Guid) )
-	{
-		if ( SaveDataToFile( *(FString(LZMA_CACHE_PATH)+CmpFilename), InData, CompressedSize) )
-			State = CS_STATE_Ready;
-		else
-			State = CS_STATE_NoSource;
-	}
+	FLZMASharedData* Mapping; //Created on first request
+	UBOOL bMapFailed; //Don't retry, serve through file readers
 
 	FLZMASourceFile( const FPackageInfo& Info, const TCHAR* InFilename)
 		: FLZMASourceBase(Info)
 		, CmpFilename(InFilename)
+		, Mapping(nullptr)
+		, bMapFailed(0)
+	{
+		CompressedSize = GFileManager->FileSize( *(FString(LZMA_CACHE_PATH)+InFilename) );
+		State = CS_STATE_Ready;
+	}
+
+	// Compressor already wrote the file
+	FLZMASourceFile( const FLZMASourceBase& Base, const TCHAR* InCmpFilename)
+		: FLZMASourceBase(Base)
+		, CmpFilename(InCmpFilename)
+		, Mapping(nullptr)
+		, bMapFailed(0)
 	{
-		CompressedSize = GFileManager->FileSize(InFilename);
 		State = CS_STATE_Ready;
 	}
 
+	~FLZMASourceFile()
+	{
+		if ( Mapping )
+			Mapping->Release();
+	}
+
 	FArchive* CreateReader()
 	{
-		return CreateLock( GFileManager->CreateFileReader(*(FString(LZMA_CACHE_PATH)+CmpFilename)), ActiveRequests);
+		FArchiveView* View = CreateView();
+		if ( View )
+			return View;
+		return CreateLock( GFileManager->CreateFileReader(*(FString(LZMA_CACHE_PATH)+CmpFilename)), Requests);
+	}
+
+	FArchiveView* CreateView()
+	{
+		if ( !Mapping && !bMapFailed )
+		{
+			Mapping = FLZMASharedData::MapFile( *(FString(LZMA_CACHE_PATH)+CmpFilename) );
+			bMapFailed = (Mapping == nullptr);
+		}
+		return Mapping ? new FLZMASharedReader(Mapping,Requests) : nullptr;
 	}
 
 	FString GetCompressedFile()
@@ -419,32 +2142,172 @@ public:
 class FLZMASourceMemory : public FLZMASourceBase
 {
 public:
-	struct FArrayMod
-	{
-		void* Data;
-		int32 Size;
-		int32 MaxSize;
-	};
-	FArrayMod Data;
+	FLZMASharedData* Shared;
 
 	FLZMASourceMemory( const FLZMASourceBase& Base, void* InData)
 		: FLZMASourceBase(Base)
+		, Shared( new FLZMASharedData(InData,Base.CompressedSize,FLZMASharedData::SHARED_Malloc) )
 	{
 		State = CS_STATE_Ready;
-		Data.Data = InData;
-		Data.Size = CompressedSize;
-		Data.MaxSize = CompressedSize;
 	}
 
 	~FLZMASourceMemory()
 	{
-		free(Data.Data);
-		Data = {nullptr,0,0};
+		Shared->Release(); //Readers may still hold it
 	}
 
-	FArchive* CreateReader()    { return CreateLock( new FBufferReader(*(TArray<BYTE>*)&Data), ActiveRequests); }
-	void* GetMemory()           { return Data.Data;}
+	FArchive* CreateReader()    { return CreateView(); }
+	FArchiveView* CreateView()  { return new FLZMASharedReader(Shared,Requests); }
+	void* GetMemory()           { return Shared->Data;}
 	INT   GetMemorySize()       { return CompressedSize; };
+	FLZMASharedData* GetSharedData() { return Shared; }
+};
+
+//
+// Container readers only touch their own file, they don't keep the source's
+// data busy and don't hold up spilling it to the file cache.
+//
+FArchive* FLZMASourceBase::CreateContainerReader()
+{
+	if ( ContainerSize <= 0 )
+		return nullptr;
+	FArchive* Reader = GFileManager->CreateFileReader( *(FString(LZMA_CACHE_PATH)+ContainerFile) );
+	if ( Reader && Reader->GetError() )
+	{
+		delete Reader;
+		Reader = nullptr;
+	}
+	return Reader;
+}
+
+FArchiveView* FLZMASourceBase::CreateLiveReader()
+{
+	if ( !Live )
+		return nullptr;
+	UBOOL bFinished, bFailed;
+	Live->GetStatus( bFinished, bFailed);
+	return bFailed ? nullptr : new FLZMALiveReader( Live);
+}
+
+//
+// Compresses a single source in a worker thread
+// Sources being compressed are only deleted by ULZMAServer::FinishCompression
+// so the Source pointer remains a valid identifier until the job is claimed.
+//
+class FLZMACompressJob : public FAsyncJob
+{
+public:
+	FLZMASourceBase* Source; //Never accessed by the worker
+	FArchive*        Reader;
+	FString          CmpFilename; //Stream into this cache file instead of memory
+	FLZMAParams      Params;
+	FLZMALiveData*   Live;
+	void*            CompressedData;
+	size_t           CompressedSize;
+	DWORD            Hash;
+	TCHAR            Error[256];
+
+	FLZMACompressJob( FLZMASourceBase* InSource, FArchive* InReader, const TCHAR* InCmpFilename=TEXT(""))
+		: FAsyncJob(InSource->Priority)
+		, Source(InSource)
+		, Reader(InReader)
+		, CmpFilename(InCmpFilename)
+		, Params( LzmaGetParams(*InSource->Filename,InSource->OriginalSize) )
+		, Live(InSource->Live)
+		, CompressedData(nullptr)
+		, CompressedSize(0)
+		, Hash(0)
+	{
+		Error[0] = '\0';
+		if ( Live )
+			Live->AddRef();
+	}
+
+	~FLZMACompressJob()
+	{
+		if ( Reader )
+			delete Reader;
+		if ( CompressedData )
+			free(CompressedData);
+		if ( Live )
+		{
+			Live->Finish( 0); //Discarded before running
+			Live->Release();
+		}
+	}
+
+	void Run()
+	{
+		// Hash is computed as the compressor reads the source
+		if ( CmpFilename.Len() )
+		{
+			FString Filename = FString(LZMA_CACHE_PATH) + CmpFilename;
+			FArchive* Writer = GFileManager->CreateFileWriter( *Filename);
+			if ( Writer && !Writer->GetError() )
+			{
+				CompressedSize = LzmaCompress( Reader, Writer, Error, Params, &Cancelled, Live, &Hash);
+				if ( !Writer->Close() )
+					CompressedSize = 0;
+			}
+			else
+				appSprintf( Error, TEXT("Unable to create cache file %s"), *Filename);
+			if ( Writer )
+				delete Writer;
+			if ( !CompressedSize )
+				GFileManager->Delete( *Filename);
+		}
+		else
+			LzmaCompress( Reader, CompressedData, CompressedSize, Error, Params, &Cancelled, Live, &Hash);
+		if ( !CompressedSize )
+			Hash = 0;
+		delete Reader;
+		Reader = nullptr;
+		if ( Live )
+		{
+			Live->Finish( CompressedSize != 0);
+			Live->Release();
+			Live = nullptr;
+		}
+	}
+};
+
+//
+// Writes an in-memory source to the file cache in a worker thread
+// The source keeps serving from memory until the server claims the finished job.
+//
+class FLZMASpillJob : public FAsyncJob
+{
+public:
+	FLZMASourceBase* Source; //Never accessed by the worker
+	FLZMASharedData* Data;
+	FString          Filename; //Of source package
+	FString          CmpFilename; //Picked by the main thread
+	UBOOL            bEviction; //Memory cache policy pushed it out
+	UBOOL            bSuccess;
+
+	FLZMASpillJob( FLZMASourceBase* InSource, FLZMASharedData* InData, const TCHAR* InCmpFilename, UBOOL InEviction)
+		: Source(InSource)
+		, Data(InData)
+		, Filename(InSource->Filename)
+		, CmpFilename(InCmpFilename)
+		, bEviction(InEviction)
+		, bSuccess(0)
+	{
+		Data->AddRef();
+	}
+
+	~FLZMASpillJob()
+	{
+		Data->Release();
+	}
+
+	void Run()
+	{
+		FString CmpPath = FString(LZMA_CACHE_PATH) + CmpFilename;
+		bSuccess = SaveDataToFile( *CmpPath, Data->Data, Data->Size);
+		if ( !bSuccess )
+			GFileManager->Delete( *CmpPath);
+	}
 };
 
 //
@@ -519,12 +2382,26 @@ void ULZMAServer::StaticConstructor()
 	Defaults->MaxMemCacheMegs       =  16;
 	Defaults->MaxFileCacheMegs      = 256;
 	Defaults->ForceSourceToFileMegs =   8;
+	Defaults->MaxCompressionThreads =   2;
+	Defaults->MultiBlockMinMegs     =  16;
+	Defaults->MaxUploadRate         =   0;
+	Defaults->LevelUploadWeight     =   4;
+	Defaults->MaxDeltaBases         =   2;
+	Defaults->HttpPort              =   0;
+	Defaults->HttpMaxConnections    =  32;
 
 	// Get these to LzmaCache.ini
 	new(Class,TEXT("Silent")               , RF_Public) UBoolProperty( CPP_PROPERTY(Silent)              , TEXT("Settings"), CPF_Native|CPF_Edit);
 	new(Class,TEXT("MaxMemCacheMegs")      , RF_Public) UIntProperty( CPP_PROPERTY(MaxMemCacheMegs)      , TEXT("Settings"), CPF_Native|CPF_Edit);
 	new(Class,TEXT("MaxFileCacheMegs")     , RF_Public) UIntProperty( CPP_PROPERTY(MaxFileCacheMegs)     , TEXT("Settings"), CPF_Native|CPF_Edit);
 	new(Class,TEXT("ForceSourceToFileMegs"), RF_Public) UIntProperty( CPP_PROPERTY(ForceSourceToFileMegs), TEXT("Settings"), CPF_Native|CPF_Edit);
+	new(Class,TEXT("MaxCompressionThreads"), RF_Public) UIntProperty( CPP_PROPERTY(MaxCompressionThreads), TEXT("Settings"), CPF_Native|CPF_Edit);
+	new(Class,TEXT("MultiBlockMinMegs")    , RF_Public) UIntProperty( CPP_PROPERTY(MultiBlockMinMegs)    , TEXT("Settings"), CPF_Native|CPF_Edit);
+	new(Class,TEXT("MaxUploadRate")        , RF_Public) UIntProperty( CPP_PROPERTY(MaxUploadRate)        , TEXT("Settings"), CPF_Native|CPF_Edit);
+	new(Class,TEXT("LevelUploadWeight")    , RF_Public) UIntProperty( CPP_PROPERTY(LevelUploadWeight)    , TEXT("Settings"), CPF_Native|CPF_Edit);
+	new(Class,TEXT("MaxDeltaBases")        , RF_Public) UIntProperty( CPP_PROPERTY(MaxDeltaBases)        , TEXT("Settings"), CPF_Native|CPF_Edit);
+	new(Class,TEXT("HttpPort")             , RF_Public) UIntProperty( CPP_PROPERTY(HttpPort)             , TEXT("Settings"), CPF_Native|CPF_Edit);
+	new(Class,TEXT("HttpMaxConnections")   , RF_Public) UIntProperty( CPP_PROPERTY(HttpMaxConnections)   , TEXT("Settings"), CPF_Native|CPF_Edit);
 
 	// Status
 	new(Class,TEXT("bPendingRelocation"),RF_Public) UBoolProperty( CPP_PROPERTY(bPendingRelocation),TEXT("LZMAServer"), CPF_Transient|CPF_Edit);
@@ -539,14 +2416,48 @@ void ULZMAServer::Destroy()
 {
 	guard(ULZMAServer::Destroy);
 
-	// Wait a bit to ensure the other thread gets to read the RF_Destroyed flag change
-	if ( ThreadPtr )
+	// Requests being sent keep their data alive
+	if ( HttpServer )
+	{
+		delete HttpServer;
+		HttpServer = nullptr;
+	}
+
+	// Running compressors are cancelled and clean up after themselves
+	if ( Compressor )
+	{
+		Compressor->Release();
+		Compressor = nullptr;
+	}
+
+	if ( Spiller )
+	{
+		Spiller->Release();
+		Spiller = nullptr;
+	}
+	for ( INT i=0; i<FinishedSpills.Num(); i++)
+		delete FinishedSpills(i);
+	FinishedSpills.Empty();
+	Spilling.Empty();
+
+	if ( BlockCompressor )
+	{
+		BlockCompressor->Release();
+		BlockCompressor = nullptr;
+	}
+
+	if ( DeltaCompressor )
 	{
-		AsyncLock.Acquire();
-		if ( AsyncKey )
-			*AsyncKey = 0;
-		appSleep(0.05);
-		AsyncLock.Release();
+		DeltaCompressor->Release();
+		DeltaCompressor = nullptr;
+	}
+	DeltaPending.Empty();
+	DeltaFailed.Empty();
+
+	if ( Manifest )
+	{
+		delete Manifest;
+		Manifest = nullptr;
 	}
 
 	// RF_Destroyed for object being destroyed!!
@@ -554,6 +2465,8 @@ void ULZMAServer::Destroy()
 		if ( *It )
 			delete *It;
 	Sources.Empty();
+	SourceMap.Empty();
+	SourceNameMap.Empty();
 	Super::Destroy();
 	unguard;
 }
@@ -567,224 +2480,407 @@ void ULZMAServer::Tick(FLOAT DeltaTime)
 
 	LastUpdated += DeltaTime;
 
-	if ( LastError[0] != '\0' )
+	if ( HttpServer )
+		HttpServer->Tick( this);
+
+	// Claim finished compressors
+	if ( Compressor )
 	{
-		GWarn->Log( NAME_LZMAServer, LastError);
-		LastError[0] = '\0';
+		FAsyncJob* Job;
+		while ( (Job=Compressor->GetFinished()) != nullptr )
+		{
+			FinishCompression( (FLZMACompressJob*)Job);
+			delete Job;
+		}
 	}
 
-	CThread*& Thread = (CThread*&)ThreadPtr;
+	// Claim finished spills, retry those whose source is still being read from
+	for ( INT i=0; i<FinishedSpills.Num(); i++)
+		if ( FinishSpill(FinishedSpills(i)) )
+		{
+			delete FinishedSpills(i);
+			FinishedSpills.Remove(i--);
+		}
+	if ( Spiller )
+	{
+		FAsyncJob* Job;
+		while ( (Job=Spiller->GetFinished()) != nullptr )
+		{
+			if ( FinishSpill( (FLZMASpillJob*)Job) )
+				delete Job;
+			else
+				FinishedSpills.AddItem( (FLZMASpillJob*)Job);
+		}
+	}
 
-	// Cleanup finished thread
-	if ( Thread && Thread->IsEnded() )
+	// Claim finished container blocks, the last one of each container wrote the file
+	if ( BlockCompressor )
 	{
-		AsyncKey = nullptr;
-		AsyncLock.Release();
-		Thread->Detach();
-		delete Thread;
-		Thread = nullptr;
+		FAsyncJob* Job;
+		while ( (Job=BlockCompressor->GetFinished()) != nullptr )
+		{
+			if ( ((FLZMABlockJob*)Job)->bLast )
+				FinishContainer( (FLZMABlockJob*)Job);
+			delete Job;
+		}
 	}
 
+	if ( DeltaCompressor )
+	{
+		FAsyncJob* Job;
+		while ( (Job=DeltaCompressor->GetFinished()) != nullptr )
+		{
+			FinishDelta( (FLZMADeltaJob*)Job);
+			delete Job;
+		}
+	}
 
 	if ( !bProcessingMap && !bPendingRelocation )
 		return;
 
-	// Worker thread still operating
-	if ( AsyncLock.IsActive() && (LastUpdated < 30) )
+	// Clean up sources
+	for ( int32 i=0; i<Sources.Num(); i++)
+	{
+		FLZMASourceBase* Source = Sources(i);
+
+		// Owned by a compressor until it finishes
+		if ( Source->State == CS_STATE_Compressing )
+			continue;
+
+		// Leftover from previous level, make sure it's gone
+		if ( Source->Priority < 0 )
+			Source->State = CS_STATE_NoSource;
+
+		if ( (Source->State == CS_STATE_Initializing) || (Source->State == CS_STATE_NoSource) )
+		{
+			RemoveSource(i--);
+		}
+	}
+
+	RelocateSources( bPendingRelocation);
+	bPendingRelocation = false;
+
+	QueueCompression();
+	for ( int32 i=0; i<Sources.Num() && (!BlockCompressor || !BlockCompressor->NumActive()); i++)
+		QueueContainer(i);
+
+	// Nothing waiting or being compressed, no more updates need to be pushed
+	if ( bProcessingMap )
+	{
+		for ( int32 i=0; i<Sources.Num(); i++)
+			if ( (Sources(i)->State == CS_STATE_Waiting) || (Sources(i)->State == CS_STATE_Compressing) )
+				return;
+		if ( BlockCompressor && BlockCompressor->NumActive() )
+			return;
+		bProcessingMap = false;
+		if ( Sources.Num() && !Silent )
+			debugf( NAME_LZMAServer, TEXT("All sources processed (%i)"), Sources.Num() );
+	}
+
+	unguard;
+}
+
+//
+// Feed waiting sources to the compressor pool, highest priority first
+// Only as many jobs as workers are queued so priority changes are honored until the last moment
+//
+void ULZMAServer::QueueCompression()
+{
+	guard(ULZMAServer::QueueCompression);
+
+	if ( !Compressor )
+		Compressor = new FAsyncJobQueue( Max(MaxCompressionThreads,1) );
+
+	while ( Compressor->NumActive() < Max(MaxCompressionThreads,1) )
+	{
+		int32 PriorityMax = -1;
+		int32 PrioritySelect = INDEX_NONE;
+		for ( int32 i=0; i<Sources.Num(); i++)
+			if ( (Sources(i)->State == CS_STATE_Waiting) && (Sources(i)->Priority > PriorityMax) )
+			{
+				PriorityMax = Sources(i)->Priority;
+				PrioritySelect = i;
+			}
+		if ( PrioritySelect == INDEX_NONE )
+			break;
+
+		// Try to open file
+		FLZMASourceBase* Source = Sources(PrioritySelect);
+		FArchive* Reader = GFileManager->CreateFileReader(*Source->Filename);
+		if ( !Reader || Reader->GetError() )
+		{
+			if ( Reader )
+				delete Reader;
+			RemoveSource(PrioritySelect);
+			continue;
+		}
+
+		// Large packages are streamed straight into the file cache
+		FString CmpFilename;
+		if ( (ForceSourceToFileMegs > 0) && (Source->OriginalSize / (1024*1024) >= ForceSourceToFileMegs) )
+			CmpFilename = CreateFilename(Source->Guid);
+
+		// Let file channels send the output as it's produced
+		if ( GetEncoderHandles() && !Source->Live )
+			Source->Live = new FLZMALiveData( Source->OriginalSize);
+
+		Source->State = CS_STATE_Compressing;
+		LastUpdated = 0;
+		if ( !Silent )
+			debugf( NAME_LZMAServer, TEXT("Autocompressing package %s"), *Source->Filename);
+		Compressor->Add( new FLZMACompressJob(Source,Reader,*CmpFilename) );
+	}
+
+	unguard;
+}
+
+//
+// A compressor has finished, evaluate what type of source to use
+//
+void ULZMAServer::FinishCompression( FLZMACompressJob* Job)
+{
+	guard(ULZMAServer::FinishCompression);
+
+	if ( Job->Error[0] )
+		GWarn->Log( NAME_LZMAServer, Job->Error);
+
+	int32 i = Sources.FindItemIndex(Job->Source);
+	if ( i == INDEX_NONE )
+		return;
+
+	// Readers of the live output hold their own references
+	if ( Sources(i)->Live )
+	{
+		Sources(i)->Live->Release();
+		Sources(i)->Live = nullptr;
+	}
+
+	// Failed, or level changed and this package is no longer needed
+	UBOOL bToFile = Job->CmpFilename.Len() > 0;
+	if ( !Job->CompressedSize || (!bToFile && !Job->CompressedData) || (Sources(i)->Priority < 0) )
+	{
+		if ( bToFile && Job->CompressedSize )
+			GFileManager->Delete( *(FString(LZMA_CACHE_PATH)+Job->CmpFilename) );
+		RemoveSource(i);
 		return;
+	}
+
+	// Set Size
+	Sources(i)->CompressedSize = (int32)Job->CompressedSize;
+	Sources(i)->Hash = Job->Hash;
+
+	if ( bToFile )
+	{
+		// Compressor streamed directly to file
+		FLZMASourceFile* SourceFile = new FLZMASourceFile( *Sources(i), *Job->CmpFilename);
+		AddFileCacheEntry( *SourceFile->CmpFilename, *SourceFile->Filename, SourceFile->Guid, SourceFile->Hash);
+		ReplaceSource( i, SourceFile);
+	}
+	else
+	{
+		// Claim and keep in memory
+		FLZMASourceMemory* SourceMem = new FLZMASourceMemory( *Sources(i), Job->CompressedData);
+		Job->CompressedData = nullptr;
+		ReplaceSource( i, SourceMem);
+
+		// Serve from memory until it's saved to file
+		if ( (ForceSourceToFileMegs > 0) && (SourceMem->OriginalSize / (1024*1024) >= ForceSourceToFileMegs) )
+		{
+			if ( !Silent )
+				debugf( NAME_LZMAServer, TEXT("Pushing package to file cache (size limit)") );
+			QueueSpill( i);
+		}
+	}
+
+	unguard;
+}
+
+//
+// Write an in-memory source to the file cache in the background
+//
+void ULZMAServer::QueueSpill( INT i, UBOOL bEviction)
+{
+	guard(ULZMAServer::QueueSpill);
 
-	// Worker thread queued for start
-	if ( !AsyncLock.IsActive() && Thread && (LastUpdated < 2) )
+	FLZMASourceBase* Source = Sources(i);
+	if ( (Source->GetMemorySize() <= 0) || Source->bSpillFailed || (Spilling.FindItemIndex(Source) != INDEX_NONE) )
 		return;
 
-	// Delete lingering thread handler if something went wrong
-	if ( Thread )
+	// File system lookups stay on this thread, reserve the name until the worker writes it
+	FString CmpFilename = CreateFilename( Source->Guid);
+	if ( !SaveDataToFile( *(FString(LZMA_CACHE_PATH)+CmpFilename), nullptr, 0) )
 	{
-		debugf( NAME_LZMAServer, TEXT("Deleted lingering compressor thread") );
-		Thread->Detach();
-		delete Thread;
+		Source->bSpillFailed = 1;
+		return;
 	}
 
-	// Setup
-	Thread   = nullptr;
-	AsyncKey = nullptr;
-	AsyncLock.Release();
+	if ( !Spiller )
+		Spiller = new FAsyncJobQueue(1);
+	Spilling.AddItem( Source);
+	Spiller->Add( new FLZMASpillJob( Source, ((FLZMASourceMemory*)Source)->Shared, *CmpFilename, bEviction) ); //Only memory sources have memory
+
+	unguard;
+}
 
-	// Lock
-	CAtomicLock::CScope ScopedLock(AsyncLock);
+//
+// A spill has finished, switch the source to its file
+// Returns false if the source is still being read from
+//
+UBOOL ULZMAServer::FinishSpill( FLZMASpillJob* Job)
+{
+	guard(ULZMAServer::FinishSpill);
 
-	// This compressor just finished, evaluate what type of source to use
-	if ( AsyncCompressedData && AsyncCompressedSize && Sources.IsValidIndex(AsyncSource) )
+	INT i = Spilling.FindItemIndex(Job->Source) != INDEX_NONE ? Sources.FindItemIndex(Job->Source) : INDEX_NONE;
+	if ( (i == INDEX_NONE) || !Job->bSuccess )
 	{
-		int32 i = AsyncSource;
-		if ( Sources(i)->State == CS_STATE_Compressing )
+		// Source is gone or couldn't be saved, keep serving it from memory
+		if ( Job->bSuccess )
+			GFileManager->Delete( *(FString(LZMA_CACHE_PATH)+Job->CmpFilename) );
+		else
 		{
-			// Set Size
-			Sources(i)->CompressedSize = (int32)AsyncCompressedSize;
-
-			if ( (ForceSourceToFileMegs > 0) && (Sources(i)->OriginalSize / (1024*1024) >= ForceSourceToFileMegs) )
-			{
-				// Directly save to file
-				if ( !Silent )
-					debugf( NAME_LZMAServer, TEXT("Pushing package to file cache (size limit)") );
-				FLZMASourceFile* SourceFile = new FLZMASourceFile( *Sources(i), AsyncCompressedData);
-				if ( SourceFile->State == CS_STATE_Ready )
-					AddFileCacheEntry( *SourceFile->CmpFilename, *SourceFile->Filename);
-				delete Sources(i);
-				Sources(i) = SourceFile;
-			}
-			else
-			{
-				// Claim and keep in memory
-				FLZMASourceMemory* SourceMem = new FLZMASourceMemory( *Sources(i), AsyncCompressedData);
-				AsyncCompressedData = nullptr;
-				delete Sources(i);
-				Sources(i) = SourceMem;
-			}
+			GWarn->Log( NAME_LZMAServer, *FString::Printf(TEXT("Unable to save %s to file cache"), *Job->Filename) );
+			if ( i != INDEX_NONE )
+				Sources(i)->bSpillFailed = 1;
 		}
+		Spilling.RemoveItem( Job->Source);
+		return 1;
 	}
 
-	// Data wasn't claimed, free it
-	if ( AsyncCompressedData )
-		free(AsyncCompressedData);
-	if ( AsyncReader )
-	{
-		delete AsyncReader;
-		AsyncReader = nullptr;
-	}
-	AsyncCompressedData = nullptr;
-	AsyncCompressedSize = 0;
-	AsyncSource = INDEX_NONE;
+	// Readers hold references to the source
+	if ( Sources(i)->ActiveRequests() > 0 )
+		return 0;
 
-	// Clean up sources and select highest priority one
-	int32 PriorityMax = -1;
-	int32 PrioritySelect = INDEX_NONE;
-	for ( int32 i=0; i<Sources.Num(); i++)
-	{
-		FLZMASourceBase* Source = Sources(i);
+	FLZMASourceFile* SourceFile = new FLZMASourceFile( *Sources(i), *Job->CmpFilename);
+	AddFileCacheEntry( *SourceFile->CmpFilename, *SourceFile->Filename, SourceFile->Guid, SourceFile->Hash);
+	if ( !Silent )
+		debugf( NAME_LZMAServer, TEXT("Pushed cache to file [%s] -> [%s]"), *SourceFile->Filename, *SourceFile->CmpFilename);
+	Spilling.RemoveItem( Job->Source);
+	ReplaceSource( i, SourceFile);
+	if ( Job->bEviction )
+		Evictions++;
+	return 1;
 
-		// Leftover from previous level, make sure it's gone
-		if ( Source->Priority < 0 )
-			Source->State = CS_STATE_NoSource;
+	unguard;
+}
 
-		switch ( Source->State ) 
-		{
-		case CS_STATE_Initializing:
-		case CS_STATE_Compressing:
-		case CS_STATE_NoSource:
-			delete Source;
-			Sources.Remove(i--);
-			break;
-		case CS_STATE_Waiting:
-			if ( Source->Priority > PriorityMax )
-			{
-				PriorityMax = Source->Priority;
-				PrioritySelect = i;
-			}
-			break;
-		default:
-			break;
-		}
-	}
 
-	RelocateSources( bPendingRelocation);
-	bPendingRelocation = false;
+//
+// Build the multi-block version of a large file cache source, one container at a time
+//
+void ULZMAServer::QueueContainer( INT i)
+{
+	guard(ULZMAServer::QueueContainer);
 
-	// Nothing was selected, no more updates need to be pushed
-	if ( !Sources.IsValidIndex(PrioritySelect) )
-	{
-		bProcessingMap = false;
-		if ( Sources.Num() && !Silent )
-			debugf( NAME_LZMAServer, TEXT("All sources processed (%i)"), Sources.Num() );
+	FLZMASourceBase* Source = Sources(i);
+	if ( (MultiBlockMinMegs <= 0) || (Source->State != CS_STATE_Ready) || (Source->Priority < 0) || Source->ContainerFile.Len()
+		|| (Source->OriginalSize / (1024*1024) < MultiBlockMinMegs) )
 		return;
-	}
 
-	// Try to open file
-	AsyncReader = GFileManager->CreateFileReader(*Sources(PrioritySelect)->Filename);
-	if ( !AsyncReader || AsyncReader->GetError() )
-	{
-		if ( AsyncReader )
-			delete AsyncReader;
-		AsyncReader = nullptr;
-		delete Sources(PrioritySelect);
-		Sources.Remove(PrioritySelect);
+	FString ContainerFile = GetContainerFilename( Source->GetCompressedFile() );
+	if ( !ContainerFile.Len() )
 		return;
-	}
 
-	// Select source
-	Sources(PrioritySelect)->State = CS_STATE_Initializing;
-	AsyncSource         = PrioritySelect;
-	AsyncCompressedData = nullptr;
-	AsyncCompressedSize = 0;
+	// Blocks are small, the dictionary doesn't need to be any larger
+	FLZMAParams Params = LzmaGetParams( *Source->Filename, Source->OriginalSize);
+	Params.DictSize = Min( Params.DictSize, LZMA_CONTAINER_BLOCK);
+
+	if ( !BlockCompressor )
+		BlockCompressor = new FAsyncJobQueue( Max(MaxCompressionThreads,1) );
+	FLZMAContainerBuild* Build = new FLZMAContainerBuild( Source->Guid, *Source->Filename, *ContainerFile, Source->OriginalSize);
+	for ( INT j=0; j<Build->NumBlocks; j++)
+		BlockCompressor->Add( new FLZMABlockJob( Build, j, Params) );
+	Build->Release();
+	Source->ContainerFile = ContainerFile;
+	Source->ContainerSize = 0;
 	LastUpdated = 0;
 	if ( !Silent )
-		debugf( NAME_LZMAServer, TEXT("Autocompressing package %s"), *Sources(PrioritySelect)->Filename);
-
-	// Create compressor if required
-	if ( !Thread )
-	{
-		Thread = new CThread( [](void* Arg, CThread* Handler)
-		{ 
-			volatile int32 Key = 1; // If this is zero, do not try to access the server
-			TCHAR Error[256] = {0};
-			ULZMAServer* Server = (ULZMAServer*)Arg;
+		debugf( NAME_LZMAServer, TEXT("Building multi-block container for %s"), *Source->Filename);
 
-			// Compres ONE source
-			try
-			{
-				// Safety stops
-				int32 i = Server->AsyncSource;
-				if ( (Server->ThreadPtr != Handler) || !Server->Sources.IsValidIndex(i) )
-					return THREAD_END_NOT_OK;
-
-				Server->AsyncLock.Acquire();
-				Server->AsyncKey = &Key;
-				void*  Data;
-				size_t Size;
-				Server->Sources(i)->State = CS_STATE_Compressing;
-				LzmaCompress( Server->AsyncReader, Data, Size, Error);
-
-				// Server not available after compression ended
-				// Or thread timed out and server replaced it
-				if ( GIsRequestingExit || !Key || (Server->GetFlags() & RF_Destroyed) || (Server->AsyncSource != i) || (Server->ThreadPtr != Handler) )
-				{
-					if ( Data )
-						free(Data);
-					return THREAD_END_OK;
-				}
+	unguard;
+}
 
-				appStrcpy( Server->LastError, Error);
-				Server->AsyncCompressedData = Data;
-				Server->AsyncCompressedSize = Size;
-				if ( !Data )
-					Server->Sources(i)->State = CS_STATE_NoSource;
-				Server->LastUpdated = 0;
-			}
-			catch(...)
-			{}
+//
+// Container file written (or failed), attach to its source
+//
+void ULZMAServer::FinishContainer( FLZMABlockJob* Job)
+{
+	guard(ULZMAServer::FinishContainer);
 
-			if ( Key )
-			{
-				Key = 0;
-				Server->AsyncLock.Release();
-				Server->AsyncKey = nullptr;
-			}
+	if ( Job->Error[0] )
+		GWarn->Log( NAME_LZMAServer, Job->Error);
 
-			return THREAD_END_OK;
-		}, this, 0 );
-	}
+	FLZMAContainerBuild* Build = Job->Build;
+	FString ContainerPath = FString(LZMA_CACHE_PATH) + Build->ContainerFile;
+	TArray<FLZMASourceBase*> Found;
+	SourceMap.MultiFind( GetGuidHash(Build->Guid), Found);
+	for ( INT i=0; i<Found.Num(); i++)
+		if ( (Found(i)->Guid == Build->Guid) && (Found(i)->Filename == Build->SrcFilename) && (Found(i)->ContainerFile == Build->ContainerFile) )
+		{
+			// Failed containers aren't retried
+			Found(i)->ContainerSize = Job->bWritten ? GFileManager->FileSize(*ContainerPath) : -1;
+			if ( Found(i)->ContainerSize > 0 )
+				return;
+			break;
+		}
 
+	if ( Job->bWritten )
+		GFileManager->Delete( *ContainerPath);
 
 	unguard;
 }
 
-
 //
 // Execute commands
 //
 UBOOL ULZMAServer::Exec( const TCHAR* Cmd, FOutputDevice& Ar)
 {
+	guard(ULZMAServer::Exec);
+
+	const TCHAR* Str = Cmd;
+	if ( ParseCommand(&Str,TEXT("LZMA")) )
+	{
+		if ( ParseCommand(&Str,TEXT("STATS")) )
+		{
+			INT MemorySources = 0;
+			int64 MemorySize = 0;
+			for ( INT i=0; i<Sources.Num(); i++)
+				if ( Sources(i)->GetMemorySize() > 0 )
+				{
+					MemorySources++;
+					MemorySize += (int64)Sources(i)->GetMemorySize();
+				}
+			Ar.Logf( TEXT("LZMA Server: %i sources, %i in memory (%i KB of %i MB)"), Sources.Num(), MemorySources, (INT)(MemorySize / 1024), MaxMemCacheMegs);
+			Ar.Logf( TEXT("Hits: %i memory, %i file, %i delta - Misses: %i - Evictions: %i"), MemoryHits, FileHits, DeltaHits, Misses, Evictions);
+			Ar.Logf( TEXT("Uploads: %i files to %i connections, %i KB sent - Rate limit: %i B/s, level weight %i")
+				, GFileSendSettings.ActiveChannels, GFileSendSettings.ActiveConnections, (INT)(GFileSendSettings.TotalSent / 1024)
+				, GFileSendSettings.MaxBytesPerSecond, GFileSendSettings.LevelWeight);
+			if ( HttpServer )
+			{
+				INT Connections, Requests, KBSent;
+				HttpServer->GetStats( Connections, Requests, KBSent);
+				Ar.Logf( TEXT("HTTP: port %i, %i connections, %i requests, %i KB sent"), HttpServer->GetPort(), Connections, Requests, KBSent);
+			}
+			return 1;
+		}
+		// Runtime changes aren't saved to LzmaCache.ini
+		else if ( ParseCommand(&Str,TEXT("UPLOADRATE")) )
+		{
+			if ( *Str )
+				GFileSendSettings.MaxBytesPerSecond = MaxUploadRate = Max( appAtoi(Str), 0);
+			Ar.Logf( TEXT("LZMA Server: upload rate limit %i B/s (0=unlimited)"), MaxUploadRate);
+			return 1;
+		}
+		else if ( ParseCommand(&Str,TEXT("LEVELWEIGHT")) )
+		{
+			if ( *Str )
+				GFileSendSettings.LevelWeight = LevelUploadWeight = Clamp( appAtoi(Str), 1, 64);
+			Ar.Logf( TEXT("LZMA Server: level upload weight %i"), LevelUploadWeight);
+			return 1;
+		}
+	}
 	return 0;
+
+	unguard;
 }
 
 
@@ -812,42 +2908,140 @@ void ULZMAServer::Init()
 		LzmaCacheIni.SetInt( TEXT("Server"), TEXT("MaxFileCacheMegs"), MaxFileCacheMegs, LZMA_CACHE_INI);
 	if ( !LzmaCacheIni.GetInt( TEXT("Server"), TEXT("ForceSourceToFileMegs"), ForceSourceToFileMegs, LZMA_CACHE_INI) )
 		LzmaCacheIni.SetInt( TEXT("Server"), TEXT("ForceSourceToFileMegs"), ForceSourceToFileMegs, LZMA_CACHE_INI);
+	if ( !LzmaCacheIni.GetInt( TEXT("Server"), TEXT("MaxCompressionThreads"), MaxCompressionThreads, LZMA_CACHE_INI) )
+		LzmaCacheIni.SetInt( TEXT("Server"), TEXT("MaxCompressionThreads"), MaxCompressionThreads, LZMA_CACHE_INI);
+	MaxCompressionThreads = Clamp( MaxCompressionThreads, 1, 64);
+	if ( !LzmaCacheIni.GetInt( TEXT("Server"), TEXT("MultiBlockMinMegs"), MultiBlockMinMegs, LZMA_CACHE_INI) )
+		LzmaCacheIni.SetInt( TEXT("Server"), TEXT("MultiBlockMinMegs"), MultiBlockMinMegs, LZMA_CACHE_INI);
+	if ( !LzmaCacheIni.GetInt( TEXT("Server"), TEXT("MaxUploadRate"), MaxUploadRate, LZMA_CACHE_INI) )
+		LzmaCacheIni.SetInt( TEXT("Server"), TEXT("MaxUploadRate"), MaxUploadRate, LZMA_CACHE_INI);
+	if ( !LzmaCacheIni.GetInt( TEXT("Server"), TEXT("LevelUploadWeight"), LevelUploadWeight, LZMA_CACHE_INI) )
+		LzmaCacheIni.SetInt( TEXT("Server"), TEXT("LevelUploadWeight"), LevelUploadWeight, LZMA_CACHE_INI);
+	if ( !LzmaCacheIni.GetInt( TEXT("Server"), TEXT("MaxDeltaBases"), MaxDeltaBases, LZMA_CACHE_INI) )
+		LzmaCacheIni.SetInt( TEXT("Server"), TEXT("MaxDeltaBases"), MaxDeltaBases, LZMA_CACHE_INI);
+	MaxDeltaBases = Max( MaxDeltaBases, 0);
+	if ( !LzmaCacheIni.GetInt( TEXT("Server"), TEXT("HttpPort"), HttpPort, LZMA_CACHE_INI) )
+		LzmaCacheIni.SetInt( TEXT("Server"), TEXT("HttpPort"), HttpPort, LZMA_CACHE_INI);
+	HttpPort = Clamp( HttpPort, 0, 65535);
+	if ( !LzmaCacheIni.GetInt( TEXT("Server"), TEXT("HttpMaxConnections"), HttpMaxConnections, LZMA_CACHE_INI) )
+		LzmaCacheIni.SetInt( TEXT("Server"), TEXT("HttpMaxConnections"), HttpMaxConnections, LZMA_CACHE_INI);
+	GFileSendSettings.MaxBytesPerSecond = MaxUploadRate     = Max( MaxUploadRate, 0);
+	GFileSendSettings.LevelWeight       = LevelUploadWeight = Clamp( LevelUploadWeight, 1, 64);
+	unguard;
+
+	// Compression settings
+	LzmaLogEncoder();
+	LzmaGetProfiles();
+
+	// Redirect server, serves whatever the sources have
+	guard(HttpServer);
+	if ( (HttpPort > 0) && !HttpServer )
+	{
+		FString Error;
+		HttpServer = new FHttpRedirectServer();
+		if ( HttpServer->Listen( HttpPort, HttpMaxConnections, Error) )
+			debugf( NAME_LZMAServer, TEXT("HTTP redirect server listening on port %i"), HttpServer->GetPort() );
+		else
+		{
+			GWarn->Logf( NAME_LZMAServer, TEXT("HTTP redirect server failed: %s"), *Error);
+			delete HttpServer;
+			HttpServer = nullptr;
+		}
+	}
+	unguard;
+
+	// Load cache descriptor, import legacy LzmaCache.ini entries if there's none
+	guard(LoadManifest);
+	if ( !Manifest )
+		Manifest = new FLZMACacheManifest( LZMA_CACHE_MANIFEST);
+	if ( !Manifest->Load() )
+	{
+		TMultiMap<FString,FString>* Section = LzmaCacheIni.GetSectionPrivate( TEXT("LzmaCache"), 0, 0, LZMA_CACHE_INI );
+		if ( Section )
+		{
+			for ( TMultiMap<FString,FString>::TIterator It(*Section); It; ++It)
+			{
+				// Legacy entries don't have a GUID, it will be filled in by UpdatePackageMap
+				FString CmpPath = FString(LZMA_CACHE_PATH) + It.Key();
+				FLZMACacheEntry Entry;
+				Entry.SourceFile = It.Value();
+				Entry.Guid       = FGuid(0,0,0,0);
+				Entry.CmpFile    = It.Key();
+				Entry.CmpSize    = GFileManager->FileSize(*CmpPath);
+				Entry.LastAccess = FLZMACacheManifest::Now() - (INT)GetFileAge(*CmpPath);
+				Entry.Hash       = 0;
+				FLZMACacheManifest::GetFileStamp( *Entry.SourceFile, Entry.SourceTime, Entry.SourceSize);
+				if ( (Entry.SourceSize >= 0) && (Entry.CmpSize > 0) && (GetFileAge(*CmpPath) <= GetFileAge(*Entry.SourceFile)) )
+					Manifest->Add( Entry);
+			}
+			LzmaCacheIni.EmptySection( TEXT("LzmaCache"), LZMA_CACHE_INI);
+			debugf( NAME_LZMAServer, TEXT("Imported %i entries from legacy cache descriptor"), Manifest->Num() );
+		}
+	}
 	unguard;
 
 	// Verify compressed files
 	// Delete if file entry not found in cache descriptor.
-	// Delete if source file not found in the game.
+	// Delete if source file not found in the game, or modified.
 	guard(VerifyFiles);
-	TMultiMap<FString,FString>* Section = LzmaCacheIni.GetSectionPrivate( TEXT("LzmaCache"), 1, 0, LZMA_CACHE_INI );
 	TArray<FString> Files = GFileManager->FindFiles( LZMA_CACHE_PATH TEXT("*.lzma"), true, false);
-	TMultiMap<FString,FString> SectionUpdate;
 	for ( TArray<FString>::TIterator It(Files); It; ++It)
 	{
-		FString* Value = Section->Find(*It);
-		if ( !Value )
+		INT i = Manifest->FindByCmpFile(**It);
+		if ( i == INDEX_NONE )
 			debugf( NAME_LZMAServer, TEXT("Purging unreferenced compressed cache file [%s]"), **It);
 		else
 		{
-			double SourceAge = GetFileAge(**Value);
-			if ( SourceAge == 0 )
-				debugf( NAME_LZMAServer, TEXT("Purging deleted compressed cache for %s [%s]"), **Value, **It);
-			else if ( GetFileAge(**It) > SourceAge )
-				debugf( NAME_LZMAServer, TEXT("Purging mismatching compressed cache for %s [%s]"), **Value, **It);
-			else
+			FLZMACacheEntry& Entry = Manifest->Entries(i);
+			INT SourceTime, SourceSize;
+			if ( !FLZMACacheManifest::GetFileStamp( *Entry.SourceFile, SourceTime, SourceSize) )
+				debugf( NAME_LZMAServer, TEXT("Purging deleted compressed cache for %s [%s]"), *Entry.SourceFile, **It);
+			else if ( (SourceTime == Entry.SourceTime) && (SourceSize == Entry.SourceSize) )
+				continue;
+			else if ( KeepDeltaBase(Entry) )
 			{
-				SectionUpdate.Set( **It, **Value);
+				Manifest->Remove(**It);
 				continue;
 			}
+			else
+				debugf( NAME_LZMAServer, TEXT("Purging mismatching compressed cache for %s [%s]"), *Entry.SourceFile, **It);
+			Manifest->Remove(**It);
 		}
 		FString Filename = FString::Printf( LZMA_CACHE_PATH TEXT("%s"), **It);
 		GFileManager->Delete(*Filename);
 	}
-	for ( TMultiMap<FString,FString>::TIterator It(*Section); It; ++It)
-		if ( !SectionUpdate.Find(It.Key()) )
+
+	// Interrupted delta builds
+	TArray<FString> DeltaTemp = GFileManager->FindFiles( LZMA_DELTA_PATH TEXT("*.tmp"), 1, 0);
+	for ( INT i=0; i<DeltaTemp.Num(); i++)
+		GFileManager->Delete( *(FString(LZMA_DELTA_PATH) + DeltaTemp(i)) );
+
+	// Entries without a file (removal may compact the entry list)
+	TArray<FString> Missing;
+	for ( INT i=0; i<Manifest->Entries.Num(); i++)
+	{
+		FLZMACacheEntry& Entry = Manifest->Entries(i);
+		if ( Entry.CmpFile.Len() && (Files.FindItemIndex(Entry.CmpFile) == INDEX_NONE) )
+		{
+			debugf( NAME_LZMAServer, TEXT("Purging deleted cache source for %s [%s]"), *Entry.SourceFile, *Entry.CmpFile);
+			new(Missing) FString(Entry.CmpFile);
+		}
+	}
+	for ( INT i=0; i<Missing.Num(); i++)
+		Manifest->Remove( *Missing(i) );
+	Manifest->Save();
+
+	// Multi-block containers go along with their compressed file
+	TArray<FString> Containers = GFileManager->FindFiles( LZMA_CACHE_PATH TEXT("*.xcb"), true, false);
+	for ( TArray<FString>::TIterator It(Containers); It; ++It)
+	{
+		FString CmpFile = It->Left(It->Len()-4) + COMPRESSED_EXTENSION;
+		if ( Manifest->FindByCmpFile(*CmpFile) == INDEX_NONE )
 		{
-			debugf( NAME_LZMAServer, TEXT("Purging delete cache source for %s [%s]"), *It.Key(), *It.Value() );
-			It.RemoveCurrent();
+			debugf( NAME_LZMAServer, TEXT("Purging unreferenced container file [%s]"), **It);
+			GFileManager->Delete( *(FString(LZMA_CACHE_PATH) + *It) );
 		}
+	}
 	unguard;
 
 	unguard;
@@ -874,9 +3068,7 @@ void ULZMAServer::UpdatePackageMap( UPackageMap* NewPackageMap)
 	// Enumerate existing packages to be pushed
 	if ( NewPackageMap )
 	{
-		FConfigCacheIni LzmaCacheIni;
-		TMultiMap<FString,FString>* Section = LzmaCacheIni.GetSectionPrivate( TEXT("LzmaCache"), 1, 0, LZMA_CACHE_INI );
-
+		INT Now = FLZMACacheManifest::Now();
 		bool bCanCompress = GetHandles();
 		for ( TArray<FPackageInfo>::TIterator It(NewPackageMap->List); It; ++It)
 			if ( !IsDefaultPackage(*It->Linker->Filename) && (It->PackageFlags & PKG_AllowDownload) )
@@ -892,14 +3084,36 @@ void ULZMAServer::UpdatePackageMap( UPackageMap* NewPackageMap)
 						Source = new FLZMASourceFile(*It,*OldVerSource);
 
 					// Locate in LZMA cache
-					if ( Section && !Source )
+					if ( Manifest && !Source )
 					{
-						for ( TMultiMap<FString,FString>::TIterator CIt(*Section); CIt; ++CIt)
-							if ( CIt.Value() == *It->Linker->Filename )
+						INT i = Manifest->FindBySource(*It->Linker->Filename);
+						if ( i != INDEX_NONE )
+						{
+							FLZMACacheEntry& Entry = Manifest->Entries(i);
+							INT SourceTime, SourceSize;
+							FLZMACacheManifest::GetFileStamp( *Entry.SourceFile, SourceTime, SourceSize);
+							if ( (SourceTime == Entry.SourceTime) && (SourceSize == Entry.SourceSize) )
 							{
-								Source = new FLZMASourceFile(*It,*CIt.Key());
-								break;
+								if ( Entry.Guid == FGuid(0,0,0,0) )
+								{
+									// Imported legacy entry
+									FLZMACacheEntry Update = Entry;
+									Update.Guid = It->Guid;
+									Update.LastAccess = Now;
+									Manifest->Add( Update);
+									Source = new FLZMASourceFile(*It,*Update.CmpFile);
+								}
+								else if ( Entry.Guid == It->Guid )
+								{
+									Source = new FLZMASourceFile(*It,*Entry.CmpFile);
+									Source->Hash = Entry.Hash;
+									Manifest->Touch( i, Now);
+								}
 							}
+							// Package replaced while running
+							else if ( (Entry.Guid != It->Guid) && KeepDeltaBase(Entry) )
+								Manifest->Remove( *FString(Entry.CmpFile) );
+						}
 					}
 
 					// If no existing source was found, queue for compression
@@ -908,13 +3122,30 @@ void ULZMAServer::UpdatePackageMap( UPackageMap* NewPackageMap)
 
 					// Add source if existing
 					if ( Source )
-						Sources.AddItem(Source);
+						AddSource(Source);
 				}
 				if ( Source )
+				{
 					Source->Priority = It.GetIndex() == 0 ? 10 : 0; //Level goes first
+
+					// Attach existing multi-block container
+					if ( !Source->ContainerFile.Len() )
+					{
+						FString ContainerFile = GetContainerFilename( Source->GetCompressedFile() );
+						INT ContainerSize = ContainerFile.Len() ? GFileManager->FileSize(*(FString(LZMA_CACHE_PATH)+ContainerFile)) : -1;
+						if ( ContainerSize > 0 )
+						{
+							Source->ContainerFile = ContainerFile;
+							Source->ContainerSize = ContainerSize;
+						}
+					}
+				}
 			}
 	}
 
+	// Fresh GUID index for the new map
+	RebuildSourceMap();
+
 	unguard;
 }
 
@@ -939,37 +3170,45 @@ void ULZMAServer::RelocateSources( UBOOL bCleanupDisk)
 {
 	guard(ULZMAServer::RelocateSources);
 
-	// Select largest in-memory source
-	int32 MaxSize   = -1;
-	int32 MaxSelect = INDEX_NONE;
-	int32 TotalSize = 0;
+	// Memory cache policy: least recently served sources are moved to disk first
+	// Sources still being written to disk are on their way out, they don't count
+	// against the budget or each frame would pick another one until the spill ends
+	int64 TotalSize = 0;
+	int64 InFlight = 0;
 	for ( int32 i=0; i<Sources.Num(); i++)
 	{
-		int32 Size = Sources(i)->GetMemorySize();
-		if ( Size > 0 )
-		{
-			TotalSize += Size;
-			if ( Size > MaxSize )
-			{
-				MaxSize = Size;
-				MaxSelect = i;
-			}
-		}
+		int64 Size = (int64)Sources(i)->GetMemorySize();
+		TotalSize += Size;
+		if ( Spilling.FindItemIndex(Sources(i)) != INDEX_NONE )
+			InFlight += Size;
 	}
-	TotalSize /= (1024*1024);
 
-	// Push it to disk if available and over the limit
-	if ( (TotalSize > MaxMemCacheMegs) && (MaxSelect != INDEX_NONE) && (Sources(MaxSelect)->ActiveRequests == 0) )
+	int64 MaxSize = (int64)MaxMemCacheMegs * (1024 * 1024);
+	while ( TotalSize - InFlight > MaxSize )
 	{
-		FLZMASourceFile* SourceFile = new FLZMASourceFile( *Sources(MaxSelect), Sources(MaxSelect)->GetMemory() );
-		if ( SourceFile->State == CS_STATE_Ready )
+		// Sources being served stay in memory
+		int32 Select = INDEX_NONE;
+		for ( int32 i=0; i<Sources.Num(); i++)
 		{
-			AddFileCacheEntry( *SourceFile->CmpFilename, *SourceFile->Filename);
-			if ( !Silent )
-				debugf( NAME_LZMAServer, TEXT("Pushing cache to file [%s] -> [%s]"), *SourceFile->Filename, *SourceFile->CmpFilename);
-			delete Sources(MaxSelect);
-			Sources(MaxSelect) = SourceFile;
+			FLZMASourceBase* Source = Sources(i);
+			if ( (Source->GetMemorySize() > 0) && (Source->ActiveRequests() == 0) && !Source->bSpillFailed && (Spilling.FindItemIndex(Source) == INDEX_NONE) )
+			{
+				if ( (Select == INDEX_NONE)
+					|| (Source->LastServed < Sources(Select)->LastServed)
+					|| ((Source->LastServed == Sources(Select)->LastServed) && (Source->GetMemorySize() > Sources(Select)->GetMemorySize())) )
+					Select = i;
+			}
 		}
+		if ( Select == INDEX_NONE )
+			break;
+
+		// Push it to disk
+		if ( !Silent )
+			debugf( NAME_LZMAServer, TEXT("Pushing cache to file [%s]"), *Sources(Select)->Filename);
+		FLZMASourceBase* Source = Sources(Select);
+		QueueSpill( Select, 1);
+		if ( Spilling.FindItemIndex(Source) != INDEX_NONE )
+			InFlight += (int64)Source->GetMemorySize();
 	}
 
 	// Limit disk size cache
@@ -986,34 +3225,36 @@ void ULZMAServer::RelocateSources( UBOOL bCleanupDisk)
 
 		// Enumerate all cache sources
 		int64 TotalSize = 0;
-		TArray<FString> CacheFiles = GFileManager->FindFiles( LZMA_CACHE_PATH TEXT("*.lzma"), true, false);
+		INT Now = FLZMACacheManifest::Now();
 		TArray<FLZMAFileCacheInfo> CacheInfo;
-		CacheInfo.AddZeroed(CacheFiles.Num());
-		for ( int32 i=0; i<CacheFiles.Num(); i++)
-		{
-			FLZMAFileCacheInfo& Info = CacheInfo(i);
-			Info.Filename = FString::Printf( LZMA_CACHE_PATH TEXT("%s"), *CacheFiles(i));
-			Info.Age      = GetFileAge(*Info.Filename);
-			Info.Size     = GFileManager->FileSize(*Info.Filename);
-			Info.Locked   = LockedSources.FindItemIndex(CacheFiles(i)) != INDEX_NONE;
+		for ( int32 i=0; Manifest && i<Manifest->Entries.Num(); i++)
+		{
+			FLZMACacheEntry& Entry = Manifest->Entries(i);
+			if ( !Entry.CmpFile.Len() )
+				continue;
+			FLZMAFileCacheInfo& Info = CacheInfo(CacheInfo.AddZeroed());
+			Info.Filename = Entry.CmpFile;
+			Info.Age      = (double)(Now - Entry.LastAccess);
+			Info.Size     = Entry.CmpSize;
+			Info.Locked   = LockedSources.FindItemIndex(Entry.CmpFile) != INDEX_NONE;
 			TotalSize += (int64)Info.Size;
 		}
 
-		// Sort by age and delete oldest if over the limit
+		// Sort by last access and delete oldest if over the limit
 		int64 MaxSize = (int64)MaxFileCacheMegs * (1024 * 1024);
 		if ( TotalSize >= MaxSize )
 		{
-			FConfigCacheIni LzmaCacheIni;
-			TMultiMap<FString,FString>* Section = LzmaCacheIni.GetSectionPrivate( TEXT("LzmaCache"), 1, 0, LZMA_CACHE_INI );
-
 			Sort(CacheInfo);
 			INT Purged = 0;
-			for ( INT i=CacheInfo.Num()-1; i>=0 && TotalSize>=MaxSize; i--)
+			for ( INT i=0; i<CacheInfo.Num() && TotalSize>=MaxSize; i++)
 			{
 				FLZMAFileCacheInfo& Info = CacheInfo(i);
-				if ( !Info.Locked && GFileManager->Delete(*Info.Filename) )
+				if ( !Info.Locked && GFileManager->Delete( *(FString(LZMA_CACHE_PATH)+Info.Filename) ) )
 				{
-					Section->Remove( *Info.Filename + _len(LZMA_CACHE_PATH));
+					FString ContainerFile = GetContainerFilename( Info.Filename);
+					if ( ContainerFile.Len() )
+						GFileManager->Delete( *(FString(LZMA_CACHE_PATH)+ContainerFile) );
+					Manifest->Remove( *Info.Filename);
 					TotalSize -= (int64)Info.Size;
 					Purged++;
 				}
@@ -1029,14 +3270,22 @@ void ULZMAServer::RelocateSources( UBOOL bCleanupDisk)
 //
 // Registers a file to cache entry
 //
-void ULZMAServer::AddFileCacheEntry(const TCHAR* CmpFilename, const TCHAR* SrcFilename)
+void ULZMAServer::AddFileCacheEntry( const TCHAR* CmpFilename, const TCHAR* SrcFilename, const FGuid& Guid, DWORD Hash)
 {
 	guard(ULZMAServer::AddFileCacheEntry);
 
-	FConfigCacheIni LzmaCacheIni;
-	TMultiMap<FString,FString>* Section = LzmaCacheIni.GetSectionPrivate( TEXT("LzmaCache"), 1, 0, LZMA_CACHE_INI );
-	if ( Section )
-		Section->Set( CmpFilename, SrcFilename);
+	if ( !Manifest )
+		return;
+
+	FLZMACacheEntry Entry;
+	Entry.SourceFile = SrcFilename;
+	Entry.Guid       = Guid;
+	Entry.CmpFile    = CmpFilename;
+	Entry.CmpSize    = GFileManager->FileSize( *(FString(LZMA_CACHE_PATH)+CmpFilename) );
+	Entry.LastAccess = FLZMACacheManifest::Now();
+	Entry.Hash       = Hash;
+	FLZMACacheManifest::GetFileStamp( SrcFilename, Entry.SourceTime, Entry.SourceSize);
+	Manifest->Add( Entry);
 
 	unguard;
 }
@@ -1047,12 +3296,285 @@ void ULZMAServer::AddFileCacheEntry(const TCHAR* CmpFilename, const TCHAR* SrcFi
 //
 FLZMASourceBase* ULZMAServer::GetSource( const FPackageInfo& Info)
 {
-	for ( int32 i=0; i<Sources.Num(); i++)
-		if ( (Sources(i)->Guid == Info.Guid) && (Sources(i)->Filename == Info.Linker->Filename) )
-			return Sources(i);
+	TArray<FLZMASourceBase*> Found;
+	SourceMap.MultiFind( GetGuidHash(Info.Guid), Found);
+	for ( int32 i=0; i<Found.Num(); i++)
+		if ( (Found(i)->Guid == Info.Guid) && (Found(i)->Filename == Info.Linker->Filename) )
+			return Found(i);
 	return nullptr;
 }
 
+//
+// A file channel requested this source
+//
+void ULZMAServer::NotifyServed( FLZMASourceBase* Source, UBOOL bReady)
+{
+	Source->LastServed = appSeconds();
+	if ( !bReady )
+		Misses++;
+	else
+	{
+		Source->Hits++;
+		if ( Source->GetMemorySize() > 0 )
+			MemoryHits++;
+		else
+			FileHits++;
+	}
+}
+
+//
+// Keep the compressed file of a package that changed, it becomes a delta base
+// Deltas to the version it was replaced with are gone along with the oldest bases.
+//
+UBOOL ULZMAServer::KeepDeltaBase( const FLZMACacheEntry& Entry)
+{
+	guard(ULZMAServer::KeepDeltaBase);
+
+	if ( (MaxDeltaBases <= 0) || (Entry.Guid == FGuid(0,0,0,0)) || !Entry.CmpFile.Len() )
+		return 0;
+
+	FString Name = GetDeltaPackageName( *Entry.SourceFile);
+	FString BaseFile = GetDeltaBaseFilename( Name, Entry.Guid);
+	GFileManager->MakeDirectory( LZMA_DELTA_PATH);
+	if ( !GFileManager->Move( *BaseFile, *(FString(LZMA_CACHE_PATH)+Entry.CmpFile), 1) )
+		return 0;
+
+	FString Prefix = Name + TEXT(".");
+	TArray<FString> Deltas = GFileManager->FindFiles( LZMA_DELTA_PATH TEXT("*") DELTA_EXTENSION, 1, 0);
+	for ( INT i=0; i<Deltas.Num(); i++)
+		if ( Deltas(i).Left(Prefix.Len()) == Prefix )
+			GFileManager->Delete( *(FString(LZMA_DELTA_PATH) + Deltas(i)) );
+
+	TArray<FLZMAFileCacheInfo> Bases;
+	TArray<FString> Files = GFileManager->FindFiles( LZMA_DELTA_PATH TEXT("*") COMPRESSED_EXTENSION, 1, 0);
+	for ( INT i=0; i<Files.Num(); i++)
+		if ( Files(i).Left(Prefix.Len()) == Prefix )
+		{
+			FLZMAFileCacheInfo& Info = Bases(Bases.AddZeroed());
+			Info.Filename = FString(LZMA_DELTA_PATH) + Files(i);
+			Info.Age      = GetFileAge( *Info.Filename);
+		}
+	Sort( Bases); //Oldest first
+	for ( INT i=0; i<Bases.Num()-MaxDeltaBases; i++)
+		GFileManager->Delete( *Bases(i).Filename);
+
+	if ( !Silent )
+		debugf( NAME_LZMAServer, TEXT("Keeping previous version of %s for deltas"), *Entry.SourceFile);
+	return 1;
+
+	unguard;
+}
+
+//
+// Delta from a version the client has, built on first request
+//
+INT ULZMAServer::GetDelta( const FPackageInfo& Info, const FGuid& BaseGuid, FArchive*& Reader)
+{
+	guard(ULZMAServer::GetDelta);
+
+	Reader = nullptr;
+	if ( (MaxDeltaBases <= 0) || !Info.Linker || (BaseGuid == Info.Guid) || (BaseGuid == FGuid(0,0,0,0)) )
+		return DELTA_None;
+
+	FString Name = GetDeltaPackageName( *Info.Linker->Filename);
+	FString DeltaFile = GetDeltaFilename( Name, BaseGuid, Info.Guid);
+	if ( DeltaPending.FindItemIndex(DeltaFile) != INDEX_NONE )
+		return DELTA_Pending;
+	if ( DeltaFailed.Find(DeltaFile) )
+		return DELTA_None;
+	if ( GFileManager->FileSize(*DeltaFile) > 0 )
+	{
+		Reader = GFileManager->CreateFileReader( *DeltaFile);
+		if ( !Reader )
+			return DELTA_None;
+		DeltaHits++;
+		return DELTA_Ready;
+	}
+
+	FString BaseFile = GetDeltaBaseFilename( Name, BaseGuid);
+	if ( (GFileManager->FileSize(*BaseFile) <= 0) || !GetHandles() )
+		return DELTA_None;
+
+	// Only worth sending if smaller than the compressed package
+	FLZMASourceBase* Source = GetSource( Info);
+	INT MaxSize = (Source && Source->CompressedSize) ? Source->CompressedSize : Info.FileSize / 2;
+	if ( !DeltaCompressor )
+		DeltaCompressor = new FAsyncJobQueue( 1);
+	DeltaCompressor->Add( new FLZMADeltaJob( *BaseFile, *Info.Linker->Filename, *DeltaFile, BaseGuid, MaxSize, LzmaGetParams(*Info.Linker->Filename,Info.FileSize)) );
+	new(DeltaPending) FString(DeltaFile);
+	if ( !Silent )
+		debugf( NAME_LZMAServer, TEXT("Building delta for %s from %s"), *Info.Linker->Filename, *BaseGuid.String() );
+	return DELTA_Pending;
+
+	unguard;
+}
+
+void ULZMAServer::FinishDelta( FLZMADeltaJob* Job)
+{
+	guard(ULZMAServer::FinishDelta);
+
+	DeltaPending.RemoveItem( Job->DeltaFile);
+	if ( Job->Error[0] )
+		GWarn->Log( NAME_LZMAServer, Job->Error);
+	if ( Job->DeltaSize > 0 )
+	{
+		if ( !Silent )
+			debugf( NAME_LZMAServer, TEXT("Delta %s: %iK"), *Job->DeltaFile, Job->DeltaSize / 1024);
+	}
+	else if ( !Job->Cancelled )
+	{
+		if ( DeltaFailed.Num() >= LZMA_DELTA_MAX_FAILED )
+			DeltaFailed.Empty();
+		DeltaFailed.Set( *Job->DeltaFile, 1);
+	}
+
+	unguard;
+}
+
+//
+// Inverse of FGuid::String
+//
+static UBOOL ParseGuid( const FString& Str, FGuid& Guid)
+{
+	if ( Str.Len() != 32 )
+		return 0;
+	DWORD Parts[4] = {0,0,0,0};
+	for ( INT i=0; i<32; i++)
+	{
+		TCHAR C = (*Str)[i];
+		DWORD Digit;
+		if ( C >= '0' && C <= '9' )
+			Digit = C - '0';
+		else if ( C >= 'A' && C <= 'F' )
+			Digit = C - 'A' + 10;
+		else if ( C >= 'a' && C <= 'f' )
+			Digit = C - 'a' + 10;
+		else
+			return 0;
+		Parts[i/8] = (Parts[i/8] << 4) | Digit;
+	}
+	Guid = FGuid( Parts[0], Parts[1], Parts[2], Parts[3]);
+	return 1;
+}
+
+//
+// Find a cached file by package filename or GUID, followed by .lzma or .uz
+// Files still being compressed are pending, the caller should ask again later.
+//
+INT ULZMAServer::ExportSource( const TCHAR* Name, FLZMAExport& Export)
+{
+	guard(ULZMAServer::ExportSource);
+
+	FString Base = Name;
+	UBOOL bWantUZ;
+	if ( Base.Right(5) == COMPRESSED_EXTENSION )
+		bWantUZ = 0;
+	else if ( Base.Right(3) == TEXT(".uz") )
+		bWantUZ = 1;
+	else
+		return LZMAEXPORT_NotFound;
+	Base = Base.LeftChop( bWantUZ ? 3 : 5);
+
+	TArray<FLZMASourceBase*> Found;
+	SourceNameMap.MultiFind( Base, Found);
+	FGuid Guid;
+	if ( ParseGuid( Base, Guid) )
+	{
+		TArray<FLZMASourceBase*> FoundGuid;
+		SourceMap.MultiFind( GetGuidHash(Guid), FoundGuid);
+		for ( INT i=0; i<FoundGuid.Num(); i++)
+			if ( FoundGuid(i)->Guid == Guid )
+				Found.AddUniqueItem( FoundGuid(i) );
+	}
+
+	UBOOL bPending = 0;
+	for ( INT i=0; i<Found.Num(); i++)
+	{
+		FLZMASourceBase* Source = Found(i);
+		if ( Source->Priority < 0 )
+			continue;
+
+		if ( Source->State != CS_STATE_Ready )
+		{
+			bPending |= (Source->State != CS_STATE_NoSource);
+			continue;
+		}
+
+		// Memory sources are always LZMA, old XC_Engine files can be either
+		FString CmpFile = Source->GetCompressedFile();
+		if ( (CmpFile.Right(3) == TEXT(".uz")) != bWantUZ )
+			continue;
+
+		Export.Release();
+		FLZMASharedData* Shared = Source->GetSharedData();
+		if ( Shared )
+		{
+			Shared->AddRef();
+			Export.Shared = Shared;
+			Export.Data   = Shared->Data;
+			Export.Size   = Shared->Size;
+		}
+		else if ( CmpFile.Len() )
+		{
+			Export.Filename = FString(LZMA_CACHE_PATH) + CmpFile;
+			Export.Size     = Source->CompressedSize;
+		}
+		else
+			continue;
+		NotifyServed( Source, 1);
+		return LZMAEXPORT_Ready;
+	}
+	return bPending ? LZMAEXPORT_Pending : LZMAEXPORT_NotFound;
+
+	unguard;
+}
+
+//
+// Source list modifiers
+//
+static FString GetSourceName( const FLZMASourceBase* Source)
+{
+	INT Separator = Max( Source->Filename.InStr(TEXT("/"),1), Source->Filename.InStr(TEXT("\\"),1) );
+	return Source->Filename.Mid(Separator+1);
+}
+
+void ULZMAServer::AddSource( FLZMASourceBase* Source)
+{
+	Sources.AddItem( Source);
+	SourceMap.Add( GetGuidHash(Source->Guid), Source);
+	SourceNameMap.Add( GetSourceName(Source), Source);
+}
+
+void ULZMAServer::ReplaceSource( INT i, FLZMASourceBase* NewSource)
+{
+	SourceMap.RemovePair( GetGuidHash(Sources(i)->Guid), Sources(i));
+	SourceNameMap.RemovePair( GetSourceName(Sources(i)), Sources(i));
+	delete Sources(i);
+	Sources(i) = NewSource;
+	SourceMap.Add( GetGuidHash(NewSource->Guid), NewSource);
+	SourceNameMap.Add( GetSourceName(NewSource), NewSource);
+}
+
+void ULZMAServer::RemoveSource( INT i)
+{
+	Spilling.RemoveItem( Sources(i));
+	SourceMap.RemovePair( GetGuidHash(Sources(i)->Guid), Sources(i));
+	SourceNameMap.RemovePair( GetSourceName(Sources(i)), Sources(i));
+	delete Sources(i);
+	Sources.Remove(i);
+}
+
+void ULZMAServer::RebuildSourceMap()
+{
+	SourceMap.Empty();
+	SourceNameMap.Empty();
+	for ( INT i=0; i<Sources.Num(); i++)
+	{
+		SourceMap.Add( GetGuidHash(Sources(i)->Guid), Sources(i));
+		SourceNameMap.Add( GetSourceName(Sources(i)), Sources(i));
+	}
+}
+
 IMPLEMENT_CLASS(ULZMAServer);
 
 /*-----------------------------------------------------------------------------
@@ -1061,6 +3583,11 @@ IMPLEMENT_CLASS(ULZMAServer);
 
 
 XC_CORE_API UBOOL LzmaCompress( const TCHAR* Src, const TCHAR* Dest, TCHAR* Error)
+{
+	return LzmaCompress( Src, Dest, Error, LzmaGetParams(Src,GFileManager->FileSize(Src)) );
+}
+
+XC_CORE_API UBOOL LzmaCompress( const TCHAR* Src, const TCHAR* Dest, TCHAR* Error, const FLZMAParams& Params)
 {
 	Error[0] = '\0';
 	UBOOL Result = 0;
@@ -1071,22 +3598,16 @@ XC_CORE_API UBOOL LzmaCompress( const TCHAR* Src, const TCHAR* Dest, TCHAR* Erro
 	{
 		if ( SrcFile->TotalSize() > 0 )
 		{
-			void*  CompressedData;
-			size_t CompressedSize;
-			LzmaCompress( SrcFile, CompressedData, CompressedSize, Error); // Prints to error
-			if ( CompressedData )
+			FArchive* DestFile = GFileManager->CreateFileWriter( Dest, 0);
+			if ( DestFile )
 			{
-				FArchive* DestFile = GFileManager->CreateFileWriter( Dest, 0);
-				if ( DestFile )
-				{
-					DestFile->Serialize( CompressedData, (int32)CompressedSize);
-					Result = !DestFile->GetError();
-					DestFile->Close();
-					delete DestFile;
-				}
-				else appSprintf( Error, TEXT("Unable to create destination file %s."), Dest);
-				free(CompressedData);
+				Result = LzmaCompress( SrcFile, DestFile, Error, Params) > 0; // Prints to error
+				Result = DestFile->Close() && Result;
+				delete DestFile;
+				if ( !Result )
+					GFileManager->Delete( Dest);
 			}
+			else appSprintf( Error, TEXT("Unable to create destination file %s."), Dest);
 		}
 		else appSprintf( Error, TEXT("Empty file %s"), Src);
 		delete SrcFile;
@@ -1124,6 +3645,42 @@ XC_CORE_API UBOOL LzmaDecompress( FArchive* SrcFile, const TCHAR* Dest, TCHAR* E
 		SrcFile->Serialize( &header, LZMA_PROPS_SIZE + 8);
 		QWORD unpackSize = *(QWORD*) &header[LZMA_PROPS_SIZE];
 
+		//Decode in blocks straight into the destination file
+		if ( FLZMADecoder::IsAvailable() )
+		{
+			FLZMADecoder Decoder;
+			if ( !Decoder.Init( header, Error) )
+				return 0;
+			FArchive* DestFile = GFileManager->CreateFileWriter( Dest, FILEWRITE_EvenIfReadOnly);
+			if ( !DestFile )
+				lzPrintErrorD( TEXT("LzmaDecompress: Unable to create destination file %s."), Dest);
+
+			TArray<BYTE> Buffer( LZMA_DECODE_BLOCK);
+			INT Remaining = SrcFile->TotalSize() - SrcFile->Tell();
+			UBOOL Result = 1;
+			while ( Result && (Remaining > 0) && !Decoder.IsFinished() )
+			{
+				INT Count = Min<INT>( Remaining, Buffer.Num());
+				SrcFile->Serialize( &Buffer(0), Count);
+				Remaining -= Count;
+				Result = !SrcFile->IsError() && Decoder.Decode( &Buffer(0), Count, *DestFile, Error);
+			}
+			if ( Result && !Decoder.IsFinished() )
+			{
+				appSprintf( Error, TEXT("LzmaDecompress: %s."), TranslateLzmaError(6) );
+				Result = 0;
+			}
+			Result = DestFile->Close() && Result;
+			delete DestFile;
+			if ( !Result )
+			{
+				if ( !Error[0] )
+					appStrcpy( Error, TEXT("LzmaDecompress: Unable to write decompressed data."));
+				GFileManager->Delete( Dest);
+			}
+			return Result;
+		}
+
 		//Allocate memory and fill it with the source file's contents
 		INT SrcSize = SrcFile->TotalSize() - SrcFile->Tell();
 		TArray<ANSICHAR> SrcData( SrcSize);
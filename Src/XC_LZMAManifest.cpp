@@ -0,0 +1,334 @@
+/*=============================================================================
+	XC_LZMAManifest.cpp:
+	Binary descriptor of the LZMA file cache.
+
+	Layout:
+	- Header: magic, version.
+	- Records: BYTE Op, INT Size, DWORD Crc, Size bytes of payload.
+	  New fields go at the end of a payload so older records still load.
+
+	Records are appended as the cache changes, Save() compacts the manifest
+	into a temporary file that replaces the old one.
+	A torn or corrupt record ends the load, everything after it is dropped.
+=============================================================================*/
+
+#include "time.h"
+
+#include "XC_Core.h"
+#include "UnLinker.h"
+#include "XC_LZMA.h"
+
+#if __UNIX__
+	#include "sys/types.h"
+	#include "sys/stat.h"
+#endif
+
+#define MANIFEST_MAGIC   0x434C4358 //XCLC
+#define MANIFEST_VERSION 1
+#define MANIFEST_RECORD_HEADER (sizeof(BYTE)+sizeof(INT)+sizeof(DWORD))
+
+enum EManifestRecord
+{
+	MANIFEST_Add    = 1,
+	MANIFEST_Remove = 2,
+	MANIFEST_Touch  = 3,
+};
+
+FArchive& operator<<( FArchive& Ar, FLZMACacheEntry& Entry)
+{
+	Ar << Entry.SourceFile << Entry.SourceTime << Entry.SourceSize << Entry.Guid
+	   << Entry.CmpFile << Entry.CmpSize << Entry.LastAccess;
+
+	// Appended later, records written by older versions end before it
+	if ( !Ar.IsLoading() || !Ar.AtEnd() )
+		Ar << Entry.Hash;
+	else
+		Entry.Hash = 0;
+	return Ar;
+}
+
+/*-----------------------------------------------------------------------------
+	FLZMACacheManifest.
+-----------------------------------------------------------------------------*/
+
+FLZMACacheManifest::FLZMACacheManifest( const TCHAR* InFilename)
+	: Filename(InFilename)
+	, Appended(0)
+{}
+
+//
+// Replay manifest file
+// Replacing a file isn't atomic on Windows (target is deleted first), if the
+// manifest is gone or unreadable the compacted copy Save() left behind is used.
+//
+UBOOL FLZMACacheManifest::Load()
+{
+	guard(FLZMACacheManifest::Load);
+
+	if ( LoadFile( *Filename) )
+		return 1;
+
+	FString TempFilename = Filename + TEXT(".tmp");
+	if ( !LoadFile( *TempFilename) )
+		return 0;
+	debugf( NAME_Init, TEXT("LZMA cache manifest recovered from %s"), *TempFilename);
+	GFileManager->Move( *Filename, *TempFilename, 1);
+	return 1;
+
+	unguard;
+}
+
+UBOOL FLZMACacheManifest::LoadFile( const TCHAR* InFilename)
+{
+	guard(FLZMACacheManifest::LoadFile);
+
+	Empty();
+
+	TArray<BYTE> Data;
+	if ( !appLoadFileToArray( Data, InFilename) || (Data.Num() < 8) )
+		return 0;
+
+	DWORD Magic;
+	INT   Version;
+	appMemcpy( &Magic, &Data(0), sizeof(Magic));
+	appMemcpy( &Version, &Data(4), sizeof(Version));
+	if ( (Magic != MANIFEST_MAGIC) || (Version != MANIFEST_VERSION) )
+		return 0;
+
+	INT Pos = 8;
+	while ( Pos + (INT)MANIFEST_RECORD_HEADER <= Data.Num() )
+	{
+		BYTE  Op = Data(Pos);
+		INT   Size;
+		DWORD Crc;
+		appMemcpy( &Size, &Data(Pos+1), sizeof(Size));
+		appMemcpy( &Crc, &Data(Pos+5), sizeof(Crc));
+		Pos += MANIFEST_RECORD_HEADER;
+		if ( (Size <= 0) || (Pos + Size > Data.Num()) || (appMemCrc(&Data(Pos),Size) != Crc) )
+			break;
+
+		TArray<BYTE> Payload( Size);
+		appMemcpy( &Payload(0), &Data(Pos), Size);
+		FBufferReader Reader( Payload);
+		if ( Op == MANIFEST_Add )
+		{
+			FLZMACacheEntry Entry;
+			Reader << Entry;
+			SetEntry( Entry);
+		}
+		else if ( Op == MANIFEST_Remove )
+		{
+			FString CmpFile;
+			Reader << CmpFile;
+			RemoveEntry( FindByCmpFile(*CmpFile) );
+		}
+		else if ( Op == MANIFEST_Touch )
+		{
+			FString CmpFile;
+			INT     LastAccess;
+			Reader << CmpFile << LastAccess;
+			INT i = FindByCmpFile(*CmpFile);
+			if ( i != INDEX_NONE )
+				Entries(i).LastAccess = LastAccess;
+		}
+		Pos += Size;
+		Appended++;
+	}
+	return 1;
+
+	unguard;
+}
+
+//
+// Compact and replace the manifest file through a temporary copy
+//
+UBOOL FLZMACacheManifest::Save()
+{
+	guard(FLZMACacheManifest::Save);
+
+	// Drop removed entries
+	TArray<FLZMACacheEntry> Live;
+	for ( INT i=0; i<Entries.Num(); i++)
+		if ( Entries(i).CmpFile.Len() )
+			Live.AddItem( Entries(i) );
+	Empty();
+	for ( INT i=0; i<Live.Num(); i++)
+		SetEntry( Live(i) );
+
+	FString TempFilename = Filename + TEXT(".tmp");
+	FArchive* Ar = GFileManager->CreateFileWriter( *TempFilename);
+	if ( !Ar )
+		return 0;
+
+	DWORD Magic   = MANIFEST_MAGIC;
+	INT   Version = MANIFEST_VERSION;
+	*Ar << Magic << Version;
+	for ( INT i=0; i<Entries.Num(); i++)
+	{
+		TArray<BYTE> Payload;
+		FBufferWriter Writer( Payload);
+		Writer << Entries(i);
+		WriteRecord( *Ar, MANIFEST_Add, Payload);
+	}
+	UBOOL Result = !Ar->IsError() && Ar->Close();
+	delete Ar;
+
+	if ( Result )
+		Result = GFileManager->Move( *Filename, *TempFilename, 1);
+	if ( !Result )
+		GFileManager->Delete( *TempFilename);
+	Appended = 0;
+	return Result;
+
+	unguard;
+}
+
+//
+// Add or replace the entry of a source file
+//
+void FLZMACacheManifest::Add( const FLZMACacheEntry& Entry)
+{
+	guard(FLZMACacheManifest::Add);
+	SetEntry( Entry);
+	TArray<BYTE> Payload;
+	FBufferWriter Writer( Payload);
+	Writer << (FLZMACacheEntry&)Entry;
+	AppendRecord( MANIFEST_Add, Payload);
+	unguard;
+}
+
+void FLZMACacheManifest::Remove( const TCHAR* CmpFile)
+{
+	guard(FLZMACacheManifest::Remove);
+	INT i = FindByCmpFile( CmpFile);
+	if ( i != INDEX_NONE )
+	{
+		RemoveEntry( i);
+		FString CmpFileStr = CmpFile;
+		TArray<BYTE> Payload;
+		FBufferWriter Writer( Payload);
+		Writer << CmpFileStr;
+		AppendRecord( MANIFEST_Remove, Payload);
+	}
+	unguard;
+}
+
+void FLZMACacheManifest::Touch( INT i, INT Time)
+{
+	guard(FLZMACacheManifest::Touch);
+	if ( Entries.IsValidIndex(i) && Entries(i).CmpFile.Len() && (Entries(i).LastAccess != Time) )
+	{
+		Entries(i).LastAccess = Time;
+		TArray<BYTE> Payload;
+		FBufferWriter Writer( Payload);
+		Writer << Entries(i).CmpFile << Time;
+		AppendRecord( MANIFEST_Touch, Payload);
+	}
+	unguard;
+}
+
+INT FLZMACacheManifest::FindBySource( const TCHAR* SourceFile)
+{
+	INT* i = SourceMap.Find( SourceFile);
+	return i ? *i : INDEX_NONE;
+}
+
+INT FLZMACacheManifest::FindByCmpFile( const TCHAR* CmpFile)
+{
+	INT* i = CmpMap.Find( CmpFile);
+	return i ? *i : INDEX_NONE;
+}
+
+INT FLZMACacheManifest::Num()
+{
+	return CmpMap.Num();
+}
+
+UBOOL FLZMACacheManifest::GetFileStamp( const TCHAR* Filename, INT& Time, INT& Size)
+{
+#if __UNIX__
+	struct stat Buf;
+	if( stat(appToAnsi(Filename),&Buf)==0 )
+#elif _WINDOWS
+	struct _stat Buf;
+	if( _wstat(Filename,&Buf)==0 )
+#endif
+	{
+		Time = (INT)Buf.st_mtime;
+		Size = (INT)Buf.st_size;
+		return 1;
+	}
+	Time = 0;
+	Size = -1;
+	return 0;
+}
+
+INT FLZMACacheManifest::Now()
+{
+	return (INT)time(NULL);
+}
+
+//
+// Internals
+//
+void FLZMACacheManifest::Empty()
+{
+	Entries.Empty();
+	SourceMap.Empty();
+	CmpMap.Empty();
+	Appended = 0;
+}
+
+INT FLZMACacheManifest::SetEntry( const FLZMACacheEntry& Entry)
+{
+	// One entry per source file and per compressed file
+	RemoveEntry( FindBySource(*Entry.SourceFile) );
+	RemoveEntry( FindByCmpFile(*Entry.CmpFile) );
+
+	INT i = Entries.AddZeroed();
+	Entries(i) = Entry;
+	SourceMap.Set( *Entry.SourceFile, i);
+	CmpMap.Set( *Entry.CmpFile, i);
+	return i;
+}
+
+void FLZMACacheManifest::RemoveEntry( INT i)
+{
+	if ( !Entries.IsValidIndex(i) || !Entries(i).CmpFile.Len() )
+		return;
+	FLZMACacheEntry& Entry = Entries(i);
+	SourceMap.Remove( *Entry.SourceFile);
+	CmpMap.Remove( *Entry.CmpFile);
+	Entry.CmpFile.Empty(); // Hole, dropped on next Save()
+}
+
+void FLZMACacheManifest::AppendRecord( BYTE Op, TArray<BYTE>& Payload)
+{
+	// No manifest on disk yet (or too many records), write a compacted one instead
+	if ( (GFileManager->FileSize(*Filename) <= 0) || (Appended > 64 + Num() * 2) )
+	{
+		Save();
+		return;
+	}
+
+	FArchive* Ar = GFileManager->CreateFileWriter( *Filename, FILEWRITE_Append);
+	if ( Ar )
+	{
+		WriteRecord( *Ar, Op, Payload);
+		Ar->Close();
+		delete Ar;
+		Appended++;
+	}
+}
+
+void FLZMACacheManifest::WriteRecord( FArchive& Ar, BYTE Op, TArray<BYTE>& Payload)
+{
+	INT   Size = Payload.Num();
+	DWORD Crc  = appMemCrc( &Payload(0), Size);
+	Ar << Op << Size << Crc;
+	Ar.Serialize( &Payload(0), Size);
+}
+
+/*-----------------------------------------------------------------------------
+	The End.
+-----------------------------------------------------------------------------*/
@@ -0,0 +1,536 @@
+/*=============================================================================
+	XC_LoadTest.cpp:
+	Load test of the file transfer path.
+
+	The server side is the real thing: UXC_FileChannel, the upload scheduler
+	and ULZMAServer, all ticked on this thread like a game server would.
+	Clients are UXC_ChannelDownloads on net drivers of their own, connected
+	through loopback connections that hand packets to the other end.
+	Received data is counted and discarded so any number of clients can
+	fetch the same packages.
+
+	This measures the server and the wire only. The client's decode, hash,
+	cache write and resume paths in UXC_Download::ReceiveData are not run:
+	they write to the shared cache and DownloadTemp folders, which
+	concurrent clients of the same package would collide on.
+=============================================================================*/
+
+#include "XC_Core.h"
+#include "Engine.h"
+#include "UnNet.h"
+#include "UnLinker.h"
+#include "XC_Download.h"
+#include "XC_LZMA.h"
+
+#if __UNIX__
+	#include "sys/resource.h"
+#elif _WINDOWS
+	#define PSAPI_VERSION 1
+	#include <Psapi.h>
+	#pragma comment (lib,"Psapi.lib")
+#endif
+
+struct FLoadTestClient;
+
+/*-----------------------------------------------------------------------------
+	Loopback network.
+-----------------------------------------------------------------------------*/
+
+//
+// Packets are queued on the receiving end: DOUBLE delivery time, INT size, data
+// Created inside their net driver, which destroys them along with itself.
+//
+class UXC_LoopbackConnection : public UNetConnection
+{
+	DECLARE_CLASS(UXC_LoopbackConnection,UNetConnection,CLASS_Transient|CLASS_Config,XC_Core);
+	NO_DEFAULT_CONSTRUCTOR(UXC_LoopbackConnection);
+
+	UXC_LoopbackConnection* Peer;
+	TArray<BYTE> Pending;
+	FLOAT Latency; //One way, seconds
+	INT Id;
+
+	UXC_LoopbackConnection( UNetDriver* InDriver, INT InId, INT InRate, FLOAT InLatency)
+		: UNetConnection( InDriver, FURL(NULL) )
+		, Peer(nullptr)
+		, Latency(InLatency)
+		, Id(InId)
+	{
+		MaxPacket         = 512;
+		PacketOverhead    = 28;
+		CurrentNetSpeed   = InRate;
+		State             = USOCK_Open;
+		LastReceiveTime   = Driver->Time;
+		InitOut();
+	}
+
+	// UObject interface
+	void Destroy()
+	{
+		if ( Peer )
+			Peer->Peer = nullptr;
+		Peer = nullptr;
+		Super::Destroy();
+	}
+
+	// UNetConnection interface
+	FString LowLevelGetRemoteAddress()
+	{
+		return FString::Printf( TEXT("loopback:%i"), Id);
+	}
+	FString LowLevelDescribe()
+	{
+		return FString::Printf( TEXT("Loopback client %i (%s side)"), Id, Driver->ServerConnection ? TEXT("client") : TEXT("server") );
+	}
+	void LowLevelSend( void* Data, INT Count)
+	{
+		if ( !Peer || (Count <= 0) )
+			return;
+		DOUBLE Time = appSeconds() + Latency;
+		INT i = Peer->Pending.Add( sizeof(DOUBLE) + sizeof(INT) + Count);
+		appMemcpy( &Peer->Pending(i), &Time, sizeof(DOUBLE));
+		appMemcpy( &Peer->Pending(i+sizeof(DOUBLE)), &Count, sizeof(INT));
+		appMemcpy( &Peer->Pending(i+sizeof(DOUBLE)+sizeof(INT)), Data, Count);
+	}
+
+	// Hand over everything that has arrived by now
+	void Deliver()
+	{
+		DOUBLE Now = appSeconds();
+		TArray<BYTE> Packet;
+		INT Pos = 0;
+		while ( (Pos < Pending.Num()) && (State != USOCK_Closed) )
+		{
+			DOUBLE Time;
+			INT Count;
+			appMemcpy( &Time, &Pending(Pos), sizeof(DOUBLE));
+			if ( Time > Now )
+				break;
+			appMemcpy( &Count, &Pending(Pos+sizeof(DOUBLE)), sizeof(INT));
+			Pos += sizeof(DOUBLE) + sizeof(INT);
+			// Receiving may queue more packets here through the peer, copy first
+			Packet.Empty( Count);
+			Packet.Add( Count);
+			appMemcpy( &Packet(0), &Pending(Pos), Count);
+			Pos += Count;
+			ReceivedRawPacket( &Packet(0), Count);
+		}
+		if ( Pos > 0 )
+			Pending.Remove( 0, Min( Pos, Pending.Num()) );
+	}
+};
+IMPLEMENT_CLASS(UXC_LoopbackConnection);
+
+class UXC_LoopbackDriver : public UNetDriver
+{
+	DECLARE_CLASS(UXC_LoopbackDriver,UNetDriver,CLASS_Transient|CLASS_Config,XC_Core);
+
+	UXC_LoopbackDriver()
+	{}
+
+	// UNetDriver interface
+	void TickDispatch( FLOAT DeltaTime)
+	{
+		Super::TickDispatch( DeltaTime);
+		if ( ServerConnection )
+			((UXC_LoopbackConnection*)ServerConnection)->Deliver();
+		for ( INT i=0; i<ClientConnections.Num(); i++)
+			((UXC_LoopbackConnection*)ClientConnections(i))->Deliver();
+	}
+	FString LowLevelGetNetworkNumber()
+	{
+		return TEXT("127.0.0.1");
+	}
+	void LowLevelDestroy()
+	{}
+};
+IMPLEMENT_CLASS(UXC_LoopbackDriver);
+
+//
+// Accepts everything, nothing to show
+//
+class FLoadTestNotify : public FNetworkNotify
+{
+public:
+	EAcceptConnection NotifyAcceptingConnection()                                                  { return ACCEPTC_Accept; }
+	void NotifyAcceptedConnection( UNetConnection* Connection)                                      {}
+	UBOOL NotifyAcceptingChannel( UChannel* Channel)                                                { return 1; }
+	ULevel* NotifyGetLevel()                                                                        { return nullptr; }
+	void NotifyReceivedText( UNetConnection* Connection, const TCHAR* Text)                         {}
+	UBOOL NotifySendingFile( UNetConnection* Connection, FGuid GUID)                                { return 1; }
+	void NotifyReceivedFile( UNetConnection* Connection, INT PackageIndex, const TCHAR* Error, UBOOL Skipped) {}
+	void NotifyProgress( const TCHAR* Str1, const TCHAR* Str2, FLOAT Seconds)                       {}
+};
+
+/*-----------------------------------------------------------------------------
+	Simulated clients.
+-----------------------------------------------------------------------------*/
+
+struct FLoadTestClient
+{
+	UXC_LoopbackDriver*     Driver;
+	UXC_LoopbackConnection* Connection;
+	class UXC_LoadTestDownload* Download;
+	INT    NextFile;
+	UBOOL  bFinished;
+	FTime  StartTime;
+	FTime  RequestTime;
+	FTime  FirstByteTime;
+	FTime  EndTime;
+	QWORD  Received;
+	INT    Files;
+	INT    Errors;
+	DOUBLE TotalFirstByte;
+	DOUBLE MaxFirstByte;
+};
+
+//
+// Takes the file channel protocol as is, throws the data away
+//
+class UXC_LoadTestDownload : public UXC_ChannelDownload
+{
+	DECLARE_CLASS(UXC_LoadTestDownload,UXC_ChannelDownload,CLASS_Transient|CLASS_Config,XC_Core);
+	NO_DEFAULT_CONSTRUCTOR(UXC_LoadTestDownload);
+
+	FLoadTestClient* Client;
+
+	// UDownload interface
+	void Tick()
+	{}
+	void ReceiveData( BYTE* Data, INT Count)
+	{
+		if ( (Transfered == 0) && !bCanResume && ((Count == XCDL_HEADER_SIZE) || (Count == XCDL_HEADER_HASH_SIZE)) && (((DWORD*)Data)[0] == XCDL_HEADER_MAGIC) )
+		{
+			bCanResume = 1;
+			return;
+		}
+		if ( (Transfered == 0) && (Count > 0) )
+			Client->FirstByteTime = appSeconds();
+		Transfered += Count;
+	}
+	void DownloadDone()
+	{
+		if ( !Error[0] && !Transfered )
+			appStrcpy( Error, TEXT("Refused"));
+		if ( Ch && (Ch->Download == (UChannelDownload*)this) )
+			Ch->Download = nullptr;
+		Ch = nullptr;
+		Finished = 1;
+	}
+};
+IMPLEMENT_CLASS(UXC_LoadTestDownload);
+
+static void LoadTestRequest( FLoadTestClient& Client)
+{
+	UXC_LoadTestDownload* Download = ConstructObject<UXC_LoadTestDownload>( UXC_LoadTestDownload::StaticClass() );
+	Download->Client   = &Client;
+	Download->bNoDelta = 1;
+	Client.Download      = Download;
+	Client.RequestTime   = appSeconds();
+	Client.FirstByteTime = 0;
+	Download->ReceiveFile( Client.Connection, Client.NextFile++, TEXT(""), 1);
+}
+
+static void LoadTestFinishFile( FLoadTestClient& Client)
+{
+	UXC_LoadTestDownload* Download = Client.Download;
+	if ( Download->Error[0] || !Client.FirstByteTime )
+		Client.Errors++;
+	else
+	{
+		DOUBLE FirstByte = Client.FirstByteTime - Client.RequestTime;
+		Client.TotalFirstByte += FirstByte;
+		Client.MaxFirstByte = Max( Client.MaxFirstByte, FirstByte);
+		Client.Received += (QWORD)Download->Transfered;
+		Client.Files++;
+	}
+	Client.Download = nullptr;
+	if ( Download->Ch && (Download->Ch->Download == (UChannelDownload*)Download) )
+		Download->Ch->Download = nullptr;
+	Download->Ch = nullptr;
+	Download->ConditionalDestroy();
+}
+
+static QWORD GetPeakMemory()
+{
+#if __UNIX__
+	struct rusage Usage;
+	if ( getrusage( RUSAGE_SELF, &Usage) == 0 )
+		return (QWORD)Usage.ru_maxrss * 1024;
+#elif _WINDOWS
+	PROCESS_MEMORY_COUNTERS Counters;
+	if ( GetProcessMemoryInfo( GetCurrentProcess(), &Counters, sizeof(Counters)) )
+		return (QWORD)Counters.PeakWorkingSetSize;
+#endif
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+	UFileTransferLoadTestCommandlet.
+-----------------------------------------------------------------------------*/
+
+void UFileTransferLoadTestCommandlet::StaticConstructor()
+{
+	LogToStdout     = 1;
+	IsClient        = 0;
+	IsEditor        = 0;
+	IsServer        = 1;
+	LazyLoad        = 1;
+	ShowErrorCount  = 0;
+}
+
+//
+// ucc XC_Core.FileTransferLoadTest <Package> [<Package>...] [-clients=64] [-rate=20000] [-latency=0.05]
+//     [-stagger=0] [-tickrate=60] [-timeout=600] [-nolzma]
+//
+// Client side decoding, hashing and resuming are not exercised, see top of file.
+//
+INT UFileTransferLoadTestCommandlet::Main( const TCHAR* Parms )
+{
+	INT   NumClients = 64;
+	INT   Rate       = 20000;
+	FLOAT Latency    = 0.05f;
+	FLOAT Stagger    = 0.f;
+	FLOAT TickRate   = 60.f;
+	FLOAT Timeout    = 600.f;
+	UBOOL bNoLZMA    = 0;
+
+	TArray<FString> Packages;
+	FString Token;
+	while ( ParseToken(Parms,Token,0) )
+	{
+		if ( Token.Left(1) != TEXT("-") )
+			new(Packages) FString(Token);
+		else if ( Token.Left(9) == TEXT("-clients=") )
+			NumClients = Clamp( appAtoi(*Token + 9), 1, 1024);
+		else if ( Token.Left(6) == TEXT("-rate=") )
+			Rate = Max( appAtoi(*Token + 6), 1000);
+		else if ( Token.Left(9) == TEXT("-latency=") )
+			Latency = Clamp( appAtof(*Token + 9), 0.f, 2.f);
+		else if ( Token.Left(9) == TEXT("-stagger=") )
+			Stagger = Max( appAtof(*Token + 9), 0.f);
+		else if ( Token.Left(10) == TEXT("-tickrate=") )
+			TickRate = Clamp( appAtof(*Token + 10), 1.f, 1000.f);
+		else if ( Token.Left(9) == TEXT("-timeout=") )
+			Timeout = Max( appAtof(*Token + 9), 1.f);
+		else if ( Token == TEXT("-nolzma") )
+			bNoLZMA = 1;
+	}
+	if ( !Packages.Num() )
+		appErrorf( TEXT("No packages specified"));
+
+	// Server
+	FLoadTestNotify Notify;
+	UXC_LoopbackDriver* ServerDriver = ConstructObject<UXC_LoopbackDriver>( UXC_LoopbackDriver::StaticClass() );
+	ServerDriver->Notify                = &Notify;
+	ServerDriver->AllowDownloads        = 1;
+	ServerDriver->MaxDownloadSize       = 0;
+	ServerDriver->ConnectionTimeout     = Timeout;
+	ServerDriver->InitialConnectTimeout = Timeout;
+	ServerDriver->KeepAliveTime         = 0.2f;
+	check(ServerDriver->MasterMap);
+
+	QWORD TotalSize = 0;
+	for ( INT i=0; i<Packages.Num(); i++)
+	{
+		ULinkerLoad* Linker = UObject::GetPackageLinker( nullptr, *Packages(i), LOAD_NoWarn|LOAD_Quiet, nullptr, nullptr);
+		if ( !Linker )
+		{
+			warnf( TEXT("Skipping %s, package not found"), *Packages(i));
+			continue;
+		}
+		INT j = ServerDriver->MasterMap->AddLinker( Linker);
+		FPackageInfo& Info = ServerDriver->MasterMap->List(j);
+		Info.PackageFlags |= PKG_AllowDownload;
+		TotalSize += (QWORD)Info.FileSize;
+	}
+	ServerDriver->MasterMap->Compute();
+	INT NumFiles = ServerDriver->MasterMap->List.Num();
+	if ( !NumFiles )
+		appErrorf( TEXT("No packages to send"));
+
+	ULZMAServer* OldLZMA = UXC_FileChannel::GLZMA;
+	ULZMAServer* LZMA = nullptr;
+	if ( !bNoLZMA )
+	{
+		LZMA = ConstructObject<ULZMAServer>( ULZMAServer::StaticClass() );
+		LZMA->Init();
+		LZMA->UpdatePackageMap( ServerDriver->MasterMap);
+	}
+	UXC_FileChannel::GLZMA = LZMA;
+
+	warnf( TEXT("Load test: %i clients at %i B/s, %.0f ms latency, %i files (%i KB), LZMA server %s")
+		, NumClients, Rate, Latency * 1000.f, NumFiles, (INT)(TotalSize / 1024), LZMA ? TEXT("on") : TEXT("off") );
+	warnf( TEXT("Clients discard received data, client side decoding is not measured"));
+
+	TArray<FLoadTestClient> Clients;
+	Clients.AddZeroed( NumClients);
+
+	// Stats of the server's frame
+	INT    Frames = 0;
+	DOUBLE FrameTotal = 0;
+	FLOAT  FrameMax = 0;
+	INT    FramesOver[2] = {0,0}; //5 ms, 16 ms
+	INT    QueueMax = 0;
+	DOUBLE QueueTotal = 0;
+	INT    MemCacheMax = 0;
+
+	INT Joined = 0;
+	INT Done = 0;
+	FTime TestStart = appSeconds();
+	FTime LastTime = TestStart;
+	while ( Done < NumClients )
+	{
+		FTime Now = appSeconds();
+		FLOAT DeltaTime = Max<FLOAT>( Now - LastTime, 0.0001f);
+		LastTime = Now;
+		if ( Now - TestStart > Timeout )
+		{
+			warnf( TEXT("Timed out with %i clients still downloading"), NumClients - Done);
+			break;
+		}
+
+		// Connect
+		while ( (Joined < NumClients) && (Now - TestStart >= Joined * Stagger) )
+		{
+			FLoadTestClient& Client = Clients(Joined);
+			Client.Driver = ConstructObject<UXC_LoopbackDriver>( UXC_LoopbackDriver::StaticClass() );
+			Client.Driver->Notify            = &Notify;
+			Client.Driver->ConnectionTimeout = Timeout;
+			Client.Driver->KeepAliveTime     = 0.2f;
+			Client.Driver->Time              = ServerDriver->Time;
+
+			UXC_LoopbackConnection* ServerSide = new(ServerDriver) UXC_LoopbackConnection( ServerDriver, Joined, Rate, Latency);
+			ServerSide->PackageMap->Copy( ServerDriver->MasterMap);
+			ServerDriver->ClientConnections.AddItem( ServerSide);
+
+			Client.Driver->ServerConnection = new(Client.Driver) UXC_LoopbackConnection( Client.Driver, Joined, Rate, Latency);
+			Client.Connection = (UXC_LoopbackConnection*)Client.Driver->ServerConnection;
+			Client.Connection->PackageMap->Copy( ServerDriver->MasterMap);
+			Client.Connection->Peer = ServerSide;
+			ServerSide->Peer = Client.Connection;
+			Client.Connection->CreateChannel( CHTYPE_Control, 1, 0); //Downloads need it open
+
+			Client.StartTime = appSeconds();
+			LoadTestRequest( Client);
+			Joined++;
+		}
+
+		// Server frame, this is what the game thread pays
+		FTime FrameStart = appSeconds();
+		ServerDriver->TickDispatch( DeltaTime);
+		if ( LZMA )
+			LZMA->Tick( DeltaTime);
+		ServerDriver->TickFlush();
+		FLOAT FrameTime = appSeconds() - FrameStart;
+		Frames++;
+		FrameTotal += FrameTime;
+		FrameMax = Max( FrameMax, FrameTime);
+		FramesOver[0] += FrameTime > 0.005f;
+		FramesOver[1] += FrameTime > 0.016f;
+
+		// Clients
+		for ( INT i=0; i<Joined; i++)
+		{
+			FLoadTestClient& Client = Clients(i);
+			if ( Client.bFinished )
+				continue;
+			Client.Driver->TickDispatch( DeltaTime);
+			if ( Client.Download && Client.Download->Finished )
+			{
+				LoadTestFinishFile( Client);
+				if ( Client.NextFile < NumFiles )
+					LoadTestRequest( Client);
+				else
+				{
+					Client.bFinished = 1;
+					Client.EndTime = appSeconds();
+					Done++;
+				}
+			}
+			Client.Driver->TickFlush();
+		}
+
+		// Compression backlog and memory cache
+		if ( LZMA )
+		{
+			INT Queued = 0;
+			INT MemCache = 0;
+			for ( INT i=0; i<LZMA->Sources.Num(); i++)
+			{
+				if ( (LZMA->Sources(i)->State == CS_STATE_Waiting) || (LZMA->Sources(i)->State == CS_STATE_Compressing) )
+					Queued++;
+				MemCache += LZMA->Sources(i)->GetMemorySize();
+			}
+			QueueMax = Max( QueueMax, Queued);
+			QueueTotal += Queued;
+			MemCacheMax = Max( MemCacheMax, MemCache);
+		}
+
+		FLOAT Remaining = 1.f / TickRate - (appSeconds() - Now);
+		if ( Remaining > 0 )
+			appSleep( Remaining);
+	}
+	FTime TestEnd = appSeconds();
+
+	// Per client
+	QWORD  Received = 0;
+	INT    Files = 0;
+	INT    Errors = 0;
+	DOUBLE FirstByteTotal = 0;
+	DOUBLE FirstByteMax = 0;
+	DOUBLE RateMin = 0;
+	DOUBLE RateMax = 0;
+	DOUBLE RateTotal = 0;
+	INT    Rated = 0;
+	for ( INT i=0; i<Joined; i++)
+	{
+		FLoadTestClient& Client = Clients(i);
+		if ( Client.Download )
+			LoadTestFinishFile( Client);
+		FTime End = Client.bFinished ? Client.EndTime : TestEnd;
+		DOUBLE ClientRate = (DOUBLE)Client.Received / Max<DOUBLE>( End - Client.StartTime, 0.001);
+		Received       += Client.Received;
+		Files          += Client.Files;
+		Errors         += Client.Errors;
+		FirstByteTotal += Client.TotalFirstByte;
+		FirstByteMax    = Max( FirstByteMax, Client.MaxFirstByte);
+		RateMin         = Rated ? Min( RateMin, ClientRate) : ClientRate;
+		RateMax         = Max( RateMax, ClientRate);
+		RateTotal      += ClientRate;
+		Rated++;
+		debugf( TEXT("Client %i: %i files, %i errors, %i KB in %.2fs (%.1f KB/s), TTFB avg %.0f ms max %.0f ms")
+			, i, Client.Files, Client.Errors, (INT)(Client.Received / 1024), End - Client.StartTime, ClientRate / 1024.0
+			, Client.Files ? 1000.0 * Client.TotalFirstByte / Client.Files : 0.0, 1000.0 * Client.MaxFirstByte);
+	}
+
+	DOUBLE Elapsed = Max<DOUBLE>( TestEnd - TestStart, 0.001);
+	warnf( TEXT("Finished in %.2fs: %i files, %i errors, %i KB (%.1f KB/s total)"), Elapsed, Files, Errors, (INT)(Received / 1024), Received / 1024.0 / Elapsed);
+	warnf( TEXT("Time to first byte: avg %.0f ms, max %.0f ms"), Files ? 1000.0 * FirstByteTotal / Files : 0.0, 1000.0 * FirstByteMax);
+	warnf( TEXT("Client throughput: min %.1f KB/s, avg %.1f KB/s, max %.1f KB/s"), RateMin / 1024.0, Rated ? RateTotal / Rated / 1024.0 : 0.0, RateMax / 1024.0);
+	warnf( TEXT("Server frame: avg %.3f ms, max %.3f ms, %i of %i over 5 ms, %i over 16 ms")
+		, Frames ? 1000.0 * FrameTotal / Frames : 0.0, 1000.f * FrameMax, FramesOver[0], Frames, FramesOver[1]);
+	if ( LZMA )
+		warnf( TEXT("Compression queue: peak %i, avg %.2f - Memory cache peak %i KB"), QueueMax, Frames ? QueueTotal / Frames : 0.0, MemCacheMax / 1024);
+	warnf( TEXT("Peak process memory: %i MB"), (INT)(GetPeakMemory() / (1024*1024)) );
+	if ( LZMA )
+		LZMA->Exec( TEXT("LZMA STATS"), *GWarn);
+
+	// Clients first so their goodbyes reach live server connections
+	// Drivers take their connections and channels down with them
+	for ( INT i=0; i<Joined; i++)
+		Clients(i).Driver->ConditionalDestroy();
+	ServerDriver->ConditionalDestroy();
+	UXC_FileChannel::GLZMA = OldLZMA;
+	if ( LZMA )
+		LZMA->ConditionalDestroy();
+	UObject::CollectGarbage( RF_Native);
+
+	GIsRequestingExit = 1;
+	return Errors ? 1 : 0;
+}
+IMPLEMENT_CLASS(UFileTransferLoadTestCommandlet)
+
+/*-----------------------------------------------------------------------------
+	The End.
+-----------------------------------------------------------------------------*/
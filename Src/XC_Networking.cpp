@@ -9,35 +9,50 @@
 #include "UnNet.h"
 #include "XC_Download.h"
 #include "XC_LZMA.h"
+#include "XC_UZ.h"
+#include "XC_Delta.h"
+#include "XC_Hash.h"
 
 #include "Cacus/CacusThread.h"
 #include "Cacus/Atomics.h"
 
 
 void UZDecompress( const TCHAR* SourceFilename, const TCHAR* DestFilename, TCHAR* Error);
+void UZDecompress( FArchive& SrcFileAr, FArchive& DestFileAr, TCHAR* Error);
 
 ULZMAServer* UXC_FileChannel::GLZMA = nullptr;
 
+#define DOWNLOAD_HASH_ERROR TEXT("Received package doesn't match the server's hash")
+
 /*----------------------------------------------------------------------------
 	Asynchronous processor.
 ----------------------------------------------------------------------------*/
 
-static volatile int32 DownloadTag = 0;
-static volatile int32 RecordLock = 0;
+// Decode workers shared by all downloads, idle workers exit on their own
+#define DOWNLOAD_MAX_WORKERS 2
+static FAsyncJobQueue* DownloadQueue = nullptr;
+
+// Streamed decodes last for the whole transfer, each one gets its own worker
+// so they never hold up the finish-time decompression of other downloads.
+// Downloads past this limit are saved to the temp folder and decoded at the end.
+#define DOWNLOAD_MAX_STREAMS 4
+static FAsyncJobQueue* StreamQueue = nullptr;
+
+// Downloads are only accessed by tag, a job may outlive its download
+static int32 DownloadTag = 0;
 struct DownloadRecord
 {
-	const UXC_Download* Download;
+	UXC_Download* Download;
 	int32 Tag;
 
-	DownloadRecord( const UXC_Download* InDownload)
+	DownloadRecord( UXC_Download* InDownload)
 		: Download(InDownload), Tag(DownloadTag++ & 0x7FFFFFFF)
 	{}
 };
 static TArray<DownloadRecord> Downloads;
 
-static int32 GetDownloadTag( const UXC_Download* Download)
+static int32 GetDownloadTag( UXC_Download* Download)
 {
-	CSpinLock SL(&RecordLock);
 	for ( int32 i=0 ; i<Downloads.Num() ; i++ )
 		if ( Downloads(i).Download == Download )
 			return Downloads(i).Tag;
@@ -45,9 +60,16 @@ static int32 GetDownloadTag( const UXC_Download* Download)
 	return Downloads.Last().Tag;
 }
 
+static UXC_Download* FindDownload( int32 Tag)
+{
+	for ( int32 i=0 ; i<Downloads.Num() ; i++ )
+		if ( Downloads(i).Tag == Tag )
+			return Downloads(i).Download;
+	return nullptr;
+}
+
 static void RemoveDownload( const UXC_Download* Download)
 {
-	CSpinLock SL(&RecordLock);
 	for ( int32 i=0 ; i<Downloads.Num() ; i++ )
 		if ( Downloads(i).Download == Download )
 		{
@@ -56,52 +78,596 @@ static void RemoveDownload( const UXC_Download* Download)
 		}
 }
 
-static uint32 AsyncProc( void* Arg, CThread* Handler)
+FDownloadAsyncProcessor::FDownloadAsyncProcessor( UXC_Download* InDownload)
+	: DownloadTag( GetDownloadTag(InDownload) )
 {
-	FDownloadAsyncProcessor* Processor = (FDownloadAsyncProcessor*)Handler;
-	do
-	{	while ( Processor->Download->AsyncAction); //Additional TEST operation before WRITE prevents scalability issues
-	} while ( FPlatformAtomics::InterlockedCompareExchange(&Processor->Download->AsyncAction, 1, 0) );
+	Error[0] = '\0';
+}
 
-	try	{(Processor->Proc)(Processor);}	catch(...){}
-	FPlatformAtomics::InterlockedExchange( &UXC_Download::GlobalLock, 0); //Hacky, but saves us from exception
+void FDownloadAsyncProcessor::Finish( UXC_Download* Download)
+{
+	appStrcpy( Download->Error, Error);
+	Download->AsyncAction = 0;
+	Download->Finished = 1;
+}
 
-	if ( Processor->DownloadActive() )
-		FPlatformAtomics::InterlockedExchange( &Processor->Download->AsyncAction, 0);
-	Processor->Detach();
-	appSleep( 0.2f ); //Don't immediately kill the processor
-	delete Processor;
-	return THREAD_END_OK;
+void FDownloadAsyncProcessor::Queue( FDownloadAsyncProcessor* Job)
+{
+	if ( !DownloadQueue )
+		DownloadQueue = new FAsyncJobQueue( DOWNLOAD_MAX_WORKERS);
+	UXC_Download* Download = FindDownload( Job->DownloadTag);
+	if ( Download )
+		Download->AsyncAction = 1;
+	DownloadQueue->Add( Job);
 }
 
-FDownloadAsyncProcessor::FDownloadAsyncProcessor( const ASYNC_PROC InProc, UXC_Download* InDownload)
-	: CThread()
-	, Download(InDownload)
-	, DownloadTag( GetDownloadTag(InDownload) )
-	, Proc(InProc)
+UBOOL FDownloadAsyncProcessor::CanQueueStream()
 {
-	Run(&AsyncProc);
-	while ( !IsEnded() ) //Don't let main go until thread is detached
-		appSleep(0.f);
+	return !StreamQueue || (StreamQueue->NumActive() < DOWNLOAD_MAX_STREAMS);
 }
 
-bool FDownloadAsyncProcessor::DownloadActive()
+void FDownloadAsyncProcessor::QueueStream( FDownloadAsyncProcessor* Job)
 {
-	CSpinLock SL(&RecordLock);
-	for ( int32 i=0 ; i<Downloads.Num() ; i++ )
-		if ( Downloads(i).Tag == DownloadTag )
-			return true;
-	return false;
+	if ( !StreamQueue )
+		StreamQueue = new FAsyncJobQueue( DOWNLOAD_MAX_STREAMS);
+	UXC_Download* Download = FindDownload( Job->DownloadTag);
+	if ( Download )
+		Download->AsyncAction = 1;
+	StreamQueue->Add( Job);
+}
+
+static void ClaimFinished( FAsyncJobQueue* Queue)
+{
+	if ( !Queue )
+		return;
+	FAsyncJob* Job;
+	while ( (Job=Queue->GetFinished()) != nullptr )
+	{
+		FDownloadAsyncProcessor* Proc = (FDownloadAsyncProcessor*)Job;
+		UXC_Download* Download = FindDownload( Proc->DownloadTag);
+		if ( Download )
+			Proc->Finish( Download);
+		delete Job;
+	}
+}
+
+void FDownloadAsyncProcessor::ClaimFinished()
+{
+	::ClaimFinished( DownloadQueue);
+	::ClaimFinished( StreamQueue);
+}
+
+//
+// Decompress or move a finished download from the temp folder
+//
+class FDownloadDecompressJob : public FDownloadAsyncProcessor
+{
+public:
+	BYTE    IsCompressed;
+	BYTE    IsLZMA;
+	FString TempFilename;
+	FString DestFilename;
+	FString BaseFilename;
+	DWORD   PackageHash;
+	DWORD   ReceivedHash;
+
+	FDownloadDecompressJob( UXC_Download* InDownload)
+		: FDownloadAsyncProcessor(InDownload)
+		, IsCompressed(InDownload->IsCompressed)
+		, IsLZMA(InDownload->IsLZMA)
+		, TempFilename(InDownload->TempFilename)
+		, DestFilename( ((GSys->CachePath + PATH_SEPARATOR) + InDownload->Info->Guid.String()) + GSys->CacheExt )
+		, BaseFilename( ((GSys->CachePath + PATH_SEPARATOR) + InDownload->DeltaBase.String()) + GSys->CacheExt )
+		, PackageHash(InDownload->PackageHash)
+		, ReceivedHash(InDownload->ReceivedHash)
+	{}
+
+	void Run()
+	{
+		if ( !GFileManager->FileSize( *TempFilename ) )
+			appStrcpy( Error, *UXC_Download::NetOpenError );
+		else if ( IsCompressed )
+		{
+			if ( IsLZMA == 3 )       DeltaApply( *TempFilename, *BaseFilename, *DestFilename, Error);
+			else if ( IsLZMA == 2 )  LzmaDecompressContainer( *TempFilename, *DestFilename, Error);
+			else if ( IsLZMA )       LzmaDecompress( *TempFilename, *DestFilename, Error);
+			else                     UZDecompress( *TempFilename, *DestFilename, Error);
+
+			// Decoders write straight into the cache, a bad file must not stay there
+			DWORD Hash;
+			if ( !Error[0] && PackageHash && (!Crc32CFile( *DestFilename, Hash) || (Hash != PackageHash)) )
+			{
+				appStrcpy( Error, DOWNLOAD_HASH_ERROR);
+				GFileManager->Delete( *DestFilename);
+			}
+		}
+		else if ( PackageHash && (ReceivedHash != PackageHash) )
+			appStrcpy( Error, DOWNLOAD_HASH_ERROR);
+		else if ( !GFileManager->Move( *DestFilename, *TempFilename, 1) )
+			appStrcpy( Error, *UXC_Download::NetMoveError);
+	}
+
+	void Finish( UXC_Download* Download)
+	{
+		// Cached version didn't match, start over asking for the full file
+		if ( (IsLZMA == 3) && Error[0] && !Download->bNoDelta )
+		{
+			debugf( NAME_DevNet, TEXT("%s Downloading full package."), Error);
+			GFileManager->Delete( *TempFilename);
+			Download->DeleteResume();
+			Download->AsyncAction  = 0;
+			Download->Transfered   = 0;
+			Download->RealFileSize = 0;
+			Download->IsCompressed = 0;
+			Download->IsLZMA       = 0;
+			Download->bNoDelta     = 1;
+			Download->OpenTransfer();
+			return;
+		}
+		FDownloadAsyncProcessor::Finish( Download);
+	}
+};
+
+
+/*----------------------------------------------------------------------------
+	Streaming decompressor.
+----------------------------------------------------------------------------*/
+
+//
+// Received data is handed to a download worker that writes the cache file,
+// LZMA is decoded as it arrives.
+// UZ needs the whole compressed stream (Huffman stage reads it in one go)
+// so it's only buffered in memory and decoded once the transfer ends.
+//
+// Received data waiting for the worker is bounded, if the decoder falls
+// behind the main thread waits for it instead of buffering the package.
+//
+#define DOWNLOAD_STREAM_MAX_PENDING (4*1024*1024)
+class FDownloadStream
+{
+public:
+	FString DestFilename;
+	FString PartFilename; //Decoded here, moved into the cache once complete and verified
+	BYTE IsLZMA;
+	DWORD Hash; //Expected CRC32C of the decoded package, zero if unknown
+	volatile int32 Lock;
+	volatile int32 RefCount;
+	volatile int32 bClosed;   //No more data will be pushed
+	volatile int32 bAbort;    //Download cancelled, discard everything
+	volatile int32 bFailed;   //Decoder gave up, stop receiving
+	TArray<BYTE> Pending;
+	FAsyncEvent DataReady;    //Pushed, closed or aborted
+	FAsyncEvent Drained;      //Pending taken by the worker, or decoder failed
+
+	FDownloadStream( const TCHAR* InDestFilename, const TCHAR* InPartFilename, BYTE InIsLZMA, DWORD InHash)
+		: DestFilename(InDestFilename)
+		, PartFilename(InPartFilename)
+		, IsLZMA(InIsLZMA)
+		, Hash(InHash)
+		, Lock(0)
+		, RefCount(1)
+		, bClosed(0)
+		, bAbort(0)
+		, bFailed(0)
+	{}
+
+	void AddRef()
+	{
+		FPlatformAtomics::InterlockedIncrement( &RefCount);
+	}
+
+	void Release()
+	{
+		if ( FPlatformAtomics::InterlockedDecrement( &RefCount) == 0 )
+			delete this;
+	}
+
+	// Main thread interface
+	UBOOL Push( const void* Data, INT Count)
+	{
+		while ( !bFailed && (NumPending() > DOWNLOAD_STREAM_MAX_PENDING) )
+			Drained.Wait( 0.1f);
+		if ( bFailed )
+			return 0;
+		{
+			CSpinLock SL(&Lock);
+			INT i = Pending.Add( Count);
+			appMemcpy( &Pending(i), Data, Count);
+		}
+		DataReady.Signal();
+		return 1;
+	}
+	void Close()
+	{
+		FPlatformAtomics::InterlockedExchange( &bClosed, 1);
+		DataReady.Signal();
+	}
+	void Abort()
+	{
+		FPlatformAtomics::InterlockedExchange( &bAbort, 1);
+		DataReady.Signal();
+	}
+	FArchive* CreateWriter( FArchive* File);
+
+	// Worker thread, writes the cache file
+	void Decode( TCHAR* Error);
+
+protected:
+	// Worker thread: waits for data, returns false when there's no more
+	UBOOL Pop( TArray<BYTE>& Out)
+	{
+		Out.Empty();
+		while ( !bAbort )
+		{
+			UBOOL bLast = bClosed; //Read before checking data
+			{
+				CSpinLock SL(&Lock);
+				if ( Pending.Num() )
+				{
+					Out.Add( Pending.Num() );
+					appMemcpy( &Out(0), &Pending(0), Pending.Num() );
+					Pending.Empty();
+				}
+			}
+			if ( Out.Num() )
+			{
+				Drained.Signal();
+				return 1;
+			}
+			if ( bLast )
+				break;
+			DataReady.Wait( 1.f);
+		}
+		return 0;
+	}
+
+	INT NumPending()
+	{
+		CSpinLock SL(&Lock);
+		return Pending.Num();
+	}
+
+private:
+	~FDownloadStream() {}
+};
+
+void FDownloadStream::Decode( TCHAR* Error)
+{
+	// The engine trusts any file with the GUID's name in the cache,
+	// an interrupted download must never leave a partial one there
+	FArchive* DestAr = GFileManager->CreateFileWriter( *PartFilename);
+	if ( !DestAr )
+	{
+		appStrcpy( Error, *UXC_Download::NetOpenError);
+		return;
+	}
+
+	FCrc32CWriter HashAr( *DestAr);
+	try
+	{
+		TArray<BYTE> Data;
+		if ( IsLZMA )
+		{
+			FLZMADecoder Decoder;
+			BYTE  Header[13];
+			INT   HeaderSize = 0;
+			while ( !Error[0] && Pop(Data) )
+			{
+				INT Pos = 0;
+				if ( HeaderSize < 13 )
+				{
+					INT Count = Min( 13 - HeaderSize, Data.Num() );
+					appMemcpy( Header + HeaderSize, &Data(0), Count);
+					HeaderSize += Count;
+					Pos += Count;
+					if ( (HeaderSize < 13) || !Decoder.Init( Header, Error) )
+						continue;
+				}
+				if ( Pos < Data.Num() )
+					Decoder.Decode( &Data(Pos), Data.Num() - Pos, HashAr, Error);
+			}
+			if ( !Error[0] && !bAbort && ((HeaderSize < 13) || !Decoder.IsFinished()) )
+				appStrcpy( Error, *UXC_Download::NetSizeError);
+		}
+		else
+		{
+			TArray<BYTE> Compressed;
+			while ( Pop(Data) )
+			{
+				INT i = Compressed.Add( Data.Num() );
+				appMemcpy( &Compressed(i), &Data(0), Data.Num() );
+			}
+			if ( !bAbort )
+			{
+				FBufferReader Reader( Compressed);
+				UZDecompress( Reader, HashAr, Error);
+			}
+		}
+	}
+	catch ( const TCHAR* C )
+	{
+		if ( *C && !Error[0] )
+			appStrncpy( Error, C, 255);
+	}
+	catch (...)
+	{
+		if ( !Error[0] )
+			appStrcpy( Error, TEXT("Unhandled exception in download decompressor"));
+	}
+
+	if ( !DestAr->Close() && !Error[0] )
+		appStrcpy( Error, *UXC_Download::NetWriteError);
+	delete DestAr;
+	if ( bAbort && !Error[0] )
+		appStrcpy( Error, TEXT("Download cancelled"));
+	if ( Hash && (HashAr.Crc != Hash) && !Error[0] )
+		appStrcpy( Error, DOWNLOAD_HASH_ERROR);
+	if ( !Error[0] && !GFileManager->Move( *DestFilename, *PartFilename, 1) )
+		appStrcpy( Error, *UXC_Download::NetMoveError);
+	if ( Error[0] )
+	{
+		GFileManager->Delete( *PartFilename);
+		FPlatformAtomics::InterlockedExchange( &bFailed, 1);
+		Drained.Signal();
+	}
 }
 
+//
+// Runs for the whole transfer
+//
+class FDownloadStreamJob : public FDownloadAsyncProcessor
+{
+public:
+	FDownloadStream* Stream;
 
+	FDownloadStreamJob( UXC_Download* InDownload, FDownloadStream* InStream)
+		: FDownloadAsyncProcessor(InDownload)
+		, Stream(InStream)
+	{
+		Stream->AddRef();
+	}
+	~FDownloadStreamJob()
+	{
+		Stream->Release();
+	}
+	void Run()
+	{
+		Stream->Decode( Error);
+	}
+	void Finish( UXC_Download* Download)
+	{
+		if ( Download->Stream == Stream )
+		{
+			Download->Stream->Release();
+			Download->Stream = nullptr;
+		}
+		FDownloadAsyncProcessor::Finish( Download);
+	}
+};
+
+//
+// Used as the download's RecvFileAr, deleting it closes the stream
+//
+class FDownloadStreamWriter : public FArchive
+{
+public:
+	FDownloadStream* Stream;
+	FArchive* File; //Raw copy so an interrupted download can be resumed
+	INT Pos;
+
+	FDownloadStreamWriter( FDownloadStream* InStream, FArchive* InFile)
+		: Stream(InStream)
+		, File(InFile)
+		, Pos(0)
+	{
+		ArIsSaving = 1;
+		Stream->AddRef();
+	}
+	~FDownloadStreamWriter()
+	{
+		if ( File )
+			delete File;
+		Stream->Close();
+		Stream->Release();
+	}
+	void Serialize( void* V, INT Length)
+	{
+		if ( !Stream->Push( V, Length) )
+			ArIsError = 1;
+		if ( File )
+			File->Serialize( V, Length);
+		Pos += Length;
+	}
+	INT Tell()
+	{
+		return Pos;
+	}
+	INT TotalSize()
+	{
+		return Pos;
+	}
+};
+
+FArchive* FDownloadStream::CreateWriter( FArchive* File)
+{
+	return new FDownloadStreamWriter( this, File);
+}
+
+
+/*----------------------------------------------------------------------------
+	Prefetching.
+----------------------------------------------------------------------------*/
+
+//
+// Packages after the one the engine is downloading are fetched in the
+// background by downloads of our own, the engine still receives them
+// one by one in PackageMap order.
+//
+struct FDownloadPrefetch
+{
+	UNetConnection* Connection;
+	FGuid Guid;
+	UXC_Download* Download; //Deleted once finished
+	UBOOL bDone;            //Successfully stored in cache
+};
+static TArray<FDownloadPrefetch> Prefetches;
+
+static INT FindPrefetch( UNetConnection* Connection, const FGuid& Guid)
+{
+	for ( INT i=0; i<Prefetches.Num(); i++)
+		if ( (Prefetches(i).Connection == Connection) && (Prefetches(i).Guid == Guid) )
+			return i;
+	return INDEX_NONE;
+}
+
+static INT FindPrefetch( const UXC_Download* Download)
+{
+	for ( INT i=0; i<Prefetches.Num(); i++)
+		if ( Prefetches(i).Download == Download )
+			return i;
+	return INDEX_NONE;
+}
+
+static void StartPrefetches( UXC_Download* Active)
+{
+	guard(StartPrefetches);
+
+	// Forget downloads from previous connections
+	for ( INT i=0; i<Prefetches.Num(); i++)
+		if ( Prefetches(i).Connection != Active->Connection )
+		{
+			UXC_Download* Download = Prefetches(i).Download;
+			Prefetches.Remove(i--);
+			if ( Download )
+				delete Download;
+		}
+
+	INT Running = 0;
+	for ( INT i=0; i<Prefetches.Num(); i++)
+		if ( !Prefetches(i).bDone )
+			Running++;
+
+	// Optional packages may be skipped by the user, don't waste bandwidth on them
+	TArray<FPackageInfo>& List = Active->Connection->PackageMap->List;
+	for ( INT i=Active->PackageIndex+1; (i<List.Num()) && (Running < Active->MaxConcurrentDownloads-1); i++)
+		if ( (List(i).PackageFlags & PKG_Need) && !(List(i).PackageFlags & PKG_ClientOptional)
+			&& (FindPrefetch(Active->Connection,List(i).Guid) == INDEX_NONE) )
+		{
+			UXC_Download* Download = ConstructObject<UXC_Download>( Active->GetClass() );
+			Download->bPrefetch = 1;
+			FDownloadPrefetch& Prefetch = Prefetches( Prefetches.AddZeroed() );
+			Prefetch.Connection = Active->Connection;
+			Prefetch.Guid       = List(i).Guid;
+			Prefetch.Download   = Download;
+			Download->ReceiveFile( Active->Connection, i, *Active->DownloadParams, Active->UseCompression);
+			Running++;
+		}
+
+	unguard;
+}
+
+static void TickPrefetches()
+{
+	guard(TickPrefetches);
+
+	TArray<UXC_Download*> Ticking;
+	for ( INT i=0; i<Prefetches.Num(); i++)
+		if ( Prefetches(i).Download )
+			Ticking.AddItem( Prefetches(i).Download );
+
+	for ( INT i=0; i<Ticking.Num(); i++)
+		if ( FindPrefetch(Ticking(i)) != INDEX_NONE ) //Not destroyed by a previous tick
+		{
+			Ticking(i)->Tick();
+			if ( Ticking(i)->Finished )
+				delete Ticking(i);
+		}
+
+	unguard;
+}
+
+/*----------------------------------------------------------------------------
+	Cache index.
+----------------------------------------------------------------------------*/
+
+//
+// cache.ini entries of finished downloads
+// The file is loaded once per batch and written when the instance is deleted,
+// instead of being rewritten after every package.
+//
+static FConfigCacheIni* CacheIndex = nullptr;
+
+static void AddCacheEntry( const FGuid& Guid, const TCHAR* Name)
+{
+	guard(AddCacheEntry);
+	if ( !CacheIndex )
+		CacheIndex = new FConfigCacheIni;
+	FString IniName = GSys->CachePath + PATH_SEPARATOR + TEXT("cache.ini");
+	CacheIndex->SetString( TEXT("Cache"), *Guid.String(), Name, *IniName );
+	unguard;
+}
+
+static void FlushCacheIndex()
+{
+	guard(FlushCacheIndex);
+	if ( CacheIndex )
+	{
+		delete CacheIndex; //Writes dirty files
+		CacheIndex = nullptr;
+	}
+	unguard;
+}
+
+//
+// Older version of a package in the cache, the one closest in size
+//
+static UBOOL FindCachedVersion( const FPackageInfo& Info, FGuid& Result)
+{
+	guard(FindCachedVersion);
+	if ( !Info.URL.Len() )
+		return 0;
+	if ( !CacheIndex )
+		CacheIndex = new FConfigCacheIni;
+	FString IniName = GSys->CachePath + PATH_SEPARATOR + TEXT("cache.ini");
+	TMultiMap<FString,FString>* Section = CacheIndex->GetSectionPrivate( TEXT("Cache"), 0, 1, *IniName);
+	if ( !Section )
+		return 0;
+
+	INT BestDiff = MAXINT;
+	for ( TMultiMap<FString,FString>::TIterator It(*Section); It; ++It)
+	{
+		FGuid Guid;
+		if ( (It.Value() != Info.URL) || !Parse( *(FString(TEXT("GUID=")) + It.Key()), TEXT("GUID="), Guid) || (Guid == Info.Guid) )
+			continue;
+		INT Size = GFileManager->FileSize( *(((GSys->CachePath + PATH_SEPARATOR) + It.Key()) + GSys->CacheExt) );
+		if ( (Size > 0) && (Abs(Size - Info.FileSize) < BestDiff) )
+		{
+			BestDiff = Abs(Size - Info.FileSize);
+			Result = Guid;
+		}
+	}
+	return BestDiff != MAXINT;
+	unguard;
+}
+
+// Packages left to download after this one
+static UBOOL HasQueuedDownloads( UXC_Download* Active)
+{
+	for ( INT i=0; i<Prefetches.Num(); i++)
+		if ( !Prefetches(i).bDone && (Prefetches(i).Download != Active) )
+			return 1;
+	TArray<FPackageInfo>& List = Active->Connection->PackageMap->List;
+	for ( INT i=Active->PackageIndex+1; i<List.Num(); i++)
+		if ( List(i).PackageFlags & PKG_Need )
+			return 1;
+	return 0;
+}
 
 
 /*----------------------------------------------------------------------------
 	XC_Download.
 ----------------------------------------------------------------------------*/
 
-volatile int32 UXC_Download::GlobalLock = 0;
 FString UXC_Download::NetSizeError;
 FString UXC_Download::NetOpenError;
 FString UXC_Download::NetWriteError;
@@ -133,8 +699,25 @@ UXC_Download::UXC_Download()
 void UXC_Download::Destroy()
 {
 	guard(UXC_Download::Destroy);
-	CSpinLock SL(&UXC_Download::GlobalLock);
 	RemoveDownload(this);
+	INT i = FindPrefetch(this);
+	if ( i != INDEX_NONE )
+	{
+		// Keep finished ones so the engine download can pick them up
+		if ( Prefetches(i).bDone )
+			Prefetches(i).Download = nullptr;
+		else
+			Prefetches.Remove(i);
+	}
+	if ( Stream )
+	{
+		Stream->Abort();
+		Stream->Release();
+		Stream = nullptr;
+	}
+	// Disconnected or shutting down, don't lose what was received
+	if ( !Finished || Error[0] )
+		FlushCacheIndex();
 	Super::Destroy();
 	unguard;
 }
@@ -143,63 +726,82 @@ void UXC_Download::Tick()
 {
 	guard(UXC_Download::Tick);
 
+	// Pick up results of all downloads, not just this one
+	FDownloadAsyncProcessor::ClaimFinished();
+
+	// Engine download drives the background ones
+	if ( !bPrefetch )
+	{
+		TickPrefetches();
+		if ( bAdopted )
+		{
+			INT i = FindPrefetch( Connection, Info->Guid);
+			if ( i == INDEX_NONE )
+			{
+				// Background download failed, retry on our own
+				bAdopted = 0;
+				OpenTransfer();
+			}
+			else if ( Prefetches(i).bDone )
+			{
+				Prefetches.Remove(i);
+				bAdopted = 0;
+				Finished = 1;
+			}
+			else
+			{
+				Transfered   = Prefetches(i).Download->Transfered;
+				RealFileSize = Prefetches(i).Download->RealFileSize;
+			}
+		}
+		StartPrefetches( this);
+	}
+
 	if ( Error[0] )
 		Finished = 1;
 
 	int32 DownloadSize = RealFileSize ? RealFileSize : Info->FileSize;
-	if ( !Finished && (OldTransfered != Transfered) )
+	if ( !Finished && !bPrefetch )
 	{
-		int32 FileCount = 0;
-		for ( int32 i=0; i<Connection->PackageMap->List.Num(); i++)
-			if (Connection->PackageMap->List(i).PackageFlags & PKG_Need)
-				FileCount++;
-		
-		FString Msg1 = FString::Printf( (Info->PackageFlags&PKG_ClientOptional)?LocalizeProgress(TEXT("ReceiveOptionalFile"),TEXT("Engine")):LocalizeProgress(TEXT("ReceiveFile"),TEXT("Engine")), Info->Parent->GetName() );
-		FString Msg2 = FString::Printf( LocalizeProgress(TEXT("ReceiveSize"),TEXT("Engine")), DownloadSize/1024, 100.f*Transfered/DownloadSize, Transfered/1024, FileCount-1 );
-		Connection->Driver->Notify->NotifyProgress( *Msg1, *Msg2, 4.f );
-		OldTransfered = Transfered;
+		// Progress of all active downloads
+		int32 TotalSize = DownloadSize;
+		int32 TotalTransfered = Transfered;
+		for ( INT i=0; i<Prefetches.Num(); i++)
+		{
+			UXC_Download* Download = Prefetches(i).Download;
+			if ( Download && !Prefetches(i).bDone && (Prefetches(i).Guid != Info->Guid) )
+			{
+				TotalSize += Download->RealFileSize ? Download->RealFileSize : Download->Info->FileSize;
+				TotalTransfered += Download->Transfered;
+			}
+		}
+
+		if ( OldTransfered != TotalTransfered )
+		{
+			int32 FileCount = 0;
+			for ( int32 i=0; i<Connection->PackageMap->List.Num(); i++)
+				if (Connection->PackageMap->List(i).PackageFlags & PKG_Need)
+					FileCount++;
+
+			FString Msg1 = FString::Printf( (Info->PackageFlags&PKG_ClientOptional)?LocalizeProgress(TEXT("ReceiveOptionalFile"),TEXT("Engine")):LocalizeProgress(TEXT("ReceiveFile"),TEXT("Engine")), Info->Parent->GetName() );
+			FString Msg2 = FString::Printf( LocalizeProgress(TEXT("ReceiveSize"),TEXT("Engine")), TotalSize/1024, 100.f*TotalTransfered/Max(TotalSize,1), TotalTransfered/1024, FileCount-1 );
+			Connection->Driver->Notify->NotifyProgress( *Msg1, *Msg2, 4.f );
+			OldTransfered = TotalTransfered;
+		}
 	}
-	if ( !Finished && !AsyncAction )
+	if ( !Finished && !AsyncAction && !bAdopted )
 	{
 		//*******************************************************
 		//File has been downloaded, and receiver has been closed.
 		if ( (Transfered >= DownloadSize) && !RecvFileAr )
 		{
-			if ( IsCompressed )
+			if ( IsCompressed && !bPrefetch )
 			{
 				FString Msg1 = FString::Printf( LocalizeProgress(TEXT("DecompressFile"),TEXT("XC_Core")), Info->Parent->GetName() );
 				FString Msg2 = FString::Printf( TEXT("%s: %iK > %iK"), (IsLZMA ? TEXT("LZMA") : TEXT("UZ")), Transfered/1024, Info->FileSize/1024 );
 				Connection->Driver->Notify->NotifyProgress( *Msg1, *Msg2, 4.f );
 			}
-			new FDownloadAsyncProcessor( [](FDownloadAsyncProcessor* Proc)
-			{
-				//STAGE 1, setup local environment.
-				BYTE IsCompressed = Proc->Download->IsCompressed;
-				BYTE IsLZMA = Proc->Download->IsLZMA;
-				FString Guid = Proc->Download->Info->Guid.String();
-				FString TempFilename = Proc->Download->TempFilename;
-				FString DestFilename = ((GSys->CachePath + PATH_SEPARATOR) + Guid) + GSys->CacheExt;
-				TCHAR Error[256] = TEXT("");
-
-				//STAGE 2, let main go (no longer safe to use Download from now on)
-				Proc->Detach();
-				if ( !GFileManager->FileSize( *TempFilename ) )
-					appStrcpy( Error, *UXC_Download::NetOpenError );
-				else if ( IsCompressed )
-				{
-					if ( IsLZMA ) LzmaDecompress( *TempFilename, *DestFilename, Error);
-					else          UZDecompress( *TempFilename, *DestFilename, Error);
-				}
-				else if ( !GFileManager->Move( *DestFilename, *TempFilename, 1) )
-					appStrcpy( Error, *UXC_Download::NetMoveError);
-
-				//STAGE 3, validate downloader and lock
-				CSpinLock SL(&UXC_Download::GlobalLock);
-				if ( !Proc->DownloadActive() )
-					return;
-				appStrcpy( Proc->Download->Error, Error);
-				Proc->Download->Finished = 1;
-			}, this);
+			FDownloadAsyncProcessor::Queue( new FDownloadDecompressJob(this) );
 		}
 		else if ( (Transfered > 0) && (Transfered < DownloadSize) && !RecvFileAr )
 		{
@@ -215,15 +817,29 @@ void UXC_Download::Tick()
 			debugf( TEXT("Download finished with error: %s"), Error);
 		if ( !Error[0] ) //Finished without errors
 		{
-			FString IniName = GSys->CachePath + PATH_SEPARATOR + TEXT("cache.ini");
-			FConfigCacheIni CacheIni;
-			CacheIni.SetString( TEXT("Cache"), Info->Guid.String(), *(*Info->URL) ? *Info->URL : Info->Parent->GetName(), *IniName );
+			AddCacheEntry( Info->Guid, *(*Info->URL) ? *Info->URL : Info->Parent->GetName() );
+			if ( !bPrefetch && !HasQueuedDownloads(this) )
+				FlushCacheIndex();
 
-			FString Msg = FString::Printf( TEXT("Received '%s'"), Info->Parent->GetName() );
-			Connection->Driver->Notify->NotifyProgress( TEXT("Success"), *Msg, 4.f );
+			if ( !bPrefetch )
+			{
+				FString Msg = FString::Printf( TEXT("Received '%s'"), Info->Parent->GetName() );
+				Connection->Driver->Notify->NotifyProgress( TEXT("Success"), *Msg, 4.f );
+			}
 		}
 		GFileManager->Delete( TempFilename);
-		Connection->Driver->Notify->NotifyReceivedFile( Connection, PackageIndex, Error, 0);
+		DeleteResume();
+		if ( !bPrefetch )
+			Connection->Driver->Notify->NotifyReceivedFile( Connection, PackageIndex, Error, 0);
+		else
+		{
+			// Failed ones are dropped, the engine download will retry
+			INT i = FindPrefetch(this);
+			if ( (i != INDEX_NONE) && !Error[0] )
+				Prefetches(i).bDone = 1;
+			else if ( i != INDEX_NONE )
+				Prefetches.Remove(i);
+		}
 
 		if ( RecvFileAr )
 		{
@@ -244,6 +860,9 @@ void UXC_Download::StaticConstructor()
 {
 	EnableLZMA = 1;
 	UseCompression = 1;
+	MaxConcurrentDownloads = 3;
+
+	new(GetClass(),TEXT("MaxConcurrentDownloads"), RF_Public) UIntProperty( CPP_PROPERTY(MaxConcurrentDownloads), TEXT("Download"), CPF_Config );
 }
 
 
@@ -251,6 +870,34 @@ void UXC_Download::StaticConstructor()
 void UXC_Download::ReceiveData( BYTE* Data, INT Count )
 {
 	guard( UXC_Download:ReceiveData);
+
+	// Control header from servers that can resume, precedes file data
+	if ( (Transfered == 0) && !RecvFileAr && !bCanResume && ((Count == XCDL_HEADER_SIZE) || (Count == XCDL_HEADER_HASH_SIZE)) && (((DWORD*)Data)[0] == XCDL_HEADER_MAGIC) )
+	{
+		INT Offset = ((INT*)Data)[1];
+		bCanResume = 1;
+		PackageHash = (Count == XCDL_HEADER_HASH_SIZE) ? ((DWORD*)Data)[3] : 0;
+		bResuming = (Offset > 0) && (Offset == Resume.Offset) && PackageHash && (PackageHash == Resume.Hash);
+		if ( !bResuming )
+			Resume.Offset = 0;
+		Resume.StreamSize = ((INT*)Data)[2];
+		Resume.Hash = PackageHash;
+		return;
+	}
+
+	// Continue partial file from previous attempt
+	if ( (Transfered == 0) && !RecvFileAr && bResuming )
+	{
+		debugf( NAME_DevNet, TEXT("Resuming package '%s' at %iK"), Info->Parent->GetName(), Resume.Offset/1024 );
+		IsCompressed = Resume.IsCompressed;
+		IsLZMA = Resume.IsLZMA;
+		appStrncpy( TempFilename, *Resume.TempFilename, 255);
+		if ( !IsCompressed && PackageHash && !Crc32CFile( TempFilename, ReceivedHash, Resume.Offset) )
+			PackageHash = 0;
+		RecvFileAr = GFileManager->CreateFileWriter( TempFilename, FILEWRITE_Append);
+		Transfered = Resume.Offset;
+	}
+
 	// Receiving spooled file data.
 	if( Transfered==0 && !RecvFileAr )
 	{
@@ -260,7 +907,21 @@ void UXC_Download::ReceiveData( BYTE* Data, INT Count )
 		if ( DirSeparator >= 0 )
 			PackageName = PackageName.Mid( DirSeparator+1);
 
-		if ( Count >= 13 )
+		if ( DeltaIsPatch( Data, Count) )
+		{
+			IsCompressed = 1;
+			IsLZMA = 3;
+			PackageName += DELTA_EXTENSION;
+			debugf( NAME_DevNet, TEXT("USES DELTA FROM %s"), *DeltaBase.String() );
+		}
+		else if ( LzmaIsContainer( Data, Count) )
+		{
+			IsCompressed = 1;
+			IsLZMA = 2;
+			PackageName += LZMA_CONTAINER_EXTENSION;
+			debugf( NAME_DevNet, TEXT("USES LZMA MULTI-BLOCK"));
+		}
+		else if ( Count >= 13 )
 		{
 			QWORD* LZMASize = (QWORD*)&Data[5];
 			if ( Info->FileSize == *LZMASize )
@@ -269,6 +930,8 @@ void UXC_Download::ReceiveData( BYTE* Data, INT Count )
 				IsLZMA = 1;
 				PackageName += TEXT(".lzma");
 				debugf( NAME_DevNet, TEXT("USES LZMA"));
+				if ( !FLZMADecoder::IsAvailable() )
+					debugf( NAME_DevNet, TEXT("Streaming LZMA decoder unavailable (%s), decompressing after download"), FLZMADecoder::GetUnavailableReason() );
 			}
 			INT* UzSignature = (INT*)&Data[0];
 			if ( *UzSignature == 1234 || *UzSignature == 5678 )
@@ -284,7 +947,30 @@ void UXC_Download::ReceiveData( BYTE* Data, INT Count )
 		GFileManager->MakeDirectory( TEXT("../DownloadTemp"), 0);
 		FString Filename = FString::Printf( TEXT("../DownloadTemp/%s"), *PackageName );
 		appStrncpy( TempFilename, *Filename, 255);
-		RecvFileAr = GFileManager->CreateFileWriter( TempFilename );
+
+		// Only full streams of a known package can be picked up again
+		UBOOL bResumable = bCanResume && Resume.StreamSize && Resume.Hash && (IsLZMA != 3);
+
+		// Decode straight into the cache if possible and a stream worker is free
+		if ( IsCompressed && (!IsLZMA || ((IsLZMA == 1) && FLZMADecoder::IsAvailable())) && FDownloadAsyncProcessor::CanQueueStream() )
+		{
+			FString DestFilename = ((GSys->CachePath + PATH_SEPARATOR) + Info->Guid.String()) + GSys->CacheExt;
+			FString PartFilename = FString::Printf( TEXT("../DownloadTemp/%s.part"), *Info->Guid.String() );
+			Stream = new FDownloadStream( *DestFilename, *PartFilename, IsLZMA, PackageHash);
+			RecvFileAr = Stream->CreateWriter( bResumable ? GFileManager->CreateFileWriter(TempFilename) : nullptr );
+			FDownloadAsyncProcessor::QueueStream( new FDownloadStreamJob( this, Stream) );
+		}
+		else
+			RecvFileAr = GFileManager->CreateFileWriter( TempFilename );
+
+		// Remember how to pick this up again if we get disconnected
+		if ( bResumable && RecvFileAr )
+		{
+			Resume.IsCompressed = IsCompressed;
+			Resume.IsLZMA       = IsLZMA;
+			Resume.TempFilename = TempFilename;
+			SaveResume();
+		}
 
 	}
 
@@ -306,6 +992,8 @@ void UXC_Download::ReceiveData( BYTE* Data, INT Count )
 		else
 		{
 			// Successful.
+			if ( !IsCompressed )
+				ReceivedHash = Crc32C( Data, Count, ReceivedHash);
 			Transfered += Count;
 		}
 	}	
@@ -325,8 +1013,15 @@ void UXC_Download::DownloadDone()
 	if( SkippedFile )
 	{
 		guard( Skip );
+		if ( Stream )
+		{
+			Stream->Abort();
+			Stream->Release();
+			Stream = nullptr;
+		}
 		debugf( TEXT("Skipped download of '%s'"), Info->Parent->GetName() );
 		GFileManager->Delete( TempFilename );
+		DeleteResume();
 		TCHAR Msg[256];
 		appSprintf( Msg, TEXT("Skipped '%s'"), Info->Parent->GetName() );
 		Connection->Driver->Notify->NotifyProgress( TEXT("Success"), Msg, 4.f );
@@ -348,6 +1043,72 @@ void UXC_Download::DownloadDone()
 	}
 	unguard;
 }
+
+//
+// Resume sidecar: ../DownloadTemp/<GUID>.resume
+//
+#define RESUME_MAGIC 0x32455258 //Version 2 adds the package hash
+
+static FString GetResumeFilename( const FGuid& Guid)
+{
+	return FString::Printf( TEXT("../DownloadTemp/%s.resume"), *Guid.String() );
+}
+
+void UXC_Download::LoadResume()
+{
+	guard(UXC_Download::LoadResume);
+
+	Resume.Offset = 0;
+	Resume.StreamSize = 0;
+	Resume.Hash = 0;
+	bCanResume = 0;
+	bResuming = 0;
+
+	FString Filename = GetResumeFilename( Info->Guid);
+	TArray<BYTE> Data;
+	if ( (GFileManager->FileSize(*Filename) <= 0) || !appLoadFileToArray( Data, *Filename) )
+		return;
+
+	DWORD Magic = 0;
+	FBufferReader Reader( Data);
+	Reader << Magic;
+	if ( Magic == RESUME_MAGIC )
+		Reader << Resume.StreamSize << Resume.Hash << Resume.IsCompressed << Resume.IsLZMA << Resume.TempFilename;
+	INT Size = (Magic == RESUME_MAGIC) ? GFileManager->FileSize( *Resume.TempFilename) : 0;
+	if ( !Reader.IsError() && (Magic == RESUME_MAGIC) && Resume.Hash && (Resume.IsLZMA != 3) && (Size > 0) && (Size < Resume.StreamSize) )
+		Resume.Offset = Size;
+	else
+		DeleteResume();
+
+	unguard;
+}
+
+void UXC_Download::SaveResume()
+{
+	guard(UXC_Download::SaveResume);
+
+	FArchive* Ar = GFileManager->CreateFileWriter( *GetResumeFilename(Info->Guid) );
+	if ( Ar )
+	{
+		DWORD Magic = RESUME_MAGIC;
+		*Ar << Magic << Resume.StreamSize << Resume.Hash << Resume.IsCompressed << Resume.IsLZMA << Resume.TempFilename;
+		delete Ar;
+	}
+
+	unguard;
+}
+
+void UXC_Download::DeleteResume()
+{
+	guard(UXC_Download::DeleteResume);
+
+	FString Filename = GetResumeFilename( Info->Guid);
+	if ( GFileManager->FileSize(*Filename) >= 0 )
+		GFileManager->Delete( *Filename);
+
+	unguard;
+}
+
 IMPLEMENT_CLASS(UXC_Download)
 
 
@@ -381,6 +1142,17 @@ void UXC_ChannelDownload::ReceiveFile( UNetConnection* InConnection, INT InPacka
 {
 	UXC_Download::ReceiveFile( InConnection, InPackageIndex, Params, InCompression );
 
+	// Already being fetched in the background, Tick will wait for it
+	if ( !bPrefetch && (FindPrefetch(Connection,Info->Guid) != INDEX_NONE) )
+	{
+		bAdopted = 1;
+		return;
+	}
+	OpenTransfer();
+}
+
+void UXC_ChannelDownload::OpenTransfer()
+{
 	// Create channel.
 	Ch = (UFileChannel *)Connection->CreateChannel( (EChannelType)7, 1 );
 
@@ -398,7 +1170,21 @@ void UXC_ChannelDownload::ReceiveFile( UNetConnection* InConnection, INT InPacka
 	// Send file request.
 	FOutBunch Bunch( Ch, 0 );
 	Bunch.ChType = 7;
-	Bunch << Info->Guid;
+	// Older servers ignore everything after the GUID
+	LoadResume();
+	DWORD Flags = XCDL_Resume | XCDL_ResumeHash | XCDL_Hash;
+	DeltaBase = FGuid(0,0,0,0);
+	PackageHash = 0;
+	ReceivedHash = 0;
+	if ( EnableLZMA )
+	{
+		Flags |= XCDL_MultiBlock;
+		if ( !bNoDelta && FindCachedVersion( *Info, DeltaBase) )
+			Flags |= XCDL_Delta;
+	}
+	Bunch << Info->Guid << Flags << Resume.Offset << Resume.StreamSize << Resume.Hash;
+	if ( Flags & XCDL_Delta )
+		Bunch << DeltaBase;
 	Bunch.bReliable = 1;
 	check(!Bunch.IsError());
 	Ch->SendBunch( &Bunch, 0 );
@@ -419,6 +1205,13 @@ IMPLEMENT_CLASS(UXC_ChannelDownload)
 UXC_FileChannel::UXC_FileChannel()
 {
 	Download = NULL;
+	SendFileView = NULL;
+	ClientFlags = 0;
+	ResumeOffset = 0;
+	ResumeSize = 0;
+	ResumeHash = 0;
+	DeltaBaseGuid = FGuid(0,0,0,0);
+	SendHash = 0;
 }
 
 void UXC_FileChannel::Init( UNetConnection* InConnection, INT InChannelIndex, INT InOpenedLocally )
@@ -468,6 +1261,19 @@ void UXC_FileChannel::ReceivedBunch( FInBunch& Bunch )
 			// Request to send a file.
 			FGuid Guid;
 			Bunch << Guid;
+			ClientFlags = 0;
+			ResumeOffset = 0;
+			ResumeSize = 0;
+			ResumeHash = 0;
+			DeltaBaseGuid = FGuid(0,0,0,0);
+			if ( !Bunch.IsError() && !Bunch.AtEnd() )
+				Bunch << ClientFlags;
+			if ( !Bunch.IsError() && (ClientFlags & XCDL_Resume) )
+				Bunch << ResumeOffset << ResumeSize;
+			if ( !Bunch.IsError() && (ClientFlags & XCDL_Resume) && (ClientFlags & XCDL_ResumeHash) )
+				Bunch << ResumeHash;
+			if ( !Bunch.IsError() && (ClientFlags & XCDL_Delta) )
+				Bunch << DeltaBaseGuid;
 			if( !Bunch.IsError() && ProcessGuid( Guid, true) )
 				return;
 		}
@@ -481,6 +1287,137 @@ void UXC_FileChannel::ReceivedBunch( FInBunch& Bunch )
 	unguard;
 }
 
+/*-----------------------------------------------------------------------------
+	Upload scheduler.
+-----------------------------------------------------------------------------*/
+
+FFileSendSettings GFileSendSettings = { 0, 4, 4096, 0, 0, 0 };
+
+//
+// Deficit round robin across connections
+// Each round a connection earns Quantum bytes (LevelWeight times that if it's
+// downloading the level) and spends them on its own file channels, level first.
+// When an upload rate is set all connections draw from a single token bucket.
+//
+struct FFileSendFlow
+{
+	UNetConnection* Connection;
+	INT   Deficit;
+	UBOOL bBlocked;
+	TArray<UXC_FileChannel*> Channels;
+};
+
+static TArray<UXC_FileChannel*> SendChannels;
+static TArray<FFileSendFlow> SendFlows;
+static UNetDriver* SendDriver = nullptr;
+static FTime SendTime;
+static FTime SendRefill;
+static DOUBLE SendBudget = 0;
+static INT SendCursor = 0;
+
+static void BuildSendFlows()
+{
+	for ( INT i=0; i<SendFlows.Num(); i++)
+	{
+		SendFlows(i).Channels.Empty();
+		SendFlows(i).bBlocked = 0;
+	}
+
+	for ( INT i=0; i<SendChannels.Num(); i++)
+	{
+		UXC_FileChannel* Channel = SendChannels(i);
+		if ( !Channel->SendFileAr || Channel->Closing )
+		{
+			SendChannels.Remove(i--);
+			continue;
+		}
+		INT j;
+		for ( j=0; j<SendFlows.Num() && SendFlows(j).Connection!=Channel->Connection; j++);
+		if ( j == SendFlows.Num() )
+		{
+			SendFlows.AddZeroed();
+			SendFlows(j).Connection = Channel->Connection;
+		}
+		FFileSendFlow& Flow = SendFlows(j);
+		INT k = (Channel->PackageIndex == 0) ? 0 : Flow.Channels.Num();
+		Flow.Channels.Insert(k);
+		Flow.Channels(k) = Channel;
+	}
+
+	// Idle connections lose their deficit (Channels is empty, nothing to free)
+	for ( INT i=0; i<SendFlows.Num(); i++)
+		if ( !SendFlows(i).Channels.Num() )
+			SendFlows.Remove(i--);
+
+	GFileSendSettings.ActiveConnections = SendFlows.Num();
+	GFileSendSettings.ActiveChannels    = SendChannels.Num();
+}
+
+//
+// Called by every file channel tick, only the first call of each driver frame does anything
+//
+static void ServiceSendFlows( UNetDriver* Driver)
+{
+	guard(ServiceSendFlows);
+	if ( (Driver == SendDriver) && (Driver->Time == SendTime) )
+		return;
+	SendDriver = Driver;
+	SendTime   = Driver->Time;
+
+	// Refill, allow bursts of a quarter second
+	FTime Now = appSeconds();
+	FLOAT Delta = Clamp<FLOAT>( Now - SendRefill, 0.f, 1.f);
+	SendRefill = Now;
+	INT Rate    = GFileSendSettings.MaxBytesPerSecond;
+	INT Quantum = Max( GFileSendSettings.Quantum, 512);
+	if ( Rate > 0 )
+		SendBudget = Min<DOUBLE>( SendBudget + Delta * Rate, Max( Rate/4, Quantum) );
+
+	BuildSendFlows();
+	if ( !SendFlows.Num() )
+		return;
+
+	UBOOL bSent = 1;
+	while ( bSent && ((Rate <= 0) || (SendBudget >= 1)) )
+	{
+		bSent = 0;
+		for ( INT n=0; n<SendFlows.Num(); n++)
+		{
+			FFileSendFlow& Flow = SendFlows( (SendCursor + n) % SendFlows.Num() );
+			if ( Flow.bBlocked )
+				continue;
+			INT Weight = (Flow.Channels(0)->PackageIndex == 0) ? Max( GFileSendSettings.LevelWeight, 1) : 1;
+			Flow.Deficit += Quantum * Weight;
+			while ( Flow.Deficit > 0 )
+			{
+				INT Limit = Flow.Deficit;
+				if ( Rate > 0 )
+					Limit = Min( Limit, (INT)SendBudget);
+				INT Sent = 0;
+				for ( INT c=0; c<Flow.Channels.Num() && !Sent; c++)
+					Sent = Flow.Channels(c)->SendChunk( Limit);
+				if ( !Sent )
+				{
+					// Connection can't take more data this frame
+					if ( Limit == Flow.Deficit )
+					{
+						Flow.bBlocked = 1;
+						Flow.Deficit = 0;
+					}
+					break;
+				}
+				Flow.Deficit -= Sent;
+				if ( Rate > 0 )
+					SendBudget -= Sent;
+				GFileSendSettings.TotalSent += Sent;
+				bSent = 1;
+			}
+		}
+	}
+	SendCursor++;
+	unguard;
+}
+
 static UBOOL LanPlay = -1; //Prevent static init inside function, newer compilers try to do it thread-safe when not necessary
 void UXC_FileChannel::Tick()
 {
@@ -503,114 +1440,291 @@ void UXC_FileChannel::Tick()
 		}
 	}
 
+	if ( !OpenedLocally && SendFileAr )
+		ServiceSendFlows( Connection->Driver);
+}
+
+//
+// Send one bunch of at most Limit bytes
+//
+INT UXC_FileChannel::SendChunk( INT Limit)
+{
 	INT Size;
 
 	//TIM: IsNetReady(1) causes the client's bandwidth to be saturated. Good for clients, very bad
 	// for bandwidth-limited servers. IsNetReady(0) caps the clients bandwidth.
 	if ( LanPlay == -1 )
 		LanPlay = ParseParam(appCmdLine(),TEXT("lanplay"));
-	while( !OpenedLocally && SendFileAr && IsNetReady(LanPlay) && (Size=MaxSendBytes())!=0 )
-	{
-		// Sending.
-		INT Remaining = ((FArchive*)SendFileAr)->TotalSize() - SentData;
-		Size = Min( Size, Remaining );
-		//Never send less than 13 bytes, we ensure LZMA header is sent in one chunk
-		if ( (SentData == 0) && (Size <= 13) )
-			return;
-		FOutBunch Bunch( this, Size>=Remaining );
+	if ( OpenedLocally || Closing || !SendFileAr || !IsNetReady(LanPlay) || (Size=MaxSendBytes())==0 )
+		return 0;
 
-		//Slow method, otherwise we depend on Alloca
-		TArray<BYTE> Buffer(Size);
-//		BYTE* Buffer = (BYTE*)appAlloca( Size );
-		((FArchive*)SendFileAr)->Serialize( Buffer.GetData(), Size ); //Linux v440 net crashfix
+	// Stream may still be growing, only the last byte of a complete one closes the channel
+	UBOOL bComplete = !SendFileView || SendFileView->IsComplete();
+	if ( SendFileAr->IsError() )
+	{
+		debugf( NAME_DevNet, TEXT("File stream failed, closing") );
+		Close();
+		return 0;
+	}
+	INT Remaining = ((FArchive*)SendFileAr)->TotalSize() - SentData;
+	if ( bComplete && (Remaining <= 0) && (SentData > 0) )
+	{
+		// Everything went out before the stream was known to be complete
+		FOutBunch Bunch( this, 1);
+		Bunch.bReliable = 1;
+		SendBunch( &Bunch, 0 );
+		delete SendFileAr;
+		SendFileAr = nullptr;
+		SendFileView = nullptr;
+		SendScratch.Empty();
+		return 0;
+	}
+	Size = Min( Min( Size, Limit), Remaining );
+	//Never send less than 13 bytes, we ensure LZMA header is sent in one chunk
+	if ( (Size <= 0) || ((SentData == 0) && (Size <= 13)) )
+		return 0;
+	FOutBunch Bunch( this, bComplete && (Size>=Remaining) );
+
+	// Source data in memory, send as is
+	const BYTE* Data = SendFileView ? SendFileView->ReadView( Size) : nullptr;
+	if ( !Data )
+	{
+		// Otherwise go through a buffer that lives as long as the channel
+		if ( SendScratch.Num() < Size )
+			SendScratch.Add( Size - SendScratch.Num() );
+		((FArchive*)SendFileAr)->Serialize( SendScratch.GetData(), Size ); //Linux v440 net crashfix
 		if( SendFileAr->IsError() )
 		{
-			//HANDLE THIS!!
+			debugf( NAME_DevNet, TEXT("File read failed, closing") );
+			Close();
+			return 0;
 		}
-		SentData += Size;
-		Bunch.Serialize( Buffer.GetData(), Size );
-		Bunch.bReliable = 1;
-		check(!Bunch.IsError());
-		SendBunch( &Bunch, 0 );
-		Connection->FlushNet();
-		if ( Bunch.bClose ) //Finished
+		Data = SendScratch.GetData();
+	}
+	SentData += Size;
+	Bunch.Serialize( (void*)Data, Size );
+	Bunch.bReliable = 1;
+	check(!Bunch.IsError());
+	SendBunch( &Bunch, 0 );
+	Connection->FlushNet();
+	if ( Bunch.bClose ) //Finished
+	{
+		delete SendFileAr;
+		SendFileAr = nullptr;
+		SendFileView = nullptr;
+		SendScratch.Empty();
+	}
+	return Size;
+}
+
+//
+// GUID to package index tables, one per package map
+// Package maps may be modified or deleted at any time so entries are validated on lookup,
+// the package map pointer is only used as a key. Tables of maps no longer owned by any of
+// the driver's connections are freed when a new table is needed.
+//
+struct FPackageGuidIndex
+{
+	UPackageMap*         PackageMap;
+	INT                  Num;
+	TMultiMap<DWORD,INT> Index;
+
+	FPackageGuidIndex( UPackageMap* InPackageMap)
+		: PackageMap(InPackageMap), Num(-1)
+	{}
+
+	void Build()
+	{
+		Index.Empty();
+		Num = PackageMap->List.Num();
+		for ( INT i=0; i<Num; i++)
+			Index.Add( GetGuidHash(PackageMap->List(i).Guid), i);
+	}
+
+	INT Find( const FGuid& Guid)
+	{
+		TArray<INT> Found;
+		Index.MultiFind( GetGuidHash(Guid), Found);
+		for ( INT i=0; i<Found.Num(); i++)
 		{
-			delete SendFileAr;
-			SendFileAr = nullptr;
+			FPackageInfo& Info = PackageMap->List(Found(i));
+			if ( Info.Guid==Guid && Info.URL!=TEXT("") )
+				return Found(i);
 		}
+		return INDEX_NONE;
 	}
+};
+static TArray<FPackageGuidIndex*> PackageGuidIndexes;
+
+static UBOOL IsPackageMapInUse( UNetDriver* Driver, UPackageMap* PackageMap)
+{
+	if ( Driver->ServerConnection && (Driver->ServerConnection->PackageMap == PackageMap) )
+		return 1;
+	for ( INT i=0; i<Driver->ClientConnections.Num(); i++)
+		if ( Driver->ClientConnections(i) && (Driver->ClientConnections(i)->PackageMap == PackageMap) )
+			return 1;
+	return 0;
+}
+
+static INT FindPackageIndex( UNetConnection* Connection, const FGuid& Guid, INT Hint)
+{
+	guard(FindPackageIndex);
+
+	// Last known location (pending LZMA requests)
+	UPackageMap* PackageMap = Connection->PackageMap;
+	if ( PackageMap->List.IsValidIndex(Hint) && PackageMap->List(Hint).Guid==Guid && PackageMap->List(Hint).URL!=TEXT("") )
+		return Hint;
+
+	FPackageGuidIndex* Table = nullptr;
+	for ( INT i=0; i<PackageGuidIndexes.Num() && !Table; i++)
+		if ( PackageGuidIndexes(i)->PackageMap == PackageMap )
+			Table = PackageGuidIndexes(i);
+	if ( !Table )
+	{
+		// Closed connections no longer need theirs
+		for ( INT i=0; i<PackageGuidIndexes.Num(); i++)
+			if ( !IsPackageMapInUse( Connection->Driver, PackageGuidIndexes(i)->PackageMap) )
+			{
+				delete PackageGuidIndexes(i);
+				PackageGuidIndexes.Remove(i--);
+			}
+		Table = new FPackageGuidIndex(PackageMap);
+		PackageGuidIndexes.AddItem( Table);
+	}
+
+	// Package map changed, or pointer now belongs to a different map
+	if ( Table->Num != PackageMap->List.Num() )
+		Table->Build();
+	INT Result = Table->Find(Guid);
+	if ( Result == INDEX_NONE )
+	{
+		Table->Build();
+		Result = Table->Find(Guid);
+	}
+	return Result;
+
+	unguard;
 }
 
 UBOOL UXC_FileChannel::ProcessGuid( const FGuid& Guid, UBOOL UseGLZMA)
 {
 	guard(UXC_FileChannel::ProcessGuid);
 
-	for( INT i=0; i<Connection->PackageMap->List.Num(); i++ )
+	INT i = FindPackageIndex( Connection, Guid, PackageIndex);
+	if ( i != INDEX_NONE )
 	{
 		FPackageInfo& Info = Connection->PackageMap->List(i);
-		if( Info.Guid==Guid && Info.URL!=TEXT("") )
-		{
-			if ( (LZMA_PendingGuid != Guid) && !Connection->Driver->Notify->NotifySendingFile( Connection, Guid) )
-				return 0;
+		if ( (LZMA_PendingGuid != Guid) && !Connection->Driver->Notify->NotifySendingFile( Connection, Guid) )
+			return 0;
+		PackageIndex = i; //Lookup hint for pending requests
 
-			FString FileToSend;
-			SendFileAr = nullptr;
+		FString FileToSend;
+		SendFileAr = nullptr;
+		SendFileView = nullptr;
+		SendHash = 0;
 
-			FLZMASourceBase* Source = (UseGLZMA && GLZMA) ? GLZMA->GetSource(Info) : nullptr;
-			if ( Source )
+		// Difference to the client's cached version, wait a bit if it's being built
+		if ( (ClientFlags & XCDL_Delta) && UseGLZMA && GLZMA )
+		{
+			if ( GLZMA->GetDelta( Info, DeltaBaseGuid, SendFileAr) == DELTA_Pending )
 			{
 				if ( LZMA_PendingGuid != Guid )
 				{
-					Source->Priority++;
 					LZMA_PendingGuid = Guid;
 					LZMA_Timeout     = Connection->Driver->Time + 10.f;
+					DeltaTimeout     = Connection->Driver->Time + 5.f;
 				}
+				if ( Connection->Driver->Time < DeltaTimeout )
+					return 1;
+			}
+			if ( SendFileAr )
+				FileToSend = Info.URL + TEXT(" (LZMA Server, delta)");
+			else
+			{
+				// Continue as a regular request
+				ClientFlags &= ~XCDL_Delta;
+				LZMA_PendingGuid = FGuid(0,0,0,0);
+			}
+		}
 
-				// Not finished compressing
-				if ( Source->CompressedSize == 0 )
+		FLZMASourceBase* Source = (UseGLZMA && GLZMA && !SendFileAr) ? GLZMA->GetSource(Info) : nullptr;
+		if ( Source )
+		{
+			if ( LZMA_PendingGuid != Guid )
+			{
+				GLZMA->NotifyServed( Source, Source->CompressedSize != 0);
+				Source->Priority++;
+				LZMA_PendingGuid = Guid;
+				LZMA_Timeout     = Connection->Driver->Time + 10.f;
+			}
+
+			// Not finished compressing, start with what the compressor has published so far
+			// Stream ends when the channel closes so clients don't need the size in advance.
+			if ( Source->CompressedSize == 0 )
+			{
+				if ( (Connection->Driver->MaxDownloadSize > 0) && (Source->OriginalSize > Connection->Driver->MaxDownloadSize) )
 					return 1;
+				// Hash is only known once the compressor has read everything, not verified
+				SendFileView = Source->CreateLiveReader();
+				if ( !SendFileView )
+					return 1;
+				SendFileAr = SendFileView;
+				FileToSend = Info.URL + TEXT(" (LZMA Server, live)");
+			}
 
-				// File too large
-				if( (Connection->Driver->MaxDownloadSize > 0) && (Source->CompressedSize > Connection->Driver->MaxDownloadSize) )
-					break;
+			// File too large
+			else if( (Connection->Driver->MaxDownloadSize > 0) && (Source->CompressedSize > Connection->Driver->MaxDownloadSize) )
+				return 0;
 
+			// Multi-block container for clients that can decode it in parallel
+			else if ( (ClientFlags & XCDL_MultiBlock) && (Source->ContainerSize > 0)
+				&& ((Connection->Driver->MaxDownloadSize <= 0) || (Source->ContainerSize <= Connection->Driver->MaxDownloadSize))
+				&& ((SendFileAr = Source->CreateContainerReader()) != nullptr) )
+				FileToSend = Info.URL + TEXT(" (LZMA Server, multi-block)");
+			else
+			{
 				FileToSend = Info.URL + TEXT(" (LZMA Server)");
-				SendFileAr = Source->CreateReader();
-				if ( !SendFileAr ) // Wtf
-				{
-					debugf( NAME_DevNet, TEXT("WTF NO SENDER") );
-					return 1;
-				}
+				SendFileView = Source->CreateView();
+				SendFileAr = SendFileView ? SendFileView : Source->CreateReader();
 			}
-			else //oldver
+			if ( !SendFileAr ) // Wtf
 			{
-				// Get download size
-				INT DownloadSize = GFileManager->FileSize(*Info.URL);
-				if ( (Connection->Driver->MaxDownloadSize > 0) && (DownloadSize > Connection->Driver->MaxDownloadSize) )
-					break;
+				debugf( NAME_DevNet, TEXT("WTF NO SENDER") );
+				return 1;
+			}
+			SendHash = Source->Hash; //Zero while compressing
+		}
+		else if ( !SendFileAr ) //oldver
+		{
+			// Get download size
+			INT DownloadSize = GFileManager->FileSize(*Info.URL);
+			if ( (Connection->Driver->MaxDownloadSize > 0) && (DownloadSize > Connection->Driver->MaxDownloadSize) )
+				return 0;
 
-				appStrncpy( SrcFilename, *Info.URL, ARRAY_COUNT(SrcFilename) );
-				FileToSend = FString::Printf(TEXT("%s.lzma"), SrcFilename);
+			appStrncpy( SrcFilename, *Info.URL, ARRAY_COUNT(SrcFilename) );
+			FileToSend = FString::Printf(TEXT("%s.lzma"), SrcFilename);
+			SendFileAr = GFileManager->CreateFileReader( *FileToSend);
+			if ( !SendFileAr )
+			{
+				FileToSend = FString::Printf(TEXT("%s.uz"), SrcFilename);
 				SendFileAr = GFileManager->CreateFileReader( *FileToSend);
 				if ( !SendFileAr )
 				{
-					FileToSend = FString::Printf(TEXT("%s.uz"), SrcFilename);
-					SendFileAr = GFileManager->CreateFileReader( *FileToSend);
-					if ( !SendFileAr )
-					{
-						FileToSend = SrcFilename;
-						SendFileAr = GFileManager->CreateFileReader( SrcFilename);
-					}
+					FileToSend = SrcFilename;
+					SendFileAr = GFileManager->CreateFileReader( SrcFilename);
 				}
 			}
+		}
 
-			// File/memory reader create, start sending,
-			if( SendFileAr )
-			{
-				debugf( NAME_DevNet, LocalizeProgress(TEXT("NetSend"),TEXT("Engine")), *FileToSend );
-				PackageIndex = i;
-				return 1;
-			}
+		// File/memory reader create, start sending,
+		if( SendFileAr )
+		{
+			debugf( NAME_DevNet, LocalizeProgress(TEXT("NetSend"),TEXT("Engine")), *FileToSend );
+			SentData = 0;
+			if ( ClientFlags & XCDL_Resume )
+				SendControlHeader();
+			SendChannels.AddUniqueItem( this);
+			return 1;
 		}
 	}
 	return 0;
@@ -618,6 +1732,38 @@ UBOOL UXC_FileChannel::ProcessGuid( const FGuid& Guid, UBOOL UseGLZMA)
 	unguard;
 }
 
+//
+// Tell the client where the data starts, skip what it already has
+// The partial file must belong to a full stream of the same size and package hash,
+// otherwise start over. Deltas are never resumed, their base isn't part of the check.
+//
+void UXC_FileChannel::SendControlHeader()
+{
+	guard(UXC_FileChannel::SendControlHeader);
+
+	INT StreamSize = (!SendFileView || SendFileView->IsComplete()) ? SendFileAr->TotalSize() : 0; //Unknown yet, can't resume
+	INT Offset = 0;
+	if ( (ResumeOffset > 0) && (ResumeOffset < StreamSize) && (ResumeSize == StreamSize)
+		&& (ClientFlags & XCDL_ResumeHash) && SendHash && (ResumeHash == SendHash) && !(ClientFlags & XCDL_Delta) )
+	{
+		Offset = ResumeOffset;
+		SendFileAr->Seek( Offset);
+		SentData = Offset;
+		debugf( NAME_DevNet, TEXT("Resuming at %iK of %iK"), Offset/1024, StreamSize/1024 );
+	}
+
+	FOutBunch Bunch( this, 0);
+	DWORD Magic = XCDL_HEADER_MAGIC;
+	Bunch << Magic << Offset << StreamSize;
+	if ( ClientFlags & XCDL_Hash )
+		Bunch << SendHash;
+	Bunch.bReliable = 1;
+	check(!Bunch.IsError());
+	SendBunch( &Bunch, 0);
+
+	unguard;
+}
+
 void UXC_FileChannel::Destroy()
 {
 	check(Connection);
@@ -632,6 +1778,9 @@ void UXC_FileChannel::Destroy()
 		delete SendFileAr;
 		SendFileAr = nullptr;
 	}
+	SendFileView = nullptr;
+	SendScratch.Empty();
+	SendChannels.RemoveItem( this);
 
 	// Notify that the receive succeeded or failed.
 	if( OpenedLocally && Download )
@@ -655,7 +1804,13 @@ IMPLEMENT_CLASS(UXC_FileChannel)
 #define guard(n) {
 #define unguard }
 
-#include "FCodec.h"
+//
+// Exceptions must be handled by caller
+//
+void UZDecompress( FArchive& SrcFileAr, FArchive& DestFileAr, TCHAR* Error)
+{
+	UzDecompress( SrcFileAr, DestFileAr, Error);
+}
 
 void UZDecompress( const TCHAR* SourceFilename, const TCHAR* DestFilename, TCHAR* Error)
 {
@@ -670,23 +1825,7 @@ void UZDecompress( const TCHAR* SourceFilename, const TCHAR* DestFilename, TCHAR
 			DestFileAr = GFileManager->CreateFileWriter( DestFilename );
 			if ( DestFileAr )
 			{
-				int32 Signature;
-				*SrcFileAr << Signature;
-				if( (Signature != 5678) && (Signature != 1234) )
-					appStrcpy( Error, *UXC_Download::NetSizeError);
-				else
-				{
-					FString OrigFilename;
-					*SrcFileAr << OrigFilename;
-					FCodecFull Codec;
-					Codec.AddCodec(new FCodecRLE);
-					Codec.AddCodec(new FCodecBWT);
-					Codec.AddCodec(new FCodecMTF);
-					if ( Signature == 5678 ) //UZ2 Support
-						Codec.AddCodec(new FCodecRLE);
-					Codec.AddCodec(new FCodecHuffman);
-					Codec.Decode( *SrcFileAr, *DestFileAr );
-				}
+				UZDecompress( *SrcFileAr, *DestFileAr, Error);
 				delete DestFileAr;
 				DestFileAr = nullptr;
 			}
@@ -0,0 +1,585 @@
+/*=============================================================================
+	XC_UZ.cpp:
+	Native UZ/UZ2 decoder.
+
+	Engine codec chain, undone in reverse order:
+	- UZ:  RLE, BWT, MTF, Huffman
+	- UZ2: RLE, BWT, MTF, RLE, Huffman
+
+	Huffman, MTF and RLE carry their state over the whole stream, only the BWT
+	stage works on independent blocks. Those are inverted by worker threads
+	while the main thread runs MTF ahead of them and the final RLE behind them.
+=============================================================================*/
+
+#include "XC_Core.h"
+#include "FCodec.h"
+#include "XC_UZ.h"
+
+#define UZ_BWT_BLOCK     0x40000 //MAX_BUFFER_SIZE in FCodecBWT
+#define UZ_BWT_HEADER    12      //Length, First, Last
+#define UZ_RLE_LEAD      5
+#define UZ_HUFFMAN_NODES 511
+#define UZ_BIT(Data,Pos) (((Data)[(Pos) >> 3] >> ((Pos) & 7)) & 1)
+
+/*-----------------------------------------------------------------------------
+	Stages.
+-----------------------------------------------------------------------------*/
+
+//
+// Growable output, Data has slack past Num
+//
+struct FUzOutput
+{
+	TArray<BYTE> Data;
+	INT          Num;
+
+	FUzOutput()
+		: Num(0)
+	{}
+
+	BYTE* Reserve( INT Count)
+	{
+		if ( Num + Count > Data.Num() )
+			Data.Add( Max( Count, Max( Data.Num(), 64*1024)) );
+		return (BYTE*)Data.GetData() + Num;
+	}
+};
+
+//
+// Tree is stored depth first: 1 is an inner node followed by both children,
+// 0 is a leaf followed by its byte. Bits are read LSB first like FBitReader.
+//
+static UBOOL UzDecodeHuffman( const BYTE* Src, INT SrcSize, FUzOutput& Out, TCHAR* Error)
+{
+	INT Total;
+	if ( (SrcSize < (INT)sizeof(INT)) || (SrcSize >= 0x0FFFFFFF) )
+	{
+		appStrcpy( Error, TEXT("UZ: Invalid compressed size."));
+		return 0;
+	}
+	appMemcpy( &Total, Src, sizeof(INT));
+	Src     += sizeof(INT);
+	SrcSize -= sizeof(INT);
+
+	INT NumBits = SrcSize * 8;
+	INT Pos = 0;
+	INT Child[UZ_HUFFMAN_NODES][2];
+	INT Ch[UZ_HUFFMAN_NODES];
+	INT NumNodes = 1;
+	INT Stack[UZ_HUFFMAN_NODES];
+	INT StackNum = 0;
+	Stack[StackNum++] = 0;
+	while ( StackNum )
+	{
+		INT Node = Stack[--StackNum];
+		if ( Pos >= NumBits )
+		{
+			appStrcpy( Error, TEXT("UZ: Truncated Huffman table."));
+			return 0;
+		}
+		UBOOL bInner = UZ_BIT(Src,Pos);
+		Pos++;
+		if ( bInner )
+		{
+			if ( NumNodes + 2 > UZ_HUFFMAN_NODES )
+			{
+				appStrcpy( Error, TEXT("UZ: Invalid Huffman table."));
+				return 0;
+			}
+			Ch[Node] = -1;
+			Child[Node][0] = NumNodes++;
+			Child[Node][1] = NumNodes++;
+			Stack[StackNum++] = Child[Node][1];
+			Stack[StackNum++] = Child[Node][0];
+		}
+		else
+		{
+			if ( Pos + 8 > NumBits )
+			{
+				appStrcpy( Error, TEXT("UZ: Truncated Huffman table."));
+				return 0;
+			}
+			INT B = 0;
+			for ( INT i=0; i<8; i++)
+				B |= UZ_BIT(Src,Pos+i) << i;
+			Pos += 8;
+			Ch[Node] = B;
+		}
+	}
+
+	// Every symbol takes at least one bit unless there's only one
+	if ( (Total < 0) || ((Ch[0] == -1) ? (Total > NumBits - Pos) : (Total > 0x10000000)) )
+	{
+		appStrcpy( Error, TEXT("UZ: Invalid decompressed size."));
+		return 0;
+	}
+
+	// Walk 8 bits at once where possible
+	INT  FastNode[256];
+	BYTE FastBits[256];
+	for ( INT v=0; v<256; v++)
+	{
+		INT Node = 0;
+		INT Bits = 0;
+		while ( (Ch[Node] == -1) && (Bits < 8) )
+			Node = Child[Node][(v >> Bits++) & 1];
+		FastNode[v] = Node;
+		FastBits[v] = (BYTE)Bits;
+	}
+
+	BYTE* Dest = Out.Reserve( Total);
+	for ( INT i=0; i<Total; i++)
+	{
+		INT Node = 0;
+		if ( Pos + 8 <= NumBits )
+		{
+			INT Shift = Pos & 7;
+			INT v = Src[Pos >> 3] >> Shift;
+			if ( Shift )
+				v |= Src[(Pos >> 3) + 1] << (8 - Shift);
+			v &= 0xFF;
+			Node = FastNode[v];
+			Pos += FastBits[v];
+		}
+		while ( Ch[Node] == -1 )
+		{
+			if ( Pos >= NumBits )
+			{
+				appStrcpy( Error, TEXT("UZ: Truncated Huffman data."));
+				return 0;
+			}
+			Node = Child[Node][UZ_BIT(Src,Pos)];
+			Pos++;
+		}
+		Dest[i] = (BYTE)Ch[Node];
+	}
+	Out.Num += Total;
+	return 1;
+}
+
+//
+// FCodecRLE: a run of UZ_RLE_LEAD equal bytes is followed by the run length
+// State is kept between calls so data can be fed in pieces.
+//
+struct FUzRLEDecoder
+{
+	INT   Count;
+	BYTE  Prev;
+	UBOOL bNeedCount;
+
+	FUzRLEDecoder()
+		: Count(0)
+		, Prev(0)
+		, bNeedCount(0)
+	{}
+
+	UBOOL Decode( const BYTE* Src, INT Num, FUzOutput& Out, TCHAR* Error)
+	{
+		for ( INT i=0; i<Num; i++)
+		{
+			BYTE B = Src[i];
+			if ( bNeedCount )
+			{
+				if ( B < 2 )
+				{
+					appStrcpy( Error, TEXT("UZ: Invalid RLE run."));
+					return 0;
+				}
+				if ( B > UZ_RLE_LEAD )
+				{
+					appMemset( Out.Reserve(B-UZ_RLE_LEAD), Prev, B-UZ_RLE_LEAD);
+					Out.Num += B-UZ_RLE_LEAD;
+				}
+				Count = 0;
+				bNeedCount = 0;
+				continue;
+			}
+			*Out.Reserve(1) = B;
+			Out.Num++;
+			if ( B != Prev )
+			{
+				Prev = B;
+				Count = 1;
+			}
+			else if ( ++Count == UZ_RLE_LEAD )
+				bNeedCount = 1;
+		}
+		return 1;
+	}
+
+	UBOOL Finish( TCHAR* Error)
+	{
+		if ( bNeedCount )
+		{
+			appStrcpy( Error, TEXT("UZ: Truncated RLE run."));
+			return 0;
+		}
+		return 1;
+	}
+};
+
+//
+// FCodecMTF, decoded in place
+//
+struct FUzMTFDecoder
+{
+	BYTE List[256];
+
+	FUzMTFDecoder()
+	{
+		for ( INT i=0; i<256; i++)
+			List[i] = (BYTE)i;
+	}
+
+	void Decode( BYTE* Data, INT Num)
+	{
+		for ( INT i=0; i<Num; i++)
+		{
+			BYTE B = Data[i];
+			BYTE C = List[B];
+			memmove( List + 1, List, B);
+			List[0] = C;
+			Data[i] = C;
+		}
+	}
+};
+
+//
+// FCodecBWT block, Count is the stored length plus one
+//
+static void UzInvertBlock( const BYTE* In, INT Count, INT First, INT Last, BYTE* Out, INT* Temp)
+{
+	INT Counts[257];
+	INT Running[257];
+	appMemzero( Counts, sizeof(Counts));
+	for ( INT i=0; i<Count; i++)
+		Counts[ (i != Last) ? In[i] : 256 ]++;
+	INT Sum = 0;
+	for ( INT i=0; i<257; i++)
+	{
+		Running[i] = Sum;
+		Sum += Counts[i];
+		Counts[i] = 0;
+	}
+	for ( INT i=0; i<Count; i++)
+	{
+		INT Index = (i != Last) ? In[i] : 256;
+		Temp[ Running[Index] + Counts[Index]++ ] = i;
+	}
+	for ( INT i=First, j=0; j<Count-1; i=Temp[i], j++)
+		Out[j] = In[i];
+}
+
+class FUzBlockJob : public FAsyncJob
+{
+public:
+	INT          Index;
+	const BYTE*  In; //Owned by the decoder, which waits for all jobs
+	INT          Count;
+	INT          First;
+	INT          Last;
+	TArray<BYTE> Decoded;
+
+	FUzBlockJob( INT InIndex, const BYTE* InData, INT InCount, INT InFirst, INT InLast)
+		: FAsyncJob( -InIndex)
+		, Index(InIndex)
+		, In(InData)
+		, Count(InCount)
+		, First(InFirst)
+		, Last(InLast)
+		, Decoded(InCount-1)
+	{}
+
+	void Run()
+	{
+		TArray<INT> Temp( Count);
+		UzInvertBlock( In, Count, First, Last, Decoded.GetData(), &Temp(0));
+	}
+};
+
+/*-----------------------------------------------------------------------------
+	Decoder.
+-----------------------------------------------------------------------------*/
+
+//
+// Runs on download workers, no guard blocks
+//
+XC_CORE_API UBOOL UzDecompress( FArchive& Src, FArchive& Dest, TCHAR* Error, INT Threads)
+{
+	Error[0] = '\0';
+	INT Signature = 0;
+	Src << Signature;
+	if ( (Signature != UZ_SIGNATURE) && (Signature != UZ2_SIGNATURE) )
+	{
+		appStrcpy( Error, TEXT("UZ: Unknown signature."));
+		return 0;
+	}
+	FString OrigFilename;
+	Src << OrigFilename;
+
+	INT Size = Src.TotalSize() - Src.Tell();
+	TArray<BYTE> Packed( Max(Size,0) );
+	if ( Size > 0 )
+		Src.Serialize( &Packed(0), Size);
+	if ( Src.IsError() || (Size < 0) )
+	{
+		appStrcpy( Error, TEXT("UZ: Unable to read file."));
+		return 0;
+	}
+
+	FUzOutput Huffman;
+	if ( !UzDecodeHuffman( Packed.GetData(), Size, Huffman, Error) )
+		return 0;
+	Packed.Empty();
+
+	// UZ2 has an extra RLE pass before Huffman
+	FUzOutput Unpacked;
+	FUzOutput* Stage = &Huffman;
+	if ( Signature == UZ2_SIGNATURE )
+	{
+		FUzRLEDecoder RLE;
+		if ( !RLE.Decode( Huffman.Data.GetData(), Huffman.Num, Unpacked, Error) || !RLE.Finish( Error) )
+			return 0;
+		Huffman.Data.Empty();
+		Huffman.Num = 0;
+		Stage = &Unpacked;
+	}
+
+	// MTF runs ahead of the block decoders, final RLE writes blocks in order
+	BYTE* Data = Stage->Data.GetData();
+	INT   Num  = Stage->Num;
+	Threads = Clamp( Threads, 1, 16);
+	FAsyncJobQueue* Queue = (Threads > 1) ? new FAsyncJobQueue( Threads) : nullptr;
+	FAsyncEvent BlockDecoded;
+	if ( Queue )
+		Queue->SetFinishedEvent( &BlockDecoded);
+	FUzMTFDecoder MTF;
+	FUzRLEDecoder RLE;
+	FUzOutput Out;
+	TArray<FUzBlockJob*> Done;
+	INT Pos = 0;
+	INT Submitted = 0;
+	INT Claimed = 0;
+	INT Written = 0;
+	UBOOL Result = 1;
+	while ( Result && ((Pos < Num) || (Written < Submitted)) )
+	{
+		UBOOL bSubmitted = 0;
+		while ( (Pos < Num) && (Submitted - Written < (Queue ? Threads * 2 : 1)) )
+		{
+			INT Length, First, Last;
+			if ( Pos + UZ_BWT_HEADER <= Num )
+			{
+				MTF.Decode( Data + Pos, UZ_BWT_HEADER);
+				appMemcpy( &Length, Data + Pos    , sizeof(INT));
+				appMemcpy( &First , Data + Pos + 4, sizeof(INT));
+				appMemcpy( &Last  , Data + Pos + 8, sizeof(INT));
+				Pos += UZ_BWT_HEADER;
+			}
+			else
+				Length = -1;
+			if ( (Length < 0) || (Length > UZ_BWT_BLOCK) || (First < 0) || (First > Length) || (Last < 0) || (Last > Length) || (Length + 1 > Num - Pos) )
+			{
+				appStrcpy( Error, TEXT("UZ: Invalid BWT block."));
+				Result = 0;
+				break;
+			}
+			MTF.Decode( Data + Pos, Length + 1);
+			FUzBlockJob* Job = new FUzBlockJob( Submitted, Data + Pos, Length + 1, First, Last);
+			Pos += Length + 1;
+			Done.AddItem( nullptr);
+			Submitted++;
+			bSubmitted = 1;
+			if ( Queue )
+				Queue->Add( Job);
+			else
+			{
+				Job->Run();
+				Done(Job->Index) = Job;
+				Claimed++;
+			}
+		}
+
+		if ( Queue )
+		{
+			FUzBlockJob* Job;
+			while ( (Job=(FUzBlockJob*)Queue->GetFinished()) != nullptr )
+			{
+				Done(Job->Index) = Job;
+				Claimed++;
+			}
+		}
+		if ( !Result )
+			break;
+
+		if ( (Written < Submitted) && !Done(Written) )
+		{
+			if ( !bSubmitted )
+				BlockDecoded.Wait( 1.f);
+			continue;
+		}
+		while ( Result && (Written < Submitted) && Done(Written) )
+		{
+			FUzBlockJob* Job = Done(Written);
+			Result = RLE.Decode( Job->Decoded.GetData(), Job->Decoded.Num(), Out, Error);
+			delete Job;
+			Done(Written++) = nullptr;
+		}
+		if ( Out.Num )
+		{
+			Dest.Serialize( Out.Data.GetData(), Out.Num);
+			Out.Num = 0;
+			if ( Dest.IsError() )
+			{
+				appStrcpy( Error, TEXT("UZ: Unable to write decompressed data."));
+				Result = 0;
+			}
+		}
+	}
+
+	// Jobs read from our buffer, wait for the ones still running
+	if ( Queue )
+	{
+		while ( Claimed < Submitted )
+		{
+			FUzBlockJob* Job = (FUzBlockJob*)Queue->GetFinished();
+			if ( !Job )
+			{
+				BlockDecoded.Wait( 1.f);
+				continue;
+			}
+			Done(Job->Index) = Job;
+			Claimed++;
+		}
+		Queue->Release();
+	}
+	for ( INT i=Written; i<Done.Num(); i++)
+		if ( Done(i) )
+			delete Done(i);
+
+	return Result && RLE.Finish( Error);
+}
+
+/*-----------------------------------------------------------------------------
+	UUZBenchmarkCommandlet.
+-----------------------------------------------------------------------------*/
+
+//
+// Reference decoder, same chain UZ files are decoded with in the engine
+//
+static void UzEngineDecompress( FArchive& Src, FArchive& Dest)
+{
+	INT Signature;
+	FString OrigFilename;
+	Src << Signature << OrigFilename;
+	FCodecFull Codec;
+	Codec.AddCodec(new FCodecRLE);
+	Codec.AddCodec(new FCodecBWT);
+	Codec.AddCodec(new FCodecMTF);
+	if ( Signature == UZ2_SIGNATURE )
+		Codec.AddCodec(new FCodecRLE);
+	Codec.AddCodec(new FCodecHuffman);
+	Codec.Decode( Src, Dest);
+}
+
+INT UUZBenchmarkCommandlet::Main( const TCHAR* Parms )
+{
+	FString Wildcard;
+	if( !ParseToken(Parms,Wildcard,0) )
+		appErrorf(TEXT("Source file(s) not specified"));
+	OSpath(Parms);
+	OSpath(*Wildcard);
+
+	INT Threads = 4;
+	TArray<FString> Sources;
+	do
+	{
+		if ( (Wildcard.Len() > 0) && ((*Wildcard)[0] == '-') )
+		{
+			if ( Wildcard.Left(9) == TEXT("-threads=") )
+				Threads = Clamp( appAtoi(*Wildcard + 9), 1, 16);
+			continue;
+		}
+
+		// Directories are searched for .uz files
+		if ( Wildcard.Right(1) == TEXT("/") || Wildcard.Right(1) == TEXT("\\") )
+			Wildcard += TEXT("*.uz");
+		FString Dir;
+		INT i = Max( Wildcard.InStr( TEXT("\\"), 1), Wildcard.InStr( TEXT("/"), 1));
+		if( i != -1 )
+			Dir = Wildcard.Left( i+1);
+		TArray<FString> Files = GFileManager->FindFiles( *Wildcard, 1, 0 );
+		if( !Files.Num() )
+			appErrorf(TEXT("Source %s not found"), *Wildcard);
+		for( INT j=0;j<Files.Num();j++)
+			new(Sources) FString( Dir + Files(j));
+	}
+	while( ParseToken(Parms,Wildcard,0) );
+
+	QWORD TotalIn = 0;
+	QWORD TotalOut = 0;
+	DOUBLE TimeEngine = 0;
+	DOUBLE TimeSingle = 0;
+	DOUBLE TimeThreaded = 0;
+	INT Failed = 0;
+	for ( INT i=0; i<Sources.Num(); i++)
+	{
+		TArray<BYTE> Data;
+		if ( !appLoadFileToArray( Data, *Sources(i)) || (Data.Num() < 4) || ((*(INT*)&Data(0) != UZ_SIGNATURE) && (*(INT*)&Data(0) != UZ2_SIGNATURE)) )
+		{
+			warnf( TEXT("Skipping %s, not a UZ file"), *Sources(i));
+			continue;
+		}
+
+		TArray<BYTE> Reference;
+		FTime StartTime = appSeconds();
+		{
+			FBufferReader Reader( Data);
+			FBufferWriter Writer( Reference);
+			UzEngineDecompress( Reader, Writer);
+		}
+		FLOAT Engine = Max<FLOAT>( appSeconds() - StartTime, 0.0001f);
+
+		FLOAT Native[2];
+		UBOOL bMatch = 1;
+		TCHAR Error[256] = {0};
+		for ( INT Pass=0; Pass<2; Pass++)
+		{
+			TArray<BYTE> Decoded;
+			StartTime = appSeconds();
+			{
+				FBufferReader Reader( Data);
+				FBufferWriter Writer( Decoded);
+				UzDecompress( Reader, Writer, Error, Pass ? Threads : 1);
+			}
+			Native[Pass] = Max<FLOAT>( appSeconds() - StartTime, 0.0001f);
+			bMatch = bMatch && !Error[0] && (Decoded.Num() == Reference.Num())
+				&& (!Decoded.Num() || !appMemcmp( &Decoded(0), &Reference(0), Decoded.Num()));
+		}
+
+		if ( !bMatch )
+		{
+			warnf( TEXT("MISMATCH %s %s"), *Sources(i), Error);
+			Failed++;
+			continue;
+		}
+		TotalIn += (QWORD)Data.Num();
+		TotalOut += (QWORD)Reference.Num();
+		TimeEngine += Engine;
+		TimeSingle += Native[0];
+		TimeThreaded += Native[1];
+		warnf( TEXT("%s: %i KB -> %i KB - FCodecFull %.3fs - Native %.3fs (1 thread) %.3fs (%i threads)")
+			, *Sources(i), Data.Num() / 1024, Reference.Num() / 1024, Engine, Native[0], Native[1], Threads);
+	}
+
+	DOUBLE MegsOut = (DOUBLE)TotalOut / (1024.0 * 1024.0);
+	warnf( TEXT("Decoded %.2f MB from %.2f MB, %i mismatched"), MegsOut, (DOUBLE)TotalIn / (1024.0 * 1024.0), Failed);
+	warnf( TEXT("FCodecFull: %.2f MB/s - Native: %.2f MB/s (1 thread) %.2f MB/s (%i threads)")
+		, MegsOut / Max(TimeEngine,0.0001), MegsOut / Max(TimeSingle,0.0001), MegsOut / Max(TimeThreaded,0.0001), Threads);
+	return Failed ? 1 : 0;
+}
+IMPLEMENT_CLASS(UUZBenchmarkCommandlet)
+
+/*-----------------------------------------------------------------------------
+	The End.
+-----------------------------------------------------------------------------*/